@@ -1,71 +1,923 @@
 #include "../source/log.hpp"
 #include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <cctype>
+#include <ctime>
+#include <sys/resource.h>
 
-// 参数:日志器名称,线程数,信息数,每条信息的大小
-void bench(const std::string &name, size_t thread_cnt, size_t msg_cnt, size_t msg_size)
+// 延迟基准测试:统计每次调用的延迟分布,而不只是总耗时
+// 生产者延迟:一次日志调用从进入到返回的时间
+// 端到端延迟:从调用开始到该条日志被落地方式写出(sink->log()返回)的时间
+// 用法: ./bench [-n 每轮条数] [-t 线程数列表] [-s 消息大小列表] [-m 模式列表] [-k 落地方式列表] [-o 结果文件]
+//      列表用逗号分隔,例如 -t 1,2,4 -m sync,safe,unsafe,lockfree -k stdout,file,roll,idx,fd,uring,fdsync,mmap
+//      模式slow/workers额外挂一个慢的落地方式,对比共用后台线程与每个落地方式独立输出线程,不在默认列表中
+//      模式shared挂在进程默认的共享后台上,不创建自己的线程
+//      模式dropnew/droplevel/timeout同样挂慢的落地方式,缓冲区写满后分别丢弃新日志/按等级丢弃/阻塞1ms后丢弃,看生产者延迟和丢弃条数
+//      -b 缓冲区个数 -z 每个缓冲区大小(KB) -g 1(使用大页) 设置异步日志器的缓冲区池,默认2个10MB
+//      -r 无锁模式下每个生产者线程的环大小(KB),向上取整到2的整数次幂,默认4MB
+//      -f 刷新阈值(KB) -l 最大延迟(ms) 设置异步日志器的批量刷新,默认有数据就立即处理
+// 结果以csv格式追加写入结果文件(默认bench.csv),人可读的汇总输出到标准错误
+// 测试stdout落地方式时日志会写到标准输出,建议运行 ./bench > /dev/null
+
+#define BENCH_DIR "./bench_logs/"           // 测试时日志文件的存放目录,每轮结束后删除
+#define ROLL_SIZE 16 * 1024 * 1024          // 滚动文件的大小
+#define TS_WIDTH 20                         // 消息末尾时间戳的宽度
+#define WAIT_TIMEOUT 60                     // 等待所有日志落地的最长时间,秒
+
+// 单调时钟,纳秒
+uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// 进程的上下文切换次数(主动+被动)
+long ContextSwitches()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+// 一组延迟样本的统计结果
+struct Stats
 {
-    wcm::Logger::ptr logger = wcm::LoggerManager::GetInstancce().GetLogger(name); // 获取指定日志器
-    assert(logger.get());                                              // 判断是否成功获得日志器
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+    uint64_t max = 0;
+};
 
-    printf("测试信息:\n[线程个数:%d,日志条数:%d,每条大小:%d字节,总大小:%dMB]\n\n测试开始:\n\n",thread_cnt, msg_cnt, msg_size, msg_cnt * msg_size / 1024 / 1024);
-    std::vector<std::thread> threads;   // 管理线程
-    size_t cnt = msg_cnt / thread_cnt;  // 每个线程要输出的日志条数
-    double max_cost = 0.0;              // 记录各线程中的最大花销
-    std::string msg(msg_size - 1, 'S'); // 组织日志有效载荷,留一个位置保存换行
-    for (int i = 0; i < thread_cnt; ++i)
+Stats Percentiles(std::vector<uint64_t> &samples)
+{
+    Stats st;
+    if (samples.empty())
+    {
+        return st;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double q) { return samples[std::min(samples.size() - 1, (size_t)(q * samples.size()))]; };
+    st.p50 = at(0.50);
+    st.p99 = at(0.99);
+    st.p999 = at(0.999);
+    st.max = samples.back();
+    return st;
+}
+
+// 包装真正的落地方式,写出后从每行末尾取出生产者写入的时间戳,记录端到端延迟
+// 异步模式只有后台线程调用,同步模式在日志器的锁内调用,都不需要额外加锁
+class ProbeSink : public wcm::Sink
+{
+public:
+    ProbeSink(wcm::Sink::ptr sink, size_t expect)
+        : _sink(sink), _lines(0), _batches(0), _bytes(0)
     {
-        threads.emplace_back([&, i](){
-            auto begin = std::chrono::high_resolution_clock::now(); // 记录开始执行时间
-            for (int j = 0; j < cnt; ++j)
+        _samples.reserve(expect);
+    }
+
+    void log(const char *data, size_t len) override
+    {
+        _sink->log(data, len);
+        Count(data, len);
+    }
+
+    // 转发日志器的统计,包装按等级刷盘或建立索引的落地方式时行为不变
+    void logbatch(const char *data, size_t len, const wcm::BatchInfo &info) override
+    {
+        _sink->logbatch(data, len, info);
+        Count(data, len);
+    }
+
+    // 包装二进制落地方式时日志器交来的是记录,时间戳是最后一个参数,在记录体末尾
+    bool Binary() const override
+    {
+        return _sink->Binary();
+    }
+
+    void logrecords(const std::string &logger, const std::string &pattern, const char *data, size_t len) override
+    {
+        _sink->logrecords(logger, pattern, data, len);
+        _batches++;
+        _bytes += len;
+        uint64_t now = NowNs();
+        size_t cnt = 0;
+        for (size_t pos = 0; pos + sizeof(wcm::RecordHead) <= len;)
+        {
+            wcm::RecordHead head;
+            memcpy(&head, data + pos, sizeof(head));
+            const char *end = data + pos + head.size;
+            pos += head.size;
+            if (head.type == wcm::RecordType::DEFERRED && head.size >= sizeof(head) + 9 && end[-9] == wcm::TAG_UINT)
             {
-                logger->fatal("%s", msg.c_str());
+                uint64_t ts;
+                memcpy(&ts, end - 8, sizeof(ts));
+                _samples.push_back(now - ts);
+                ++cnt;
+            }
+        }
+        _lines.fetch_add(cnt, std::memory_order_release);
+    }
+
+    size_t Lines()
+    {
+        return _lines.load(std::memory_order_acquire);
+    }
+
+    std::vector<uint64_t> &Samples()
+    {
+        return _samples;
+    }
+
+    // 落地方式被调用的次数,即写出的批数
+    size_t Batches()
+    {
+        return _batches;
+    }
+
+    // 释放真正的落地方式,让它关闭文件
+    void Close()
+    {
+        _sink.reset();
+    }
+
+    // 交给落地方式的字节数(压缩前)
+    size_t Bytes()
+    {
+        return _bytes;
+    }
+
+private:
+    // 统计一批文本中带时间戳的行,记下端到端延迟
+    void Count(const char *data, size_t len)
+    {
+        _batches++;
+        _bytes += len;
+        uint64_t now = NowNs();
+        const char *end = data + len;
+        size_t cnt = 0;
+        for (const char *p = data; p < end;)
+        {
+            const char *nl = (const char *)memchr(p, '\n', end - p);
+            if (nl == nullptr)
+            {
+                break;
+            }
+            if (nl - p >= TS_WIDTH && isdigit(nl[-1])) // 日志器自己插入的记录(如丢弃统计)不带时间戳,不计数
+            {
+                uint64_t ts = 0;
+                for (const char *d = nl - TS_WIDTH; d < nl; ++d)
+                {
+                    ts = ts * 10 + (*d - '0');
+                }
+                _samples.push_back(now - ts);
+                ++cnt;
+            }
+            p = nl + 1;
+        }
+        _lines.fetch_add(cnt, std::memory_order_release);
+    }
+
+    wcm::Sink::ptr _sink;
+    std::vector<uint64_t> _samples;
+    std::atomic<size_t> _lines;
+    size_t _batches;
+    size_t _bytes;
+};
+
+// 模拟很慢的落地方式(比如被管道阻塞的终端),每批数据耗时10ms
+class SlowSink : public wcm::Sink
+{
+public:
+    void log(const char *data, size_t len) override
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+};
+
+// 只统计写出的行数,不落地,用于只关心调用端开销的测试
+class CountSink : public wcm::Sink
+{
+public:
+    void log(const char *data, size_t len) override
+    {
+        _lines += std::count(data, data + len, '\n');
+    }
+
+    size_t Lines()
+    {
+        return _lines;
+    }
+
+private:
+    size_t _lines = 0;
+};
+
+// 一轮测试的参数
+struct Case
+{
+    std::string mode; // sync / safe / unsafe / lockfree / slow / workers / shared / dropnew / droplevel / timeout
+    std::string sink; // stdout / file / roll / lz4 / fd / uring / fdsync / mmap / bin
+    size_t threads;
+    size_t size; // 每条有效载荷的字节数,含末尾时间戳
+    size_t msgs; // 总条数
+    wcm::BufferConfig buffers; // 异步日志器的缓冲区池
+    wcm::FlushConfig flush;    // 异步日志器的批量刷新条件
+};
+
+wcm::Sink::ptr MakeSink(const std::string &kind)
+{
+    if (kind == "stdout")
+    {
+        return wcm::SinkFactory::CreateSink<wcm::StdoutSink>();
+    }
+    if (kind == "file")
+    {
+        return wcm::SinkFactory::CreateSink<wcm::FileSink>(std::string(BENCH_DIR "bench.log"));
+    }
+    if (kind == "fd")
+    {
+        return wcm::SinkFactory::CreateSink<wcm::FdSink>(std::string(BENCH_DIR "bench.log"));
+    }
+    if (kind == "uring")
+    {
+        return wcm::SinkFactory::CreateSink<wcm::FdSink>(std::string(BENCH_DIR "bench.log"), wcm::SyncPolicy(), true);
+    }
+    if (kind == "mmap")
+    {
+        return wcm::SinkFactory::CreateSink<wcm::MmapFileSink>(std::string(BENCH_DIR "mmap-"), (size_t)ROLL_SIZE);
+    }
+    if (kind == "bin") // 二进制日志,后台线程不格式化
+    {
+        return wcm::SinkFactory::CreateSink<wcm::BinFileSink>(std::string(BENCH_DIR "bench.bin"));
+    }
+    if (kind == "lz4") // 滚动文件,LZ4流式压缩
+    {
+        return wcm::SinkFactory::CreateSink<wcm::RollFileSink>(std::string(BENCH_DIR "lz4-"), (size_t)ROLL_SIZE, 0, true);
+    }
+    if (kind == "idx") // 滚动文件,同时写时间/等级索引
+    {
+        return wcm::SinkFactory::CreateSink<wcm::RollFileSink>(std::string(BENCH_DIR "idx-"), (size_t)ROLL_SIZE, 0, false, true);
+    }
+    if (kind == "fdsync") // 有ERROR及以上的日志或每写1MB刷一次盘
+    {
+        wcm::SyncPolicy policy;
+        policy.bytes = 1024 * 1024;
+        policy.level = wcm::levels::ERROR;
+        return wcm::SinkFactory::CreateSink<wcm::FdSink>(std::string(BENCH_DIR "bench.log"), policy);
+    }
+    return wcm::SinkFactory::CreateSink<wcm::RollFileSink>(std::string(BENCH_DIR "roll-"), (size_t)ROLL_SIZE);
+}
+
+// 异步日志器因缓冲区满丢弃的条数
+size_t Dropped(const wcm::Logger::ptr &logger)
+{
+    auto async = std::dynamic_pointer_cast<wcm::AsyncLogger>(logger);
+    return async ? async->Dropped() : 0;
+}
+
+// 测试目录中文件的总大小
+size_t DiskBytes()
+{
+    size_t total = 0;
+    for (auto &e : std::filesystem::directory_iterator(BENCH_DIR))
+    {
+        total += e.file_size();
+    }
+    return total;
+}
+
+// 运行一轮测试,结果追加到csv
+void Run(const Case &c, std::ostream &csv)
+{
+    size_t per_thread = c.msgs / c.threads;
+    size_t total = per_thread * c.threads;
+    auto probe = std::make_shared<ProbeSink>(MakeSink(c.sink), total);
+
+    std::unique_ptr<wcm::LocalLoggerBuilder> builder(new wcm::LocalLoggerBuilder());
+    builder->BuildName("bench_logger");
+    builder->BuildLevel(wcm::levels::DEBUG);
+    builder->BuildSink(probe);
+    if (c.mode == "slow" || c.mode == "workers" || c.mode == "dropnew" || c.mode == "droplevel" || c.mode == "timeout")
+    {
+        // 再加一个慢的落地方式,看它对被测落地方式的影响;workers模式下每个落地方式有自己的输出线程
+        builder->BuildSink<SlowSink>();
+        if (c.mode == "workers")
+            builder->BuildSinkWorkers();
+        else if (c.mode == "dropnew")
+            builder->BuildOverflow(wcm::OverflowPolicy::DROP_NEWEST);
+        else if (c.mode == "droplevel")
+            builder->BuildOverflow(wcm::OverflowPolicy::DROP_BY_LEVEL);
+        else if (c.mode == "timeout")
+            builder->BuildOverflow(wcm::OverflowPolicy::BLOCK_TIMEOUT, 1);
+    }
+    if (c.mode == "sync")
+    {
+        builder->BuildType(wcm::LoggerType::Sync);
+    }
+    else
+    {
+        builder->BuildType(wcm::LoggerType::Async);
+        builder->BuildBuffers(c.buffers.count, c.buffers.size, c.buffers.huge);
+        builder->BuildFlush(c.flush.bytes, c.flush.latency);
+        if (c.mode == "unsafe")
+            builder->BuildUnSafe();
+        else if (c.mode == "shared")
+            builder->BuildBackend();
+        else if (c.mode == "lockfree")
+            builder->BuildLockFree(c.buffers.ring);
+    }
+    wcm::Logger::ptr logger = builder->Build();
+
+    // 有效载荷: 填充字符 + 空格 + 20位时间戳
+    std::string pad(c.size > TS_WIDTH + 1 ? c.size - TS_WIDTH - 1 : 0, 'S');
+    std::vector<std::vector<uint64_t>> samples(c.threads);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < c.threads; ++i)
+    {
+        samples[i].reserve(per_thread);
+        threads.emplace_back([&, i]() {
+            std::vector<uint64_t> &mine = samples[i]; // 每个线程只写自己的样本数组
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield(); // 所有线程一起开始
+            }
+            for (size_t j = 0; j < per_thread; ++j)
+            {
+                uint64_t begin = NowNs();
+                logger->info("%s %020lu", pad.c_str(), (unsigned long)begin);
+                mine.push_back(NowNs() - begin);
             }
-            auto end = std::chrono::high_resolution_clock::now(); // 记录结束执行时间
-            std::chrono::duration<double> diff = end - begin; //计算执行间隔时间
-            max_cost = max_cost > diff.count() ? max_cost : diff.count(); //更新最大时间
-            std::cout << "线程" << i << "耗时:" << diff.count() << "s,共输出" << cnt << "条" << std::endl;
         });
     }
 
-    //等待线程
-    for(auto& e : threads)
+    long csw = ContextSwitches();
+    uint64_t begin = NowNs();
+    go.store(true, std::memory_order_release);
+    for (auto &e : threads)
     {
         e.join();
     }
+    uint64_t produced = NowNs();
+    // 等待所有日志落地(或被丢弃),作为端到端的总耗时
+    while (probe->Lines() + Dropped(logger) < total && NowNs() - begin < WAIT_TIMEOUT * 1000000000ul)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    uint64_t flushed = NowNs();
+    size_t lines = probe->Lines();
+    size_t dropped = Dropped(logger);
+    csw = ContextSwitches() - csw;
+    logger.reset(); // 异步日志器在析构时停止后台线程
+    probe->Close();  // 关闭文件,压缩文件写出帧结束标记
+
+    std::vector<uint64_t> prod;
+    prod.reserve(total);
+    for (auto &v : samples)
+    {
+        prod.insert(prod.end(), v.begin(), v.end());
+    }
+    Stats ps = Percentiles(prod);
+    Stats es = Percentiles(probe->Samples());
+    double secs = (flushed - begin) / 1e9;
+    char ratio[64] = "";
+    if (c.sink == "lz4")
+    {
+        snprintf(ratio, sizeof(ratio), " 压缩率 %.2f", (double)probe->Bytes() / std::max<size_t>(DiskBytes(), 1));
+    }
+
+    csv << c.mode << ',' << c.sink << ',' << c.threads << ',' << c.size << ',' << total << ',' << lines << ','
+        << (produced - begin) / 1e9 << ',' << secs << ',' << (size_t)(lines / secs) << ','
+        << ps.p50 << ',' << ps.p99 << ',' << ps.p999 << ',' << ps.max << ','
+        << es.p50 << ',' << es.p99 << ',' << es.p999 << ',' << es.max << ',' << dropped << ',' << probe->Batches() << ',' << csw << std::endl;
 
-    std::cout << "\n总耗时:" << max_cost << "s" << std::endl;
-    std::cout << "每秒输出:" << msg_cnt / max_cost << "条" << std::endl;
-    std::cout << "每秒输出大小:" << ((msg_cnt / max_cost) * msg_size) / 1024 / 1024 << "MB" << std::endl;
+    fprintf(stderr, "%-8s %-6s %3zu线程 %5zuB %9.0f条/s | 生产者 p50 %7lu p99 %8lu p99.9 %9lu max %10lu | 端到端 p50 %9lu p99 %10lu p99.9 %10lu max %10lu 丢弃 %zu 批数 %zu 切换 %ld%s%s\n",
+            c.mode.c_str(), c.sink.c_str(), c.threads, c.size, lines / secs,
+            ps.p50, ps.p99, ps.p999, ps.max, es.p50, es.p99, es.p999, es.max, dropped, probe->Batches(), csw, ratio,
+            lines + dropped < total ? " (超时,有日志未落地)" : "");
+
+    std::filesystem::remove_all(BENCH_DIR);
 }
 
-void SyncTest()
+// 热循环:每次迭代做一点计算,带或不带几条关闭等级的日志语句
+// 日志接口只在调用点内联等级判断,格式化和入队代码在不内联的冷函数中,循环体不会因为日志语句膨胀
+__attribute__((noinline)) double HotLoop(wcm::Logger *l, const std::vector<double> &v, bool log)
 {
-    std::unique_ptr<wcm::GlobalLoggerBuilder> builder(new wcm::GlobalLoggerBuilder());
-    builder->BuildName("sync_logger");
-    builder->BuildLevel(wcm::levels::DEBUG);
-    builder->BuildSink<wcm::FileSink>("./logfile.log");
-    builder->BuildType(wcm::LoggerType::Sync);
-    builder->Build();
+    double sum = 0;
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        sum += v[i] * v[i];
+        if (!log)
+            continue;
+        l->debug("i=%zu v=%f sum=%f", i, v[i], sum);
+        if (v[i] < 0)
+            l->debug("负数 %f 位置 %zu", v[i], i);
+        l->debug("进度 %zu/%zu", i, v.size());
+        l->debug("sum=%f", sum, wcm::kv("i", i));
+    }
+    return sum;
+}
+
+// 等级被关闭时每条日志语句的开销:旧写法每次都要加锁拷贝shared_ptr并对参数求值,宏只做一次原子读
+void DisabledTest()
+{
+    const size_t cnt = 10000000;
+    wcm::RootPtr()->SetLevel(wcm::levels::INFO);
+    std::string msg(100, 'S');
+    size_t evals = 0; // 参数求值次数
+    auto arg = [&]() { ++evals; return msg.c_str(); };
+
+    uint64_t begin = NowNs();
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        wcm::RootLogger()->debug("%s", arg());
+    }
+    uint64_t end = NowNs();
+    fprintf(stderr, "关闭等级 RootLogger()->debug: %.2fns/条, 参数求值%zu次\n", (double)(end - begin) / cnt, evals);
 
-    bench("sync_logger", 3, 1000000, 100);
+    evals = 0;
+    begin = NowNs();
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        DEBUG("%s", arg());
+    }
+    end = NowNs();
+    fprintf(stderr, "关闭等级 DEBUG: %.2fns/条, 参数求值%zu次\n", (double)(end - begin) / cnt, evals);
+
+    // 直接调用日志器的类型安全接口,放在热循环中,与不打日志的同一个循环比较每次迭代的耗时
+    std::vector<double> v(1000);
+    for (size_t i = 0; i < v.size(); ++i)
+        v[i] = i * 0.5;
+    double sum = 0;
+    for (bool log : {false, true})
+    {
+        begin = NowNs();
+        for (size_t i = 0; i < cnt / v.size(); ++i)
+            sum += HotLoop(wcm::RootPtr(), v, log);
+        end = NowNs();
+        fprintf(stderr, "热循环%s: %.2fns/次迭代\n", log ? "(4条关闭的日志语句)" : "(不打日志)", (double)(end - begin) / cnt);
+    }
+    if (sum < 0)
+        fprintf(stderr, "%f\n", sum); // 使用结果,防止循环被优化掉
+    wcm::RootPtr()->SetLevel(wcm::levels::DEBUG);
 }
 
-void AsyncTest()
+// 同一个调用点反复打同一条ERROR日志(比如重试循环)时,不限流与各种调用点限流方式的每条开销和实际写出行数
+void SuppressTest()
 {
-    std::unique_ptr<wcm::GlobalLoggerBuilder> builder(new wcm::GlobalLoggerBuilder());
-    builder->BuildName("async_logger");
-    builder->BuildLevel(wcm::levels::DEBUG);
-    builder->BuildSink<wcm::FileSink>("./logfile.log");
-    builder->BuildType(wcm::LoggerType::Async);
-    builder->BuildUnSafe();
-    builder->Build();
+    const size_t cnt = 1000000;
+    auto sink = std::make_shared<CountSink>();
+    wcm::LocalLoggerBuilder builder;
+    builder.BuildName("bench_limit");
+    builder.BuildType(wcm::LoggerType::Sync);
+    builder.BuildSink(sink);
+    wcm::Logger::ptr logger = builder.Build();
+    wcm::Logger *l = logger.get();
+    std::string msg(100, 'S');
+    auto run = [&](const char *what, const std::function<void(size_t)> &call) {
+        size_t before = sink->Lines();
+        uint64_t begin = NowNs();
+        for (size_t i = 0; i < cnt; ++i)
+        {
+            call(i);
+        }
+        uint64_t end = NowNs();
+        fprintf(stderr, "调用点限流 %-24s %.2fns/条, 写出%zu行\n", what, (double)(end - begin) / cnt, sink->Lines() - before);
+    };
+    run("不限流", [&](size_t) { l->error("连接失败: %s", msg); });
+    run("LOG_RATE(100/s,突发10)", [&](size_t) { LOG_RATE(l, ERROR, 100, 10, "连接失败: %s", msg); });
+    run("LOG_EVERY_N(1000)", [&](size_t) { LOG_EVERY_N(l, ERROR, 1000, "连接失败: %s", msg); });
+    run("LOG_DEDUP", [&](size_t) { LOG_DEDUP(l, ERROR, "连接失败: %s", msg); });
 
-    bench("async_logger", 3, 5000000, 100);
+    // LOG_DEDUP按输出的值比较:%s比较内容,%p比较指针;没报告的重复次数在日志器析构时补报
+    auto dedup = std::make_shared<CountSink>();
+    builder.BuildName("bench_dedup");
+    builder.BuildSink(dedup);
+    wcm::Logger::ptr dl = builder.Build();
+    char a[] = "same", b[] = "same";
+    for (size_t i = 0; i < 10; ++i)
+    {
+        LOG_DEDUP(dl.get(), ERROR, "%s %Lf", i % 2 ? a : b, (long double)1.5);
+    }
+    size_t str_lines = dedup->Lines();
+    for (size_t i = 0; i < 10; ++i)
+    {
+        LOG_DEDUP(dl.get(), ERROR, "%p", (void *)(i % 2 ? a : b));
+    }
+    size_t ptr_lines = dedup->Lines() - str_lines;
+    for (size_t i = 0; i < 5; ++i)
+    {
+        LOG_DEDUP(dl.get(), ERROR, "退出前一直重复");
+    }
+    dl.reset();
+    fprintf(stderr, "LOG_DEDUP: 内容相同的%%s写出%zu行, 交替的%%p写出%zu行, 析构时共%zu行, %s\n", str_lines, ptr_lines, dedup->Lines(),
+            str_lines == 1 && ptr_lines == 10 && dedup->Lines() == 14 ? "通过" : "失败");
+}
+
+// 内置LZ4流式压缩器本身的速度和压缩率:用接近真实日志的文本(变化的时间,行号,id),按不同的批大小压缩并解压校验
+// 同步日志器每条日志是一批,异步日志器一批通常有几十KB
+void CompressTest()
+{
+    std::string text;
+    const char *msgs[] = {"连接建立 peer=10.0.%u.%u:%u", "请求完成 id=%u 耗时=%uus 状态=%u", "缓存未命中 key=user:%u:%u:%u"};
+    for (unsigned i = 0; text.size() < 32 * 1024 * 1024; ++i)
+    {
+        char line[256];
+        int n = snprintf(line, sizeof(line), "[root][12:%02u:%02u][INFO][server.cpp:%u][1402%u] ", i / 60000 % 60, i / 1000 % 60, 100 + i % 37 * 13, i % 4);
+        n += snprintf(line + n, sizeof(line) - n, msgs[i % 3], i * 2654435761u % 1000, i % 256, i * 7919 % 100000);
+        line[n++] = '\n';
+        text.append(line, n);
+    }
+    for (size_t batch : {(size_t)100, (size_t)4096, (size_t)65536})
+    {
+        wcm::Lz4Stream lz4;
+        std::string out;
+        out.reserve(text.size());
+        lz4.Begin(out);
+        uint64_t begin = NowNs();
+        for (size_t off = 0; off < text.size(); off += batch)
+        {
+            lz4.Compress(text.data() + off, std::min(batch, text.size() - off), out);
+        }
+        uint64_t end = NowNs();
+        lz4.End(out);
+        std::string back;
+        uint64_t dbegin = NowNs();
+        wcm::Lz4Scan scan = wcm::Lz4Decode(out.data(), out.size(), back);
+        uint64_t dend = NowNs();
+        fprintf(stderr, "LZ4 每批%6zuB: 压缩 %.0fMB/s, 解压 %.0fMB/s, 压缩率 %.2f, 校验%s\n", batch,
+                text.size() / ((end - begin) / 1e3), text.size() / ((dend - dbegin) / 1e3),
+                (double)text.size() / out.size(), back == text && !scan.error && !scan.open ? "通过" : "失败");
+    }
 }
 
-int main()
+// 二进制日志与文本日志的对比:同一批接近真实的日志分别交给文本文件和二进制文件,比较每条的编码写出开销和文件大小,
+// 最后用BinDecoder把二进制文件还原,检查与文本文件逐字节相同
+void BinaryTest()
 {
-    //SyncTest();
-    AsyncTest();
+    const size_t cnt = 500000;
+    auto make = [](const char *name, const wcm::Sink::ptr &sink) {
+        wcm::LocalLoggerBuilder builder;
+        builder.BuildName(name);
+        builder.BuildType(wcm::LoggerType::Sync);
+        builder.BuildSink(sink);
+        return builder.Build();
+    };
+    auto run = [&](const wcm::Logger::ptr &logger) {
+        uint64_t begin = NowNs();
+        for (size_t i = 0; i < cnt; ++i)
+        {
+            logger->info("请求完成 id=%zu 耗时=%uus 状态=%d", i, (unsigned)(i * 2654435761u % 5000), 200);
+            if (i % 4 == 0)
+                logger->warn("缓存未命中 key=user:%zu 重试=%d", i * 7919 % 100000, (int)(i % 3));
+        }
+        return (double)(NowNs() - begin) / (cnt + cnt / 4);
+    };
+    std::filesystem::create_directories(BENCH_DIR);
+    double text_ns = run(make("bench_text", wcm::SinkFactory::CreateSink<wcm::FdSink>(std::string(BENCH_DIR "text.log"))));
+    double bin_ns = run(make("bench_bin", wcm::SinkFactory::CreateSink<wcm::BinFileSink>(std::string(BENCH_DIR "bin.bin"))));
+    size_t text_size = std::filesystem::file_size(BENCH_DIR "text.log");
+    size_t bin_size = std::filesystem::file_size(BENCH_DIR "bin.bin");
+
+    // 同一个日志器同时挂两种落地方式,解码结果必须与文本逐字节相同
+    {
+        wcm::LocalLoggerBuilder builder;
+        builder.BuildName("bench_both");
+        builder.BuildSink<wcm::FdSink>(std::string(BENCH_DIR "both.log"));
+        builder.BuildSink<wcm::BinFileSink>(std::string(BENCH_DIR "both.bin"));
+        wcm::Logger::ptr logger = builder.Build();
+        for (size_t i = 0; i < 10000; ++i)
+            logger->error("连接 %s:%d 失败 %.2fs 后重试, %p", "10.0.0.1", (int)i, i * 0.01, (void *)logger.get());
+    }
+    std::ifstream text_ifs(BENCH_DIR "both.log"), bin_ifs(BENCH_DIR "both.bin");
+    std::string text((std::istreambuf_iterator<char>(text_ifs)), std::istreambuf_iterator<char>());
+    std::string bin((std::istreambuf_iterator<char>(bin_ifs)), std::istreambuf_iterator<char>());
+    std::string decoded;
+    wcm::BinDecoder decoder;
+    const char *p = bin.data(), *end = bin.data() + bin.size();
+    while (p < end && decoder.Next(p, end, decoded))
+    {
+    }
+
+    fprintf(stderr, "二进制日志: 文本 %.0fns/条 %zuB, 二进制 %.0fns/条 %zuB, 大小 1/%.1f, 解码%s\n", text_ns, text_size, bin_ns, bin_size,
+            (double)text_size / bin_size, p == end && decoded == text ? "与文本一致" : "不一致");
+    std::filesystem::remove_all(BENCH_DIR);
+}
+
+// 旁路索引:同样的日志写带索引和不带索引的文件,比较每条的耗时和索引的大小;
+// 再找出其中的ERROR,比较从头扫描整个文件与按索引只读匹配段的耗时(文件都在页缓存中,只比较读取和查找的量)
+void IndexTest()
+{
+    const size_t cnt = 1000000;
+    std::filesystem::create_directories(BENCH_DIR);
+    auto write = [&](const char *name, bool index) {
+        wcm::LocalLoggerBuilder builder;
+        builder.BuildName(name);
+        builder.BuildType(wcm::LoggerType::Async);
+        builder.BuildSink<wcm::FileSink>(std::string(BENCH_DIR) + name + ".log", index);
+        wcm::Logger::ptr logger = builder.Build();
+        uint64_t begin = NowNs();
+        for (size_t i = 0; i < cnt; ++i)
+        {
+            if (i % 10000 == 0)
+                logger->error("连接 10.0.0.%zu 失败, 重试=%zu", i % 256, i);
+            else
+                logger->info("请求完成 id=%zu 耗时=%uus 状态=%d", i, (unsigned)(i * 2654435761u % 5000), 200);
+        }
+        logger.reset(); // 等后台线程写完
+        return (double)(NowNs() - begin) / cnt;
+    };
+    double plain_ns = 1e18, index_ns = 1e18; // 单核上后台线程与调用线程互相干扰,交替跑三轮取最好的一次
+    for (int r = 0; r < 3; ++r)
+    {
+        std::filesystem::remove_all(BENCH_DIR);
+        plain_ns = std::min(plain_ns, write("plain", false));
+        index_ns = std::min(index_ns, write("indexed", true));
+    }
+    std::string path = BENCH_DIR "indexed.log";
+    size_t size = std::filesystem::file_size(path);
+    size_t index_size = std::filesystem::file_size(path + INDEX_SUFFIX);
+
+    auto count = [](const std::string &text) {
+        size_t n = 0;
+        for (size_t pos = 0; (pos = text.find("[ERROR]", pos)) != std::string::npos; ++pos)
+            ++n;
+        return n;
+    };
+    uint64_t begin = NowNs();
+    std::ifstream ifs(path, std::ios::binary);
+    std::string all((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    size_t scan_cnt = count(all);
+    uint64_t scan_ns = NowNs() - begin;
+
+    begin = NowNs();
+    std::vector<wcm::IndexEntry> entries;
+    wcm::LoadIndex(path, size, entries);
+    std::vector<wcm::IndexRange> ranges = wcm::QueryIndex(entries, size, INT64_MIN, INT64_MAX, ~((1u << wcm::levels::ERROR) - 1));
+    std::string hits;
+    int fd = open(path.c_str(), O_RDONLY);
+    for (const auto &r : ranges)
+    {
+        size_t old = hits.size();
+        hits.resize(old + r.len);
+        pread(fd, &hits[old], r.len, r.offset);
+    }
+    close(fd);
+    size_t index_cnt = count(hits);
+    uint64_t query_ns = NowNs() - begin;
+
+    fprintf(stderr, "旁路索引: 写入 无索引 %.0fns/条, 有索引 %.0fns/条, 索引 %zuB(日志的%.3f%%) | 查ERROR 扫描 %.2fms 读%zuB, 索引 %.2fms 读%zuB, 结果%s\n",
+            plain_ns, index_ns, index_size, 100.0 * index_size / size, scan_ns / 1e6, all.size(), query_ns / 1e6, hits.size(),
+            scan_cnt == index_cnt ? "一致" : "不一致");
+    std::filesystem::remove_all(BENCH_DIR);
+}
+
+// 只设最大延迟的批量刷新(BuildFlush(0, latency)):每条日志落地的延迟不超过latency,同时确实攒成了批
+class DelaySink : public wcm::Sink
+{
+public:
+    DelaySink(const std::vector<uint64_t> &sent)
+        : _sent(sent), _lines(0), _batches(0), _max(0)
+    {
+    }
+
+    void log(const char *data, size_t len) override
+    {
+        uint64_t now = NowNs();
+        size_t n = std::count(data, data + len, '\n');
+        for (size_t i = 0; i < n; ++i, ++_lines)
+        {
+            _max = std::max(_max, now - _sent[_lines]);
+        }
+        _batches++;
+    }
+
+    const std::vector<uint64_t> &_sent;
+    size_t _lines, _batches;
+    uint64_t _max; // 最大落地延迟,纳秒
+};
+
+void FlushLatencyTest()
+{
+    const size_t cnt = 200, latency = 20;
+    for (const char *mode : {"safe", "lockfree"})
+    {
+        std::vector<uint64_t> sent(cnt);
+        auto sink = std::make_shared<DelaySink>(sent);
+        wcm::LocalLoggerBuilder builder;
+        builder.BuildName(std::string("bench_latency_") + mode);
+        builder.BuildType(wcm::LoggerType::Async);
+        builder.BuildSink(sink);
+        if (strcmp(mode, "lockfree") == 0)
+            builder.BuildLockFree();
+        builder.BuildFlush(0, latency);
+        wcm::Logger::ptr logger = builder.Build();
+        for (size_t i = 0; i < cnt; ++i)
+        {
+            sent[i] = NowNs();
+            logger->info("第%zu条", i);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        logger.reset();
+        bool ok = sink->_lines == cnt && sink->_max < (latency + 10) * 1000000ul && sink->_batches < cnt / 4;
+        fprintf(stderr, "BuildFlush(0, %zums) %-8s 每1ms一条: %zu条分%zu批落地, 最大延迟%.1fms, %s\n", latency, mode, sink->_lines,
+                sink->_batches, sink->_max / 1e6, ok ? "通过" : "失败");
+    }
+}
+
+// FATAL同步落地:异步日志器配置成攒1秒才写一批,写入一批INFO后打一条FATAL,看fatal()本身的耗时,
+// 以及它返回时文件里是否已经有全部日志;同时比较开启致命信号补写前后INFO的耗时,开启它不应改变热路径
+void FatalTest()
+{
+    const size_t cnt = 200000;
+    std::filesystem::create_directories(BENCH_DIR);
+    auto run = [&](const char *mode, bool crash) {
+        std::string path = std::string(BENCH_DIR) + mode + (crash ? "_crash" : "") + ".log";
+        wcm::LocalLoggerBuilder builder;
+        builder.BuildName(std::string("bench_fatal_") + mode);
+        builder.BuildType(wcm::LoggerType::Async);
+        builder.BuildSink<wcm::FileSink>(path);
+        if (strcmp(mode, "lockfree") == 0)
+            builder.BuildLockFree();
+        if (strcmp(mode, "shared") == 0)
+            builder.BuildBackend();
+        else
+            builder.BuildFlush(BUFF_SIZE, 1000);
+        if (crash)
+            builder.BuildCrashDrain();
+        wcm::Logger::ptr logger = builder.Build();
+        uint64_t begin = NowNs();
+        for (size_t i = 0; i < cnt; ++i)
+        {
+            logger->info("请求完成 id=%zu 耗时=%uus 状态=%d", i, (unsigned)(i * 2654435761u % 5000), 200);
+        }
+        uint64_t mid = NowNs();
+        logger->fatal("不可恢复的错误 code=%d", -1);
+        uint64_t end = NowNs();
+        std::ifstream ifs(path);
+        size_t lines = std::count(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>(), '\n');
+        fprintf(stderr, "FATAL同步落地 %-8s %-10s INFO %.0fns/条, fatal() %.2fms, 返回时已落地 %zu/%zu行\n", mode,
+                crash ? "开启补写" : "关闭补写", (double)(mid - begin) / cnt, (end - mid) / 1e6, lines, cnt + 1);
+    };
+    for (const char *mode : {"safe", "lockfree", "shared"})
+    {
+        run(mode, false);
+        run(mode, true);
+    }
+    std::filesystem::remove_all(BENCH_DIR);
+}
+
+// 旧版LoggerManager::GetLogger的做法:加全局锁,查两次表,按值返回shared_ptr,作为对照
+wcm::Logger::ptr LockedLookup(const std::string &name)
+{
+    static std::mutex mutex;
+    static std::unordered_map<std::string, wcm::Logger::ptr> loggers = {{name, wcm::GetLogger(name)}};
+    std::unique_lock<std::mutex> lock(mutex);
+    if (loggers.find(name) != loggers.end())
+    {
+        return loggers[name];
+    }
+    return wcm::Logger::ptr();
+}
+
+// 多线程同时查找日志器并打一条被等级过滤掉的日志,只剩查找和等级判断的开销,看线程之间的争用
+void ContentionTest(const std::vector<std::string> &threads)
+{
+    const size_t cnt = 2000000;
+    {
+        wcm::GlobalLoggerBuilder builder;
+        builder.BuildName("bench_lookup");
+        builder.BuildLevel(wcm::levels::WARN);
+        builder.Build();
+    }
+    wcm::RootPtr()->SetLevel(wcm::levels::WARN);
+    auto run = [&](const char *what, size_t n, const std::function<void()> &call) {
+        std::vector<std::thread> ths;
+        std::atomic<bool> go(false);
+        for (size_t i = 0; i < n; ++i)
+        {
+            ths.emplace_back([&]() {
+                while (!go.load(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+                for (size_t j = 0; j < cnt; ++j)
+                {
+                    call();
+                }
+            });
+        }
+        uint64_t begin = NowNs();
+        go.store(true, std::memory_order_release);
+        for (auto &e : ths)
+        {
+            e.join();
+        }
+        // 总墙钟时间除以总条数;多核上没有争用时随线程数下降,有争用时反而上升
+        fprintf(stderr, "查找争用 %-30s %3zu线程: %.2fns/条\n", what, n, (double)(NowNs() - begin) / (cnt * n));
+    };
+    for (auto &t : threads)
+    {
+        size_t n = std::stoul(t);
+        run("加锁查找(旧GetLogger)", n, []() { LockedLookup("bench_lookup")->info("%d", 1); });
+        run("GetLogger", n, []() { wcm::GetLogger("bench_lookup")->info("%d", 1); });
+        run("RootLogger()->info", n, []() { wcm::RootLogger()->info("%d", 1); });
+        run("INFO宏", n, []() { INFO("%d", 1); });
+        run("LOGGER_INFO宏(缓存句柄)", n, []() { LOGGER_INFO("bench_lookup", "%d", 1); });
+    }
+    wcm::RootPtr()->SetLevel(wcm::levels::DEBUG);
+}
+
+std::vector<std::string> Split(const std::string &str)
+{
+    std::vector<std::string> res;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (!item.empty())
+            res.push_back(item);
+    }
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t msgs = 100000;
+    std::vector<std::string> threads = {"1", "2", "4"};
+    std::vector<std::string> sizes = {"64", "256", "1024"};
+    std::vector<std::string> modes = {"sync", "safe", "unsafe", "lockfree"};
+    std::vector<std::string> sinks = {"stdout", "file", "roll", "fd", "uring", "mmap"};
+    std::string out = "bench.csv";
+    wcm::BufferConfig buffers;
+    wcm::FlushConfig flush;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string opt = argv[i], val = argv[i + 1];
+        if (opt == "-n")
+            msgs = std::stoul(val);
+        else if (opt == "-t")
+            threads = Split(val);
+        else if (opt == "-s")
+            sizes = Split(val);
+        else if (opt == "-m")
+            modes = Split(val);
+        else if (opt == "-k")
+            sinks = Split(val);
+        else if (opt == "-b")
+            buffers.count = std::stoul(val);
+        else if (opt == "-z")
+            buffers.size = std::stoul(val) * 1024;
+        else if (opt == "-g")
+            buffers.huge = val == "1";
+        else if (opt == "-r")
+            buffers.ring = std::stoul(val) * 1024;
+        else if (opt == "-f")
+            flush.bytes = std::stoul(val) * 1024;
+        else if (opt == "-l")
+            flush.latency = std::stoul(val);
+        else if (opt == "-o")
+            out = val;
+        else
+        {
+            fprintf(stderr, "未知参数: %s\n", opt.c_str());
+            return 1;
+        }
+    }
+
+    std::ofstream csv(out, std::ios::app);
+    if (csv.tellp() == 0)
+    {
+        csv << "mode,sink,threads,size,msgs,delivered,produce_s,total_s,msgs_per_s,"
+               "prod_p50_ns,prod_p99_ns,prod_p999_ns,prod_max_ns,e2e_p50_ns,e2e_p99_ns,e2e_p999_ns,e2e_max_ns,dropped,batches,csw"
+            << std::endl;
+    }
+
+    // 计时本身的开销,生产者延迟中都包含这一部分
+    uint64_t begin = NowNs();
+    for (int i = 0; i < 1000000; ++i)
+    {
+        NowNs();
+    }
+    fprintf(stderr, "时钟开销: %.1fns/次, 延迟单位: ns\n", (double)(NowNs() - begin) / 1000000);
+
+    for (auto &mode : modes)
+        for (auto &sink : sinks)
+            for (auto &t : threads)
+                for (auto &s : sizes)
+                    Run(Case{mode, sink, std::stoul(t), std::stoul(s), msgs, buffers, flush}, csv);
+
+    DisabledTest();
+    SuppressTest();
+    CompressTest();
+    BinaryTest();
+    IndexTest();
+    FatalTest();
+    FlushLatencyTest();
+    ContentionTest(threads);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,304 @@
+#include "../source/log.hpp"
+#include <chrono>
+#include <new>
+#include <cstdlib>
+#include <sys/mman.h>
+
+// 统计堆内存分配次数
+static std::atomic<size_t> g_alloc_cnt(0);
+
+void *operator new(size_t size)
+{
+    g_alloc_cnt++;
+    void *p = malloc(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+// 其余形式都转到这两个函数;delete不内联,否则编译器在调用点看到operator new的结果被free(),报分配和释放不匹配
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+// 参数:格式串,格式化次数
+void bench(const std::string &pattern, size_t cnt)
+{
+    wcm::Formatter fmter(pattern);
+    std::string payload(100, 'S');
+    wcm::LogMsg msg("fmt_bench", wcm::TimeSpec(), wcm::levels::INFO, __FILE__, __LINE__, payload);
+
+    // 两种方式的输出必须逐字节一致
+    std::stringstream check;
+    fmter.Output(check, msg);
+    std::string out;
+    fmter.Format(out, msg);
+    assert(check.str() == out);
+
+    std::cout << "格式:" << pattern << std::endl;
+
+    // 1.原来的方式:虚函数 + ostream,Logger中还要调用两次ss.str()
+    size_t allocs = g_alloc_cnt;
+    auto begin = std::chrono::high_resolution_clock::now();
+    size_t total = 0;
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        std::stringstream ss;
+        fmter.Output(ss, msg);
+        total += ss.str().size();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::nano> diff = end - begin;
+    std::cout << "ostream: " << diff.count() / cnt << "ns/条, " << (double)(g_alloc_cnt - allocs) / cnt << "次分配/条" << std::endl;
+
+    // 2.指令数组 + 复用的输出缓冲区
+    allocs = g_alloc_cnt;
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        out.clear();
+        fmter.Format(out, msg);
+        total += out.size();
+    }
+    end = std::chrono::high_resolution_clock::now();
+    diff = end - begin;
+    std::cout << "Format: " << diff.count() / cnt << "ns/条, " << (double)(g_alloc_cnt - allocs) / cnt << "次分配/条" << std::endl;
+
+    // 3.指令数组 + 调用者提供的字符数组
+    char buf[1024];
+    assert(fmter.MaxSize(msg) <= sizeof(buf));
+    allocs = g_alloc_cnt;
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        total += fmter.Format(buf, msg);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    diff = end - begin;
+    std::cout << "Format(char*): " << diff.count() / cnt << "ns/条, " << (double)(g_alloc_cnt - allocs) / cnt << "次分配/条" << std::endl;
+    std::cout << "(" << total << ")\n" << std::endl;
+}
+
+// 有效载荷格式化:vasprintf 与 编译期解析格式串的FormatTo
+std::string Vasprintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    char *res = nullptr;
+    int len = vasprintf(&res, fmt, ap);
+    va_end(ap);
+    std::string out(res, len);
+    free(res);
+    return out;
+}
+
+template <class S, class... Args>
+void payload_bench(S, size_t cnt, const Args &...args)
+{
+    std::string out;
+    wcm::FormatTo<S>(out, args...);
+    assert(out == Vasprintf(S::get(), args...));
+    std::cout << "参数格式:" << S::get() << std::endl;
+
+    size_t allocs = g_alloc_cnt;
+    auto begin = std::chrono::high_resolution_clock::now();
+    size_t total = 0;
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        char *res = nullptr;
+        total += asprintf(&res, S::get(), args...);
+        free(res);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::nano> diff = end - begin;
+    std::cout << "vasprintf: " << diff.count() / cnt << "ns/条(malloc不计入分配次数)" << std::endl;
+
+    allocs = g_alloc_cnt;
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        out.clear();
+        wcm::FormatTo<S>(out, args...);
+        total += out.size();
+    }
+    end = std::chrono::high_resolution_clock::now();
+    diff = end - begin;
+    std::cout << "FormatTo: " << diff.count() / cnt << "ns/条, " << (double)(g_alloc_cnt - allocs) / cnt << "次分配/条" << std::endl;
+    std::cout << "(" << total << ")\n" << std::endl;
+}
+
+// 结构化字段:手工拼接JSON字符串 与 打包字段 + %J直接渲染
+void fields_bench(size_t cnt)
+{
+    std::string path = "/api/v1/user";
+    wcm::Formatter fmter(JSON_PATTERN);
+    wcm::LogMsg msg("fmt_bench", wcm::TimeSpec(), wcm::levels::INFO, __FILE__, __LINE__, "请求完成");
+    std::string fields;
+    std::cout << "结构化字段: status, ms, path, ok" << std::endl;
+
+    // 1.调用者自己拼出JSON,再作为有效载荷输出
+    size_t allocs = g_alloc_cnt;
+    auto begin = std::chrono::high_resolution_clock::now();
+    size_t total = 0;
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        std::string json = "{\"msg\":\"请求完成\",\"status\":" + std::to_string(200) + ",\"ms\":" + std::to_string(3.25) +
+                           ",\"path\":\"" + path + "\",\"ok\":" + (true ? "true" : "false") + "}";
+        total += json.size();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::nano> diff = end - begin;
+    std::cout << "手工拼接(只拼字段): " << diff.count() / cnt << "ns/条, " << (double)(g_alloc_cnt - allocs) / cnt << "次分配/条" << std::endl;
+
+    // 2.打包字段并用%J渲染整条日志,与日志器中的路径相同
+    char buf[2048];
+    allocs = g_alloc_cnt;
+    begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        fields.clear();
+        wcm::PackField(fields, wcm::kv("status", 200));
+        wcm::PackField(fields, wcm::kv("ms", 3.25));
+        wcm::PackField(fields, wcm::kv("path", path));
+        wcm::PackField(fields, wcm::kv("ok", true));
+        msg._fields = fields.data();
+        msg._fields_len = fields.size();
+        assert(fmter.MaxSize(msg) <= sizeof(buf));
+        total += fmter.Format(buf, msg);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    diff = end - begin;
+    std::cout << "打包+%J(整条日志): " << diff.count() / cnt << "ns/条, " << (double)(g_alloc_cnt - allocs) / cnt << "次分配/条" << std::endl;
+    std::cout << std::string(buf, fmter.Format(buf, msg));
+    std::cout << "(" << total << ")\n" << std::endl;
+}
+
+// 延迟格式化的打包和还原,与日志器开启延迟格式化时的路径相同
+std::string Deferred(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    std::string args;
+    bool ok = wcm::EncodeArgs(args, fmt, ap);
+    va_end(ap);
+    assert(ok);
+    std::string out;
+    wcm::DecodeArgs(out, fmt, args.data(), args.size());
+    return out;
+}
+
+// 带精度的%s: 参数是紧挨着不可读页的、不以'\0'结尾的缓冲区,多读一个字节就会段错误
+void precision_test()
+{
+    long page = sysconf(_SC_PAGESIZE);
+    char *mem = (char *)mmap(nullptr, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(mem != MAP_FAILED);
+    mprotect(mem + page, page, PROT_NONE);
+    char *str = mem + page - 5;
+    memcpy(str, "hello", 5);
+
+    assert(Deferred("[%.*s]", 5, str) == "[hello]");
+    assert(Deferred("[%.*s]", 3, str) == Vasprintf("[%.*s]", 3, str));
+    assert(Deferred("[%8.5s]", str) == Vasprintf("[%8.5s]", str));
+    assert(Deferred("[%.*s][%.3s][%s]", 2, (char *)nullptr, (char *)nullptr, (char *)nullptr) == Vasprintf("[%.*s][%.3s][%s]", 2, (char *)nullptr, (char *)nullptr, (char *)nullptr));
+
+    // 类型安全接口的直接格式化和打包
+    auto direct = WCM_FMT("[%.5s][%-8.3s]");
+    auto packed = WCM_FMT("[%.5s][%.2s]");
+    std::string out, args;
+    wcm::FormatTo<decltype(direct)>(out, str, str);
+    assert(out == "[hello][hel     ]");
+    out.clear();
+    wcm::FormatTo<decltype(packed)>(out, str, (const char *)nullptr);
+    assert(out == Vasprintf(packed.get(), str, (char *)nullptr));
+    wcm::PackArgs<decltype(packed)>(args, str, (const char *)nullptr);
+    out.clear();
+    wcm::DecodeArgs(out, packed.get(), args.data(), args.size());
+    assert(out == Vasprintf(packed.get(), str, (char *)nullptr));
+    munmap(mem, page * 2);
+    std::cout << "带精度的%s: 通过\n" << std::endl;
+}
+
+// 丢弃所有数据的落地方式,只用来测日志器本身
+class NullSink : public wcm::Sink
+{
+public:
+    void log(const char *data, size_t len) override
+    {
+    }
+};
+
+// 完整的一次日志调用(填充LogMsg,生成有效载荷,格式化,交给落地方式)的耗时和堆内存分配次数
+// 异步日志器的分配次数包括后台线程,先打一批日志让线程局部和复用的缓冲区长到足够大再开始统计
+void logcall_bench(wcm::LoggerType type, size_t cnt)
+{
+    wcm::LocalLoggerBuilder builder;
+    builder.BuildName("fmt_bench");
+    builder.BuildType(type);
+    builder.BuildSink<NullSink>();
+    wcm::Logger::ptr logger = builder.Build();
+    wcm::Logger *l = logger.get();
+    std::string path = "/api/v1/user";
+    std::cout << (type == wcm::LoggerType::Sync ? "同步" : "异步") << "日志器:" << std::endl;
+    auto run = [&](const char *what, const std::function<void(size_t)> &call) {
+        for (size_t i = 0; i < 10000; ++i)
+        {
+            call(i);
+        }
+        l->Flush();
+        size_t allocs = g_alloc_cnt;
+        auto begin = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < cnt; ++i)
+        {
+            call(i);
+        }
+        l->Flush();
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> diff = end - begin;
+        std::cout << what << ": " << diff.count() / cnt << "ns/条, " << (double)(g_alloc_cnt - allocs) / cnt << "次分配/条" << std::endl;
+    };
+    run("printf风格", [&](size_t i) { (l->info)(__FILE__, __LINE__, "user %s login from %s:%d", "wcm", "127.0.0.1", (int)i); });
+    run("类型安全", [&](size_t i) { l->info("user %s login from %s:%d", "wcm", "127.0.0.1", (int)i); });
+    run("类型安全+字段", [&](size_t i) { l->info("请求完成", wcm::kv("status", 200), wcm::kv("path", path)); });
+    std::cout << std::endl;
+}
+
+int main()
+{
+    precision_test();
+    bench("[%c][%d{%H:%M:%S}][%p][%f:%l][%T] %m%n", 1000000);
+    bench("%d{%Y-%m-%d %H:%M:%S}%t[%p]%t%%%m%n", 1000000);
+    bench("[%d{%Y-%m-%d %H:%M:%S.%6N}][%p] %m%n", 1000000);
+    bench("[%d{%H:%M:%S.%3N}][%T:%N][%p] %m%n", 1000000);
+    bench("%m%n", 1000000);
+    bench(JSON_PATTERN, 1000000);
+    bench(LOGFMT_PATTERN, 1000000);
+    payload_bench(WCM_FMT("user %s login from %s:%d"), 1000000, "wcm", "127.0.0.1", 8080);
+    payload_bench(WCM_FMT("id=%lu cost=%.3fms ret=%d"), 1000000, 1234567890ul, 12.345, -1);
+    payload_bench(WCM_FMT("%s"), 1000000, std::string(100, 'S').c_str());
+    fields_bench(1000000);
+    logcall_bench(wcm::LoggerType::Sync, 1000000);
+    logcall_bench(wcm::LoggerType::Async, 1000000);
+    return 0;
+}
@@ -0,0 +1,468 @@
+// 共享后台线程池
+// 很多异步日志器共用固定数量的工作线程和一个缓冲区池,线程数和内存只随核数变化,不随日志器个数变化
+#pragma once
+#include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include "looper.hpp"
+
+namespace wcm
+{
+#define BACKEND_BUFF_SIZE 64 * 1024      // 共享后台默认的缓冲区大小,日志器只在有待处理数据时才占用缓冲区,所以用小块
+#define BACKEND_BUFFS_PER_THREAD 256     // 共享后台每个工作线程默认对应的缓冲区个数,即每个线程16MB
+
+    class BackendQueue;
+
+    // 固定数量的工作线程,每个线程有自己的就绪队列,自己的队列空了就从其他线程的队列尾部偷
+    // 一个日志器的队列同一时刻只在一个线程上处理,保证同一日志器内的顺序
+    class Backend
+    {
+    public:
+        using ptr = std::shared_ptr<Backend>;
+        // threads: 工作线程数,0表示核数的一半(至少1个)
+        // buffers: 缓冲区池的上限,0表示每个工作线程BACKEND_BUFFS_PER_THREAD个;缓冲区在第一次用到时才申请
+        Backend(size_t threads = 0, size_t buffers = 0, size_t size = BACKEND_BUFF_SIZE, bool huge = false)
+            : _size(size), _huge(huge), _allocated(0), _waiters(0), _ready(0), _sleepers(0), _stop(false)
+        {
+            if (threads == 0)
+            {
+                threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+            }
+            _max_buffers = buffers == 0 ? threads * BACKEND_BUFFS_PER_THREAD : buffers;
+            _max_buffers = std::max<size_t>(_max_buffers, 2);
+            for (size_t i = 0; i < threads; ++i)
+            {
+                _workers.emplace_back(new Worker());
+            }
+            // 工作线程最后启动,保证它看到的成员都已经初始化完毕
+            for (size_t i = 0; i < threads; ++i)
+            {
+                _workers[i]->thread = std::thread(&Backend::ThreadRoutine, this, i);
+            }
+        }
+
+        // 所有挂在上面的队列都已经停止(它们持有Backend::ptr),这里只需要停止工作线程
+        ~Backend()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+                _cv.notify_all();
+            }
+            for (auto &e : _workers)
+            {
+                e->thread.join();
+            }
+        }
+
+        // 进程默认的共享后台,第一次使用时创建
+        static ptr Default()
+        {
+            static ptr backend = std::make_shared<Backend>();
+            return backend;
+        }
+
+        size_t Threads()
+        {
+            return _workers.size();
+        }
+
+        // 已经申请的缓冲区个数,不超过上限
+        size_t Allocated()
+        {
+            std::unique_lock<std::mutex> lock(_pool_mutex);
+            return _allocated;
+        }
+
+        // 把一个有数据的队列放进home号工作线程的就绪队列,只在队列从空闲变为有数据时调用
+        void Schedule(BackendQueue *queue, size_t home)
+        {
+            Worker &w = *_workers[home % _workers.size()];
+            {
+                std::unique_lock<std::mutex> lock(w.mutex);
+                w.ready.push_back(queue);
+            }
+            _ready.fetch_add(1);
+            // 与工作线程睡眠前先登记再检查_ready对称,有线程睡眠时才去唤醒
+            if (_sleepers.load() > 0)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.notify_one();
+            }
+        }
+
+        // 从池中取一个空闲缓冲区,池空且已达上限时返回nullptr
+        // reserve不为0时,只有空闲(含未申请)的缓冲区多于reserve个才给出,用于低等级日志给高等级日志留余量
+        std::unique_ptr<Buffer> TryGet(size_t reserve = 0)
+        {
+            std::unique_lock<std::mutex> lock(_pool_mutex);
+            if (_free.size() + (_max_buffers - _allocated) <= reserve)
+            {
+                return nullptr;
+            }
+            if (!_free.empty())
+            {
+                std::unique_ptr<Buffer> buff = std::move(_free.back());
+                _free.pop_back();
+                return buff;
+            }
+            if (_allocated < _max_buffers)
+            {
+                _allocated++;
+                return std::unique_ptr<Buffer>(new Buffer(_size, _huge));
+            }
+            return nullptr;
+        }
+
+        // 归还缓冲区,扩容过的缓冲区换成标准大小的,保证池的内存有界
+        void Put(std::unique_ptr<Buffer> buff)
+        {
+            buff->Clear();
+            if (buff->Capacity() > _size + HUGE_PAGE_SIZE)
+            {
+                buff.reset(new Buffer(_size, _huge));
+            }
+            std::unique_lock<std::mutex> lock(_pool_mutex);
+            _free.push_back(std::move(buff));
+            if (_waiters > 0)
+            {
+                _pool_cv.notify_all();
+            }
+        }
+
+        // 等到池中有空闲缓冲区或者超时,返回是否有空闲缓冲区
+        bool WaitBuffer(std::chrono::steady_clock::time_point deadline)
+        {
+            std::unique_lock<std::mutex> lock(_pool_mutex);
+            auto ready = [&]() { return !_free.empty() || _allocated < _max_buffers; };
+            _waiters++;
+            bool ok = true;
+            if (deadline == std::chrono::steady_clock::time_point::max())
+                _pool_cv.wait(lock, ready);
+            else
+                ok = _pool_cv.wait_until(lock, deadline, ready);
+            _waiters--;
+            return ok;
+        }
+
+        // 标准的缓冲区大小
+        size_t BuffSize()
+        {
+            return _size;
+        }
+
+        // 缓冲区池的上限
+        size_t MaxBuffers()
+        {
+            return _max_buffers;
+        }
+
+    private:
+        struct Worker
+        {
+            std::mutex mutex;
+            std::deque<BackendQueue *> ready; // 就绪的日志器队列
+            std::thread thread;
+        };
+
+        // 先取自己就绪队列的头部,没有就从其他线程的就绪队列尾部偷一个
+        BackendQueue *Pop(size_t self)
+        {
+            size_t n = _workers.size();
+            for (size_t i = 0; i < n; ++i)
+            {
+                Worker &w = *_workers[(self + i) % n];
+                std::unique_lock<std::mutex> lock(w.mutex);
+                if (w.ready.empty())
+                {
+                    continue;
+                }
+                BackendQueue *queue;
+                if (i == 0)
+                {
+                    queue = w.ready.front();
+                    w.ready.pop_front();
+                }
+                else
+                {
+                    queue = w.ready.back();
+                    w.ready.pop_back();
+                }
+                _ready.fetch_sub(1);
+                return queue;
+            }
+            return nullptr;
+        }
+
+        void ThreadRoutine(size_t self);
+
+    private:
+        size_t _size;        // 缓冲区大小
+        bool _huge;          // 缓冲区是否使用大页
+        size_t _max_buffers; // 缓冲区池的上限
+        size_t _allocated;   // 已经申请的缓冲区个数
+        size_t _waiters;     // 等待空闲缓冲区的生产者个数
+        std::mutex _pool_mutex;
+        std::condition_variable _pool_cv;             // 等待空闲缓冲区的生产者
+        std::vector<std::unique_ptr<Buffer>> _free;   // 空闲缓冲区
+        std::vector<std::unique_ptr<Worker>> _workers;
+        std::atomic<size_t> _ready;    // 所有就绪队列中的队列总数
+        std::atomic<size_t> _sleepers; // 正在睡眠的工作线程数
+        std::mutex _mutex;             // 工作线程睡眠用
+        std::condition_variable _cv;
+        bool _stop;                    // 停止标志,受_mutex保护
+    };
+
+    // 挂在共享后台上的一个日志器的缓冲队列,本身不带线程
+    // 生产者写入输入缓冲区,写满后排队并从池中换一个;队列从空闲变为有数据时被调度到某个工作线程,
+    // 工作线程一次取走全部数据按顺序回调,处理完把缓冲区还给池
+    // 共享后台只支持加锁模式,缓冲区大小由后台决定,没有批量刷新的延迟等待(每次调度处理当时积累的全部数据)
+    class BackendQueue : public Looper
+    {
+    public:
+        using ptr = std::shared_ptr<BackendQueue>;
+        BackendQueue(const Backend::ptr &backend, func_t callback, OverflowPolicy policy = OverflowPolicy::BLOCK, size_t timeout = 0)
+            : _backend(backend), _callback(callback), _policy(policy), _timeout(timeout), _home(NewHome()), _scheduled(false), _started(0), _finished(0)
+        {
+        }
+
+        ~BackendQueue()
+        {
+            Stop();
+        }
+
+        void Push(const char *data, size_t len) override
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (!Reserve(lock, data, len))
+            {
+                Drop(data);
+                return;
+            }
+            _pro_buffer->Push(data, len);
+            if (!_scheduled)
+            {
+                _scheduled = true;
+                lock.unlock();
+                _backend->Schedule(this, _home);
+            }
+        }
+
+        // 等工作线程处理完所有已写入的数据
+        void Stop() override
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _idle_cv.wait(lock, [&]()
+                          { return !_scheduled; });
+        }
+
+        // 每次调度都取走当时的全部数据,等一次在调用之后开始的处理结束即可;没有被调度说明数据都已经处理完
+        void Flush() override
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_drainer == std::this_thread::get_id())
+            {
+                return;
+            }
+            size_t target = _started + 1;
+            _idle_cv.wait(lock, [&]()
+                          { return !_scheduled || _finished >= target; });
+        }
+
+        void Visit(visit_t visit, void *arg) override
+        {
+            for (auto &e : _batch)
+            {
+                if (e && !e->Empty())
+                    visit(e->begin(), e->ReadAbleSize(), nullptr, 0, arg);
+            }
+            for (auto &e : _full)
+            {
+                visit(e->begin(), e->ReadAbleSize(), nullptr, 0, arg);
+            }
+            if (_pro_buffer && !_pro_buffer->Empty())
+            {
+                visit(_pro_buffer->begin(), _pro_buffer->ReadAbleSize(), nullptr, 0, arg);
+            }
+        }
+
+        // 由工作线程调用:取走当前全部数据按顺序回调,返回是否还有新数据需要再次调度
+        bool Drain()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _batch.swap(_full);
+                if (_pro_buffer && !_pro_buffer->Empty())
+                {
+                    _batch.push_back(std::move(_pro_buffer)); // 下次写入时再从池中取
+                }
+                _started++;
+                _drainer = std::this_thread::get_id();
+            }
+            for (auto &buff : _batch)
+            {
+                _callback(*buff);
+                _backend->Put(std::move(buff));
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _batch.clear();
+            _finished = _started;
+            _drainer = std::thread::id();
+            if (!_full.empty() || (_pro_buffer && !_pro_buffer->Empty()))
+            {
+                _idle_cv.notify_all(); // 等待Flush的线程
+                return true;
+            }
+            _scheduled = false;
+            _idle_cv.notify_all();
+            return false;
+        }
+
+    private:
+        // 队列初始归属的工作线程,轮流分配
+        static size_t NewHome()
+        {
+            static std::atomic<size_t> home(0);
+            return home++;
+        }
+
+        // 保证输入缓冲区能放下len字节,需要换缓冲区时从池中取,reserve含义同Backend::TryGet,调用时持有锁
+        // 按标准大小判断,ERROR扩容过的输入缓冲区不会被低等级日志继续占用
+        bool Room(size_t len, size_t reserve = 0)
+        {
+            if (_pro_buffer && (_pro_buffer->Empty() || _pro_buffer->ReadAbleSize() + len <= _backend->BuffSize()))
+            {
+                return true;
+            }
+            std::unique_ptr<Buffer> buff = _backend->TryGet(reserve);
+            if (!buff)
+            {
+                return false;
+            }
+            if (_pro_buffer)
+            {
+                _full.push_back(std::move(_pro_buffer));
+            }
+            _pro_buffer = std::move(buff);
+            return true;
+        }
+
+        // 按策略为一条记录腾出空间,返回false表示这条记录应当被丢弃,调用时持有锁
+        // 等待空闲缓冲区时先释放锁,工作线程取数据需要这把锁
+        bool Reserve(std::unique_lock<std::mutex> &lock, const char *data, size_t len)
+        {
+            switch (_policy)
+            {
+            case OverflowPolicy::BLOCK:
+            case OverflowPolicy::BLOCK_TIMEOUT:
+            {
+                auto deadline = std::chrono::steady_clock::time_point::max();
+                if (_policy == OverflowPolicy::BLOCK_TIMEOUT)
+                    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout);
+                while (!Room(len))
+                {
+                    lock.unlock();
+                    bool ok = _backend->WaitBuffer(deadline);
+                    lock.lock();
+                    if (!ok)
+                        return Room(len);
+                }
+                return true;
+            }
+            case OverflowPolicy::DROP_NEWEST:
+                return Room(len);
+            case OverflowPolicy::DROP_OLDEST:
+                // 丢弃本队列最早排队的缓冲区还给池,没有排队的缓冲区时丢弃输入缓冲区开头的记录
+                while (!Room(len))
+                {
+                    if (!_full.empty())
+                    {
+                        DropFront(*_full.front(), _full.front()->Capacity());
+                        _backend->Put(std::move(_full.front()));
+                        _full.pop_front();
+                    }
+                    else if (_pro_buffer && len <= _backend->BuffSize())
+                    {
+                        DropFront(*_pro_buffer, len + _pro_buffer->Capacity() - _backend->BuffSize());
+                        _pro_buffer->Compact();
+                    }
+                    else
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            case OverflowPolicy::DROP_BY_LEVEL:
+            {
+                levels level = RecordLevel(data);
+                if (level >= levels::ERROR)
+                {
+                    // 有输入缓冲区时直接扩容,没有时等池中的缓冲区
+                    while (!Room(len) && !_pro_buffer)
+                    {
+                        lock.unlock();
+                        _backend->WaitBuffer(std::chrono::steady_clock::time_point::max());
+                        lock.lock();
+                    }
+                    return true;
+                }
+                // DEBUG/INFO给高等级日志留池的1/4
+                return Room(len, level >= levels::WARN ? 0 : _backend->MaxBuffers() / 4);
+            }
+            }
+            return true;
+        }
+
+    private:
+        Backend::ptr _backend;        // 持有后台,保证后台比挂在上面的队列活得久
+        func_t _callback;             // 回调函数
+        OverflowPolicy _policy;       // 池中没有空闲缓冲区时的策略
+        size_t _timeout;              // BLOCK_TIMEOUT策略的等待时间,毫秒
+        size_t _home;                 // 调度到的工作线程编号
+        std::mutex _mutex;
+        std::condition_variable _idle_cv;            // 等待工作线程处理完,Stop和Flush使用
+        std::unique_ptr<Buffer> _pro_buffer;         // 输入缓冲区,没有数据时可能为空
+        std::deque<std::unique_ptr<Buffer>> _full;   // 写满后排队的缓冲区,按写入顺序
+        bool _scheduled;              // 是否在某个就绪队列中或者正在被处理
+        std::deque<std::unique_ptr<Buffer>> _batch; // 工作线程正在处理的一批,只由工作线程修改
+        size_t _started;              // 开始处理的次数
+        size_t _finished;             // 处理完的次数
+        std::thread::id _drainer;     // 正在处理本队列的工作线程,在回调中调用Flush时直接返回
+    };
+
+    // 工作线程入口函数:处理就绪队列,还有数据的队列放回自己的就绪队列尾部,让其他日志器也有机会
+    void Backend::ThreadRoutine(size_t self)
+    {
+        while (1)
+        {
+            BackendQueue *queue = Pop(self);
+            if (queue != nullptr)
+            {
+                if (queue->Drain())
+                {
+                    Schedule(queue, self);
+                }
+                continue;
+            }
+            // 先登记自己要睡眠,再检查一次,避免错过调度
+            std::unique_lock<std::mutex> lock(_mutex);
+            _sleepers.fetch_add(1);
+            if (_ready.load() == 0 && !_stop)
+            {
+                _cv.wait(lock);
+            }
+            _sleepers.fetch_sub(1);
+            if (_stop && _ready.load() == 0)
+            {
+                break;
+            }
+        }
+    }
+}
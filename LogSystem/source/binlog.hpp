@@ -0,0 +1,618 @@
+// 二进制日志文件
+// 一行文本日志里大部分是重复的静态内容:日志器名,文件名,格式串,BinFileSink把它们放进字典只写一次,
+// 每条记录只写调用点编号,时间差,线程编号和打包好的参数,后台线程不再做任何格式化
+// 用tools/logdecode(内部是BinDecoder)还原出与Formatter输出完全相同的文本
+//
+// 文件格式: 文件头"WCMBLOG\3",然后是一串条目,每个条目的第一个字节是类型,整数都是LEB128变长编码
+//   'L' 日志器: id, 名字, 格式化模式
+//   'S' 调用点: id, 日志器id, 记录类型, 等级, 行号, 文件名, 格式串
+//   'T' 线程:   id, 内核线程id, 线程名
+//   'R' 记录:   调用点id, 与上一条记录的时间差(纳秒,zigzag), 线程id, 记录体长度, 记录体
+// 字符串写成长度 + 内容;记录体对FORMATTED记录是文本,对PAYLOAD记录是有效载荷字符串加结构化字段,
+// 对DEFERRED记录是参数加结构化字段;参数和字段的格式同record.hpp和field.hpp,只是整数,指针和字符串长度改成变长编码
+// 字典只在文件内有效,每次打开文件(包括追加到已有文件)都重新写文件头并从头建立字典,
+// 每批数据一次write,崩溃时最后一个条目可能不完整;之后再打开追加时从新的文件头开始,解码时跳过不完整的部分
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sink.hpp"
+#include "record.hpp"
+#include "formatter.hpp"
+#include "message.hpp"
+
+namespace wcm
+{
+#define BINLOG_MAGIC "WCMBLOG\3" // 文件头,版本2的记录体可以带结构化字段,版本3的线程条目是内核线程id和线程名
+#define BINLOG_MAGIC_LEN 8
+
+    // 条目类型
+    enum BinEntry
+    {
+        BIN_LOGGER = 'L',
+        BIN_SITE = 'S',
+        BIN_THREAD = 'T',
+        BIN_RECORD = 'R'
+    };
+
+    void PutVarint(std::string &out, uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            out.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((char)v);
+    }
+
+    void PutVarStr(std::string &out, const char *str, size_t len)
+    {
+        PutVarint(out, len);
+        out.append(str, len);
+    }
+
+    // 读取一个变长整数,数据不完整时返回false
+    bool GetVarint(const char *&p, const char *end, uint64_t &v)
+    {
+        v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7)
+        {
+            unsigned char b = *p++;
+            v |= (uint64_t)(b & 0x7F) << shift;
+            if (!(b & 0x80))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool GetVarStr(const char *&p, const char *end, std::string &str)
+    {
+        uint64_t len;
+        if (!GetVarint(p, end, len) || len > (uint64_t)(end - p))
+        {
+            return false;
+        }
+        str.assign(p, len);
+        p += len;
+        return true;
+    }
+
+    uint64_t ZigZag(int64_t v)
+    {
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    }
+
+    int64_t UnZigZag(uint64_t v)
+    {
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+
+    // 把record.hpp格式的打包参数转成变长编码,追加到out
+    void PackCompact(std::string &out, const char *args, size_t len)
+    {
+        const char *end = args + len;
+        while (args < end)
+        {
+            char tag = *args;
+            out.push_back(tag);
+            switch (tag)
+            {
+            case TAG_INT:
+                PutVarint(out, ZigZag(GetArg<int64_t>(args)));
+                break;
+            case TAG_UINT:
+                PutVarint(out, GetArg<uint64_t>(args));
+                break;
+            case TAG_PTR:
+                PutVarint(out, (uintptr_t)GetArg<const void *>(args));
+                break;
+            case TAG_DOUBLE:
+                out.append(args + 1, sizeof(double));
+                args += 1 + sizeof(double);
+                break;
+            case TAG_LDOUBLE:
+                out.append(args + 1, sizeof(long double));
+                args += 1 + sizeof(long double);
+                break;
+            case TAG_STR:
+            {
+                uint32_t n;
+                memcpy(&n, args + 1, sizeof(n));
+                PutVarStr(out, args + 1 + sizeof(n), n);
+                args += 1 + sizeof(n) + n;
+                break;
+            }
+            case TAG_BOOL:
+                out.push_back(args[1]);
+                args += 2;
+                break;
+            case TAG_FIELD: // 字段名原样保留,后面紧跟着带标签的值
+            {
+                size_t n = (unsigned char)args[1];
+                out.append(args + 1, 1 + n);
+                args += 2 + n;
+                break;
+            }
+            default:
+                out.pop_back(); // 未知标签,记录已损坏,后面的参数不要了
+                return;
+            }
+        }
+    }
+
+    // PackCompact的逆过程,还原成record.hpp格式交给DecodeArgs;fields为第一个字段在out中的位置,没有字段时为out的长度
+    bool UnpackCompact(std::string &out, const char *p, const char *end, size_t &fields)
+    {
+        fields = std::string::npos;
+        while (p < end)
+        {
+            char tag = *p++;
+            uint64_t v;
+            switch (tag)
+            {
+            case TAG_INT:
+                if (!GetVarint(p, end, v))
+                    return false;
+                PutArg<int64_t>(out, TAG_INT, UnZigZag(v));
+                break;
+            case TAG_UINT:
+                if (!GetVarint(p, end, v))
+                    return false;
+                PutArg<uint64_t>(out, TAG_UINT, v);
+                break;
+            case TAG_PTR:
+                if (!GetVarint(p, end, v))
+                    return false;
+                PutArg<const void *>(out, TAG_PTR, (const void *)(uintptr_t)v);
+                break;
+            case TAG_DOUBLE:
+            case TAG_LDOUBLE:
+            {
+                size_t n = tag == TAG_DOUBLE ? sizeof(double) : sizeof(long double);
+                if ((size_t)(end - p) < n)
+                    return false;
+                out.push_back(tag);
+                out.append(p, n);
+                p += n;
+                break;
+            }
+            case TAG_STR:
+            {
+                if (!GetVarint(p, end, v) || v > (uint64_t)(end - p))
+                    return false;
+                PutStr(out, std::string_view(p, v));
+                p += v;
+                break;
+            }
+            case TAG_BOOL:
+                if (p == end)
+                    return false;
+                out.push_back(tag);
+                out.push_back(*p++);
+                break;
+            case TAG_FIELD:
+            {
+                if (p == end || (size_t)(end - p) < 1 + (size_t)(unsigned char)*p)
+                    return false;
+                size_t n = (unsigned char)*p;
+                fields = std::min(fields, out.size());
+                out.push_back(tag);
+                out.append(p, 1 + n);
+                p += 1 + n;
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        fields = std::min(fields, out.size());
+        return true;
+    }
+
+    // 二进制日志文件落地方式,只能接收记录,不能直接输出文本:挂在日志器上时日志器把未格式化的记录交给它
+    // capacity为0时只写path一个文件,否则path作为基础文件名,按RollFileSink的规则滚动,文件名以.bin结尾
+    class BinFileSink : public Sink
+    {
+    public:
+        BinFileSink(const std::string &path, size_t capacity = 0)
+            : _path(path), _capacity(capacity), _cnt(0), _fd(-1), _size(0), _last_time(0), _last_tid(nullptr), _last_tid_id(0), _errors(0)
+        {
+            Open();
+        }
+
+        ~BinFileSink()
+        {
+            if (_fd >= 0)
+            {
+                close(_fd);
+            }
+        }
+
+        bool Binary() const override
+        {
+            return true;
+        }
+
+        // 文本数据没有调用点信息,作为一条FORMATTED记录保存
+        void log(const char *data, size_t len) override
+        {
+            std::string rec(sizeof(RecordHead), '\0');
+            RecordHead head;
+            memset(&head, 0, sizeof(head));
+            head.size = sizeof(head) + len;
+            head.type = RecordType::FORMATTED;
+            head.thread = CurrentThread();
+            memcpy(&rec[0], &head, sizeof(head));
+            rec.append(data, len);
+            logrecords("", "%m", rec.data(), rec.size());
+        }
+
+        // 字典是有状态的,同一个落地方式被多个日志器共享时要加锁
+        void logrecords(const std::string &logger, const std::string &pattern, const char *data, size_t len) override
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_capacity > 0 && _size >= _capacity)
+            {
+                close(_fd);
+                Open();
+            }
+            uint32_t logger_id = LoggerId(logger, pattern);
+            size_t pos = 0;
+            while (pos + sizeof(RecordHead) <= len)
+            {
+                RecordHead head;
+                memcpy(&head, data + pos, sizeof(head));
+                const char *body = data + pos + sizeof(head);
+                size_t body_len = head.size - sizeof(head);
+                pos += head.size;
+
+                uint32_t site = SiteId(logger_id, head);
+                uint32_t tid = ThreadId(head.thread);
+                int64_t time = head.time.tv_sec * 1000000000l + head.time.tv_nsec;
+                _out.push_back(BIN_RECORD);
+                PutVarint(_out, site);
+                PutVarint(_out, ZigZag(time - _last_time));
+                PutVarint(_out, tid);
+                _last_time = time;
+                if (head.type == RecordType::FORMATTED)
+                {
+                    PutVarStr(_out, body, body_len);
+                    continue;
+                }
+                size_t fields = std::min((size_t)head.fields, body_len);
+                _body.clear();
+                if (head.type == RecordType::PAYLOAD)
+                {
+                    PutVarStr(_body, body, fields);
+                    PackCompact(_body, body + fields, body_len - fields);
+                }
+                else
+                {
+                    PackCompact(_body, body, body_len);
+                }
+                PutVarStr(_out, _body.data(), _body.size());
+            }
+            Flush();
+        }
+
+        // 写文件失败的次数
+        size_t Errors()
+        {
+            return _errors;
+        }
+
+    private:
+        // 调用点:同一个日志器中记录类型,等级,文件名,行号,格式串都相同的记录
+        // 文件名和格式串来自字面量,在进程内地址不变,直接用指针比较
+        struct SiteKey
+        {
+            const char *file;
+            const char *fmt;
+            uint32_t line;
+            uint32_t logger;
+            uint8_t type;
+            uint8_t level;
+
+            bool operator==(const SiteKey &o) const
+            {
+                return file == o.file && fmt == o.fmt && line == o.line && logger == o.logger && type == o.type && level == o.level;
+            }
+        };
+
+        struct SiteHash
+        {
+            size_t operator()(const SiteKey &k) const
+            {
+                size_t h = std::hash<const void *>()(k.file) * 31 + std::hash<const void *>()(k.fmt);
+                return h * 31 + ((size_t)k.line << 24 ^ (size_t)k.logger << 16 ^ k.type << 8 ^ k.level);
+            }
+        };
+
+        void Open()
+        {
+            std::string file_name = _capacity > 0 ? RollFileName(_path, _cnt) + ".bin" : _path;
+            wcm::CreateDir(wcm::Path(file_name)); // 如果存储文件所在路径不存在则创建之
+            _fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (_fd < 0)
+            {
+                std::cerr << "打开日志文件失败: " << file_name << ", " << strerror(errno) << std::endl;
+                abort();
+            }
+            _size = 0;
+            Reset();
+            _out.append(BINLOG_MAGIC, BINLOG_MAGIC_LEN);
+        }
+
+        // 字典只在当前文件内有效
+        void Reset()
+        {
+            _loggers.clear();
+            _sites.clear();
+            _threads.clear();
+            _last_time = 0;
+            _last_tid_id = 0;
+            _out.clear();
+        }
+
+        uint32_t LoggerId(const std::string &name, const std::string &pattern)
+        {
+            auto it = _loggers.find(name);
+            if (it != _loggers.end())
+            {
+                return it->second;
+            }
+            uint32_t id = _loggers.size();
+            _loggers[name] = id;
+            _out.push_back(BIN_LOGGER);
+            PutVarint(_out, id);
+            PutVarStr(_out, name.data(), name.size());
+            PutVarStr(_out, pattern.data(), pattern.size());
+            return id;
+        }
+
+        uint32_t SiteId(uint32_t logger, const RecordHead &head)
+        {
+            SiteKey key = {head.file, head.fmt, head.line, logger, head.type, head.level};
+            auto it = _sites.find(key);
+            if (it != _sites.end())
+            {
+                return it->second;
+            }
+            uint32_t id = _sites.size();
+            _sites[key] = id;
+            const char *file = head.file ? head.file : "";
+            const char *fmt = head.fmt ? head.fmt : "";
+            _out.push_back(BIN_SITE);
+            PutVarint(_out, id);
+            PutVarint(_out, logger);
+            _out.push_back(head.type);
+            _out.push_back(head.level);
+            PutVarint(_out, head.line);
+            PutVarStr(_out, file, strlen(file));
+            PutVarStr(_out, fmt, strlen(fmt));
+            return id;
+        }
+
+        // ThreadInfo不会修改也不会释放,线程改名后是新的ThreadInfo,用指针区分线程即可
+        // 没有线程信息的记录(nullptr)统一写成tid为0,名字为空的"未知线程"
+        uint32_t ThreadId(const ThreadInfo *tid)
+        {
+            if (tid == _last_tid && !_threads.empty())
+            {
+                return _last_tid_id;
+            }
+            auto it = _threads.find(tid);
+            uint32_t id;
+            if (it != _threads.end())
+            {
+                id = it->second;
+            }
+            else
+            {
+                id = _threads.size();
+                _threads[tid] = id;
+                _out.push_back(BIN_THREAD);
+                PutVarint(_out, id);
+                PutVarint(_out, tid != nullptr ? (uint64_t)tid->tid : 0);
+                PutVarStr(_out, tid != nullptr ? tid->name : "", tid != nullptr ? tid->name_len : 0);
+            }
+            _last_tid = tid;
+            _last_tid_id = id;
+            return id;
+        }
+
+        // 一批条目一次写出;写失败时丢掉这批并清空字典,之后的条目重新写出定义
+        // 这批已经写出了一部分时把文件截回这批开始的位置,不在文件中间留下不完整的条目
+        void Flush()
+        {
+            const char *data = _out.data();
+            size_t len = _out.size();
+            while (len > 0)
+            {
+                ssize_t ret = write(_fd, data, len);
+                if (ret < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    ReportIoError(_errors, _path, "write", errno);
+                    size_t written = _out.size() - len;
+                    if (written > 0)
+                    {
+                        off_t end = lseek(_fd, 0, SEEK_END);
+                        if (end >= (off_t)written && ftruncate(_fd, end - written) == 0)
+                        {
+                            _size -= written;
+                        }
+                    }
+                    Reset();
+                    _out.append(BINLOG_MAGIC, BINLOG_MAGIC_LEN);
+                    return;
+                }
+                data += ret;
+                len -= ret;
+                _size += ret;
+            }
+            _out.clear();
+        }
+
+    private:
+        std::string _path;
+        size_t _capacity;
+        size_t _cnt; // 滚动文件的序号
+        int _fd;
+        size_t _size; // 当前文件已写入的字节数
+        std::unordered_map<std::string, uint32_t> _loggers;
+        std::unordered_map<SiteKey, uint32_t, SiteHash> _sites;
+        std::unordered_map<const ThreadInfo *, uint32_t> _threads;
+        int64_t _last_time;         // 上一条记录的时间,纳秒
+        const ThreadInfo *_last_tid; // 上一条记录的线程,连续同一线程时不用查表
+        uint32_t _last_tid_id;
+        std::string _out;  // 这批要写出的条目
+        std::string _body; // 变长编码后的参数
+        size_t _errors;
+        std::mutex _mutex;
+    };
+
+    // 二进制日志的解码器,按条目把记录还原成Formatter格式化的文本
+    // 日期按本机时区格式化,与写入时的时区不同时用TZ环境变量指定
+    class BinDecoder
+    {
+    public:
+        // 解码p处的一个条目,记录的文本追加到out,p前进到下一个条目
+        // 数据不完整或损坏时返回false,p不动
+        bool Next(const char *&p, const char *end, std::string &out)
+        {
+            const char *q = p;
+            if ((size_t)(end - q) >= BINLOG_MAGIC_LEN && memcmp(q, BINLOG_MAGIC, BINLOG_MAGIC_LEN) == 0)
+            {
+                // 新的文件头,字典重新开始
+                _loggers.clear();
+                _sites.clear();
+                _threads.clear();
+                _last_time = 0;
+                p = q + BINLOG_MAGIC_LEN;
+                return true;
+            }
+            if (q >= end)
+            {
+                return false;
+            }
+            char type = *q++;
+            uint64_t id, v;
+            switch (type)
+            {
+            case BIN_LOGGER:
+            {
+                LoggerEntry e;
+                std::string pattern;
+                if (!GetVarint(q, end, id) || id != _loggers.size() || !GetVarStr(q, end, e.name) || !GetVarStr(q, end, pattern))
+                    return false;
+                e.fmter = std::make_shared<Formatter>(pattern);
+                _loggers.push_back(e);
+                break;
+            }
+            case BIN_SITE:
+            {
+                Site s;
+                if (!GetVarint(q, end, id) || id != _sites.size() || !GetVarint(q, end, v) || v >= _loggers.size() || end - q < 2)
+                    return false;
+                s.logger = v;
+                s.type = *q++;
+                s.level = *q++;
+                if (!GetVarint(q, end, v) || !GetVarStr(q, end, s.file) || !GetVarStr(q, end, s.fmt))
+                    return false;
+                s.line = v;
+                _sites.push_back(s);
+                break;
+            }
+            case BIN_THREAD:
+            {
+                std::string name;
+                if (!GetVarint(q, end, id) || id != _threads.size() || !GetVarint(q, end, v) || !GetVarStr(q, end, name))
+                    return false;
+                ThreadInfo t;
+                FillThreadInfo(t, (pid_t)v, name.data(), name.size());
+                _threads.push_back(t);
+                break;
+            }
+            case BIN_RECORD:
+            {
+                uint64_t site, delta, tid, len;
+                if (!GetVarint(q, end, site) || site >= _sites.size() || !GetVarint(q, end, delta) ||
+                    !GetVarint(q, end, tid) || tid >= _threads.size() || !GetVarint(q, end, len) || len > (uint64_t)(end - q))
+                    return false;
+                const Site &s = _sites[site];
+                int64_t time = _last_time + UnZigZag(delta);
+                if (s.type == RecordType::FORMATTED)
+                {
+                    out.append(q, len);
+                }
+                else
+                {
+                    _payload.clear();
+                    _args.clear();
+                    size_t fields;
+                    if (s.type == RecordType::PAYLOAD)
+                    {
+                        const char *r = q;
+                        if (!GetVarStr(r, q + len, _payload) || !UnpackCompact(_args, r, q + len, fields))
+                            return false;
+                        fields = 0; // 有效载荷后面只有字段
+                    }
+                    else
+                    {
+                        if (!UnpackCompact(_args, q, q + len, fields))
+                            return false;
+                        DecodeArgs(_payload, s.fmt.c_str(), _args.data(), fields);
+                    }
+                    struct timespec ts;
+                    ts.tv_sec = time / 1000000000l;
+                    ts.tv_nsec = time % 1000000000l;
+                    LoggerEntry &l = _loggers[s.logger];
+                    LogMsg msg(l.name, ts, (levels)s.level, s.file, s.line, _payload, &_threads[tid]);
+                    msg._fields = _args.data() + fields;
+                    msg._fields_len = _args.size() - fields;
+                    l.fmter->Format(out, msg);
+                }
+                _last_time = time;
+                q += len;
+                break;
+            }
+            default:
+                return false;
+            }
+            p = q;
+            return true;
+        }
+
+    private:
+        struct LoggerEntry
+        {
+            std::string name;
+            Formatter::ptr fmter;
+        };
+
+        struct Site
+        {
+            uint32_t logger;
+            uint8_t type;
+            uint8_t level;
+            uint32_t line;
+            std::string file;
+            std::string fmt;
+        };
+
+        std::vector<LoggerEntry> _loggers;
+        std::vector<Site> _sites;
+        std::vector<ThreadInfo> _threads;
+        int64_t _last_time = 0;
+        std::string _payload;
+        std::string _args;
+    };
+}
@@ -1,21 +1,37 @@
 #pragma once
 #include <iostream>
-#include <vector>
+#include <algorithm>
+#include <new>
+#include <cstring>
+#include <sys/mman.h>
 
 namespace wcm
 {
-#define BUFF_SIZE 10 * 1024 * 1024     // 初始缓冲区大小
+#define BUFF_SIZE 10 * 1024 * 1024     // 默认缓冲区大小
 #define THRESHOLD 100 * 1024 * 1024    // 阈值,缓冲区大小小于阈值时双倍扩容,大于等于阈值后线性增长
 #define LINEAR_GROWTH 10 * 1024 * 1024 // 线性增长大小
+#define HUGE_PAGE_SIZE 2 * 1024 * 1024 // 大页大小,使用MAP_HUGETLB时缓冲区大小向上取整到它的整数倍
     typedef char data_type;            // 数据类型
+
+    // 缓冲区内存直接用匿名映射申请,不清零也不预先访问,物理页在第一次写入时才分配
+    // huge为true时优先使用MAP_HUGETLB大页,系统没有预留大页时退回普通映射并建议内核使用透明大页
     class Buffer
     {
     public:
-        Buffer()
-            : _buff(BUFF_SIZE), _widx(0), _ridx(0)
+        Buffer(size_t size = BUFF_SIZE, bool huge = false)
+            : _buff(nullptr), _size(0), _widx(0), _ridx(0), _huge(huge), _hugetlb(false)
         {
+            Allocate(size);
         }
 
+        ~Buffer()
+        {
+            Release();
+        }
+
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+
         // 向_buff插入长度为len的数据
         bool Push(const data_type *data, size_t len)
         {
@@ -26,14 +42,15 @@ namespace wcm
             // }
             // 2.极限性能测试,允许无限扩容
             Expansion(len);
-            std::copy(data, data + len, &_buff[_widx]); // 拷贝数据
-            _widx += len;                              // 更新写指针
+            memcpy(_buff + _widx, data, len); // 拷贝数据
+            _widx += len;                     // 更新写指针
+            return true;
         }
 
         // 还能写入的空间大小
         size_t WriteAbleSize()
         {
-            return _buff.size() - _widx;
+            return _size - _widx;
         }
 
         // 目前能够读取的空间大小
@@ -42,6 +59,18 @@ namespace wcm
             return _widx - _ridx;
         }
 
+        // 缓冲区总大小
+        size_t Capacity()
+        {
+            return _size;
+        }
+
+        // 是否真正用上了MAP_HUGETLB大页
+        bool HugeTLB()
+        {
+            return _hugetlb;
+        }
+
         // 判空
         bool Empty()
         {
@@ -58,14 +87,17 @@ namespace wcm
         void Swap(Buffer &buff)
         {
             std::swap(_buff, buff._buff);
+            std::swap(_size, buff._size);
             std::swap(_widx, buff._widx);
             std::swap(_ridx, buff._ridx);
+            std::swap(_huge, buff._huge);
+            std::swap(_hugetlb, buff._hugetlb);
         }
 
         // 返回可读的起始位置
         const data_type *begin()
         {
-            return &_buff[_ridx];
+            return _buff + _ridx;
         }
 
         //移动读指针走len
@@ -73,7 +105,58 @@ namespace wcm
         {
             _ridx += len;
         }
+
+        // 把未读数据移到缓冲区开头,回收读指针之前的空间
+        void Compact()
+        {
+            if (_ridx == 0)
+            {
+                return;
+            }
+            memmove(_buff, _buff + _ridx, _widx - _ridx);
+            _widx -= _ridx;
+            _ridx = 0;
+        }
     private:
+        // 申请size字节的映射,成功后更新_buff,_size和_hugetlb
+        void Allocate(size_t size)
+        {
+            if (_huge)
+            {
+                size_t huge_size = (size + HUGE_PAGE_SIZE - 1) / (HUGE_PAGE_SIZE) * (HUGE_PAGE_SIZE);
+                void *ptr = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (ptr != MAP_FAILED)
+                {
+                    _buff = (data_type *)ptr;
+                    _size = huge_size;
+                    _hugetlb = true;
+                    return;
+                }
+            }
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED)
+            {
+                throw std::bad_alloc();
+            }
+            if (_huge)
+            {
+                madvise(ptr, size, MADV_HUGEPAGE); // 没有开启透明大页时失败,不影响使用
+            }
+            _buff = (data_type *)ptr;
+            _size = size;
+            _hugetlb = false;
+        }
+
+        void Release()
+        {
+            if (_buff != nullptr)
+            {
+                munmap(_buff, _size);
+            }
+            _buff = nullptr;
+            _size = 0;
+        }
+
         // 扩容 -- len为这次要插入的数据的长度
         void Expansion(size_t len)
         {
@@ -84,20 +167,46 @@ namespace wcm
             }
             // 扩容
             size_t new_size = 0;
-            if (_buff.size() < THRESHOLD)
+            if (_size < THRESHOLD)
             {
-                new_size = _buff.size() * 2 + len; //加len防止双倍扩容时也不够插入新数据
+                new_size = _size * 2 + len; //加len防止双倍扩容时也不够插入新数据
             }
             else
             {
-                new_size = _buff.size() + LINEAR_GROWTH + len;
+                new_size = _size + LINEAR_GROWTH + len;
             }
-            _buff.resize(new_size);
+            // 普通映射由内核重新映射页表,不拷贝数据
+            if (!_hugetlb)
+            {
+                void *ptr = mremap(_buff, _size, new_size, MREMAP_MAYMOVE);
+                if (ptr == MAP_FAILED)
+                {
+                    throw std::bad_alloc();
+                }
+                if (_huge)
+                {
+                    madvise(ptr, new_size, MADV_HUGEPAGE);
+                }
+                _buff = (data_type *)ptr;
+                _size = new_size;
+                return;
+            }
+            // 大页映射申请新的映射,只拷贝未读数据
+            data_type *old = _buff;
+            size_t old_size = _size;
+            Allocate(new_size);
+            memcpy(_buff, old + _ridx, _widx - _ridx);
+            _widx -= _ridx;
+            _ridx = 0;
+            munmap(old, old_size);
         }
 
     private:
-        std::vector<data_type> _buff;
-        size_t _ridx; // 读指针
+        data_type *_buff;
+        size_t _size; // 映射的大小
         size_t _widx; // 写指针
+        size_t _ridx; // 读指针
+        bool _huge;   // 是否要求使用大页
+        bool _hugetlb; // 当前映射是否是MAP_HUGETLB大页
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,416 @@
+// 致命信号时输出还没落地的日志
+// InstallCrashHandler()为SIGSEGV/SIGABRT/SIGBUS注册处理函数,开启了BuildCrashDrain()的日志器构造后登记在这里
+// 收到信号时依次让登记的日志器写出落地方式用户态缓冲中的数据,再把缓冲区中还没处理的记录粗略地格式化成文本,
+// 直接write到各文本落地方式的文件,最后恢复原来的处理方式并重新触发信号,进程照常产生core或者交给原来的处理函数
+//
+// 处理函数只使用异步信号安全的调用:不加锁,不申请内存,不用iostream,stdio和localtime
+// 所以补出的日志格式固定为"[日志器][秒.纳秒][等级][文件:行号][线程] 消息",延迟格式化的参数只按类型输出,
+// 不处理宽度和精度,结构化字段不输出;已经格式化好的数据原样输出
+// 其他线程此时仍在运行,后台线程正在处理的那一批可能与它已经写出的部分重复;二进制落地方式有字典状态,不补写
+#pragma once
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <charconv>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include "sink.hpp"
+#include "record.hpp"
+#include "util.hpp"
+
+namespace wcm
+{
+#define CRASH_SLOTS 64        // 最多登记的日志器个数
+#define CRASH_BUFF 64 * 1024  // 攒够这么多文本再交给落地方式,绕回环形缓冲区的记录超过它时截断
+#define CRASH_STACK 64 * 1024 // 备用信号栈大小
+
+    // 收到致命信号时需要输出剩余日志的对象,日志器实现它
+    class CrashDrainable
+    {
+    public:
+        // 在信号处理函数中调用,只能使用异步信号安全的调用
+        virtual void CrashDrain() = 0;
+
+    protected:
+        ~CrashDrainable()
+        {
+        }
+    };
+
+    // 登记表,静态存储零初始化,信号处理函数只做原子读
+    std::atomic<CrashDrainable *> *CrashSlots()
+    {
+        static std::atomic<CrashDrainable *> slots[CRASH_SLOTS];
+        return slots;
+    }
+
+    // 登记一个对象,表满时返回false
+    bool CrashRegister(CrashDrainable *obj)
+    {
+        std::atomic<CrashDrainable *> *slots = CrashSlots();
+        for (size_t i = 0; i < CRASH_SLOTS; ++i)
+        {
+            CrashDrainable *expected = nullptr;
+            if (slots[i].compare_exchange_strong(expected, obj))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 取消登记,对象析构前调用;没有登记过时什么也不做
+    void CrashUnregister(CrashDrainable *obj)
+    {
+        std::atomic<CrashDrainable *> *slots = CrashSlots();
+        for (size_t i = 0; i < CRASH_SLOTS; ++i)
+        {
+            CrashDrainable *expected = obj;
+            slots[i].compare_exchange_strong(expected, nullptr);
+        }
+    }
+
+    // 把记录粗略格式化成文本交给一组落地方式的logcrash,只使用异步信号安全的调用
+    // 文本攒在静态缓冲区中,同一时刻只有一个线程在处理致命信号
+    class CrashWriter
+    {
+    public:
+        CrashWriter(const std::string &logger, const std::vector<Sink::ptr> &sinks)
+            : _logger(logger), _sinks(sinks), _len(0), _started(false)
+        {
+        }
+
+        ~CrashWriter()
+        {
+            Flush();
+        }
+
+        // 供Looper::Visit使用的回调,arg是CrashWriter
+        static void Visit(const char *a, size_t alen, const char *b, size_t blen, void *arg)
+        {
+            ((CrashWriter *)arg)->Region(a, alen, b, blen);
+        }
+
+        // 一段由a和b两块拼成的缓冲区中的所有完整记录
+        void Region(const char *a, size_t alen, const char *b, size_t blen)
+        {
+            size_t total = alen + blen;
+            size_t pos = 0;
+            while (pos + sizeof(RecordHead) <= total)
+            {
+                RecordHead head;
+                Copy(a, alen, b, pos, (char *)&head, sizeof(head));
+                if (head.size < sizeof(head) || head.size > total - pos)
+                {
+                    break; // 记录损坏或者还没写完
+                }
+                size_t start = pos + sizeof(head);
+                size_t len = head.size - sizeof(head);
+                const char *body;
+                if (start + len <= alen)
+                {
+                    body = a + start;
+                }
+                else if (start >= alen)
+                {
+                    body = b + (start - alen);
+                }
+                else
+                {
+                    len = std::min<size_t>(len, CRASH_BUFF);
+                    Copy(a, alen, b, start, Scratch(), len);
+                    body = Scratch();
+                }
+                Record(head, body, len);
+                pos += head.size;
+            }
+        }
+
+        void Append(const char *data, size_t len)
+        {
+            while (len > 0)
+            {
+                if (_len == CRASH_BUFF)
+                {
+                    Flush();
+                }
+                size_t n = std::min<size_t>(len, CRASH_BUFF - _len);
+                memcpy(Buff() + _len, data, n);
+                _len += n;
+                data += n;
+                len -= n;
+            }
+        }
+
+        void Append(const char *str)
+        {
+            Append(str, strlen(str));
+        }
+
+        void Number(uint64_t val, int base = 10)
+        {
+            char tmp[24];
+            size_t n;
+            if (base == 10)
+            {
+                n = Utoa(tmp, val);
+            }
+            else
+            {
+                char *p = tmp + sizeof(tmp);
+                do
+                {
+                    *--p = "0123456789abcdef"[val % base];
+                    val /= base;
+                } while (val > 0);
+                n = tmp + sizeof(tmp) - p;
+                memmove(tmp, p, n);
+            }
+            Append(tmp, n);
+        }
+
+        void Flush()
+        {
+            if (_len == 0)
+            {
+                return;
+            }
+            for (const auto &e : _sinks)
+            {
+                e->logcrash(Buff(), _len);
+            }
+            _len = 0;
+        }
+
+    private:
+        static char *Buff()
+        {
+            static char buff[CRASH_BUFF];
+            return buff;
+        }
+
+        static char *Scratch()
+        {
+            static char scratch[CRASH_BUFF];
+            return scratch;
+        }
+
+        // 从a和b拼成的数据的pos位置拷贝len字节到out
+        static void Copy(const char *a, size_t alen, const char *b, size_t pos, char *out, size_t len)
+        {
+            if (pos < alen)
+            {
+                size_t n = std::min(len, alen - pos);
+                memcpy(out, a + pos, n);
+                out += n;
+                len -= n;
+                pos += n;
+            }
+            memcpy(out, b + (pos - alen), len);
+        }
+
+        void Record(const RecordHead &head, const char *body, size_t len)
+        {
+            if (!_started)
+            {
+                Append("---- 收到致命信号,以下是缓冲区中还没有输出的日志,可能与上面有重复 ----\n");
+                _started = true;
+            }
+            if (head.type == RecordType::FORMATTED)
+            {
+                Append(body, len);
+                return;
+            }
+            char nsec[24];
+            size_t n = Utoa(nsec, head.time.tv_nsec + 1000000000l); // 补足9位,开头的1换成小数点
+            nsec[0] = '.';
+            Append("[");
+            Append(_logger.data(), _logger.size());
+            Append("][");
+            Number(head.time.tv_sec);
+            Append(nsec, n);
+            Append("][");
+            Append(LevelStr((levels)head.level));
+            Append("][");
+            Append(head.file != nullptr ? head.file : "?");
+            Append(":");
+            Number(head.line);
+            Append("][");
+            Append(head.thread->tid_str, head.thread->tid_len);
+            Append("] ");
+            size_t fields = std::min<size_t>(head.fields, len);
+            if (head.type == RecordType::PAYLOAD)
+                Append(body, fields);
+            else if (head.fmt != nullptr)
+                Args(head.fmt, body, fields);
+            Append("\n");
+        }
+
+        // 按fmt输出打包的参数,只认类型,不处理标志,宽度和精度
+        void Args(const char *fmt, const char *args, size_t len)
+        {
+            const char *end = args + len;
+            const char *p = fmt;
+            while (*p)
+            {
+                const char *pct = strchr(p, '%');
+                if (pct == nullptr)
+                {
+                    Append(p);
+                    break;
+                }
+                Append(p, pct - p);
+                FmtSpec spec = ParseSpec(pct, 0);
+                if (spec.conv == 0)
+                {
+                    Append(pct);
+                    break;
+                }
+                p = pct + spec.end;
+                if (spec.conv == '%')
+                {
+                    Append("%");
+                    continue;
+                }
+                if (spec.width_star && args < end)
+                    GetArg<int64_t>(args);
+                if (spec.prec_star && args < end)
+                    GetArg<int64_t>(args);
+                if (args >= end)
+                {
+                    break;
+                }
+                switch (*args)
+                {
+                case TAG_INT:
+                {
+                    int64_t v = GetArg<int64_t>(args);
+                    if (spec.conv == 'c')
+                    {
+                        char c = v;
+                        Append(&c, 1);
+                    }
+                    else
+                    {
+                        char tmp[24];
+                        Append(tmp, Itoa(tmp, v)); // %m也只输出错误码,strerror不是异步信号安全的
+                    }
+                    break;
+                }
+                case TAG_UINT:
+                {
+                    uint64_t v = GetArg<uint64_t>(args);
+                    Number(v, spec.conv == 'x' || spec.conv == 'X' ? 16 : spec.conv == 'o' ? 8 : 10);
+                    break;
+                }
+                case TAG_DOUBLE:
+                case TAG_LDOUBLE:
+                {
+                    double v = *args == TAG_DOUBLE ? GetArg<double>(args) : (double)GetArg<long double>(args);
+                    char tmp[32];
+                    auto res = std::to_chars(tmp, tmp + sizeof(tmp), v);
+                    Append(tmp, res.ec == std::errc() ? res.ptr - tmp : 0);
+                    break;
+                }
+                case TAG_PTR:
+                    Append("0x");
+                    Number((uintptr_t)GetArg<const void *>(args), 16);
+                    break;
+                case TAG_STR:
+                {
+                    uint32_t n;
+                    memcpy(&n, args + 1, sizeof(n));
+                    const char *str = args + 1 + sizeof(n);
+                    n = std::min<size_t>(n, end - str);
+                    Append(str, n);
+                    args = str + n;
+                    break;
+                }
+                default:
+                    return; // 未知标签,记录已损坏
+                }
+            }
+        }
+
+    private:
+        const std::string &_logger;
+        const std::vector<Sink::ptr> &_sinks;
+        size_t _len;   // 静态缓冲区中已有的字节数
+        bool _started; // 是否已经输出过分隔行
+    };
+
+    // 处理的信号和它们原来的处理方式
+    const int CRASH_SIGNALS[] = {SIGSEGV, SIGABRT, SIGBUS};
+    const size_t CRASH_SIGNAL_CNT = sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]);
+
+    struct sigaction *CrashOldActions()
+    {
+        static struct sigaction old[CRASH_SIGNAL_CNT];
+        return old;
+    }
+
+    void CrashHandler(int sig)
+    {
+        static std::atomic<bool> entered(false);
+        if (entered.exchange(true))
+        {
+            // 另一个线程正在处理,它处理完会重新触发信号结束进程
+            while (1)
+                pause();
+        }
+        std::atomic<CrashDrainable *> *slots = CrashSlots();
+        for (size_t i = 0; i < CRASH_SLOTS; ++i)
+        {
+            CrashDrainable *obj = slots[i].load();
+            if (obj != nullptr)
+            {
+                obj->CrashDrain();
+            }
+        }
+        // 恢复原来的处理方式后重新触发:信号在处理期间被阻塞,返回后立即按原来的方式处理
+        for (size_t i = 0; i < CRASH_SIGNAL_CNT; ++i)
+        {
+            if (CRASH_SIGNALS[i] == sig)
+            {
+                sigaction(sig, &CrashOldActions()[i], nullptr);
+            }
+        }
+        raise(sig);
+    }
+
+    // 为当前线程设置备用信号栈,栈溢出引起的SIGSEGV才能被处理;已经有备用栈时什么也不做
+    // 栈内存在线程退出后也不释放,只应在长期存在的线程中调用
+    void CrashAltStack()
+    {
+        stack_t ss;
+        if (sigaltstack(nullptr, &ss) == 0 && !(ss.ss_flags & SS_DISABLE))
+        {
+            return;
+        }
+        ss.ss_sp = new char[CRASH_STACK];
+        ss.ss_size = CRASH_STACK;
+        ss.ss_flags = 0;
+        sigaltstack(&ss, nullptr);
+    }
+
+    // 安装致命信号处理函数并为调用线程设置备用信号栈,重复调用只安装一次;LoggerBuilder::BuildCrashDrain()会调用它
+    void InstallCrashHandler()
+    {
+        static std::atomic<bool> installed(false);
+        if (installed.exchange(true))
+        {
+            return;
+        }
+        CrashAltStack();
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = CrashHandler;
+        sa.sa_flags = SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        for (size_t i = 0; i < CRASH_SIGNAL_CNT; ++i)
+        {
+            sigaction(CRASH_SIGNALS[i], &sa, &CrashOldActions()[i]);
+        }
+    }
+}
@@ -0,0 +1,387 @@
+// 结构化字段: logger->info("请求完成", wcm::kv("status", 200), wcm::kv("ms", 3.2))
+// 字段跟在格式串参数后面,调用线程按record.hpp的标签格式打包,不转换成文本;
+// Formatter的%k/%K/%J在输出时直接把字段渲染进输出缓冲区,转义也是就地完成的,没有中间字符串
+// 打包格式: [TAG_FIELD][uint8_t名字长度][名字][带标签的值],值的标签是TAG_INT/UINT/DOUBLE/LDOUBLE/STR/PTR/BOOL之一
+#pragma once
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <charconv>
+#include <cmath>
+#include "record.hpp"
+#include "util.hpp"
+
+namespace wcm
+{
+#define FIELD_KEY_MAX 255 // 字段名最长字节数,更长的会被截断
+#define FIELD_EXPAND 8    // 渲染后的字段最多是打包后字节数的多少倍,用于预留输出空间
+#define FIELD_FAST_DIGITS 6 // DoubleTo快速路径最多处理的小数位数
+
+    // 一个字段,只引用调用者的值,在这条日志语句结束前有效
+    template <class T>
+    struct Field
+    {
+        std::string_view key;
+        const T &val;
+    };
+
+    template <class T>
+    Field<T> kv(std::string_view key, const T &val)
+    {
+        return Field<T>{key, val};
+    }
+
+    template <class T>
+    struct IsField : std::false_type
+    {
+    };
+
+    template <class T>
+    struct IsField<Field<T>> : std::true_type
+    {
+    };
+
+    // 参数中字段的个数
+    template <class... Args>
+    constexpr size_t FieldCount()
+    {
+        return (0 + ... + (size_t)IsField<typename std::decay<Args>::type>::value);
+    }
+
+    // 字段是否都在格式串参数后面
+    template <class... Args>
+    constexpr bool FieldsTrailing()
+    {
+        bool seen = false, ok = true;
+        ((seen = seen || IsField<typename std::decay<Args>::type>::value, ok = ok && (!seen || IsField<typename std::decay<Args>::type>::value)), ...);
+        return ok;
+    }
+
+    template <class S, class Tuple, size_t... I>
+    void CheckPrefix(std::index_sequence<I...>)
+    {
+        CheckFormat<S, typename std::tuple_element<I, Tuple>::type...>();
+    }
+
+    // 编译期检查:字段放在最后,前面的参数与格式串匹配
+    template <class S, class... Args>
+    void CheckArgs()
+    {
+        static_assert(FieldsTrailing<Args...>(), "kv字段必须放在格式串参数的后面");
+        CheckPrefix<S, std::tuple<typename std::decay<Args>::type...>>(std::make_index_sequence<sizeof...(Args) - FieldCount<Args...>()>());
+    }
+
+    // 打包一个字段追加到out
+    template <class T>
+    void PackField(std::string &out, const Field<T> &field)
+    {
+        using U = typename std::decay<T>::type;
+        size_t klen = std::min(field.key.size(), (size_t)FIELD_KEY_MAX);
+        out += (char)TAG_FIELD;
+        out += (char)klen;
+        out.append(field.key.data(), klen);
+        if constexpr (std::is_same<U, bool>::value)
+        {
+            out += (char)TAG_BOOL;
+            out += (char)field.val;
+        }
+        else if constexpr (std::is_enum<U>::value)
+        {
+            using E = typename std::underlying_type<U>::type;
+            if constexpr (std::is_signed<E>::value)
+                PutArg<int64_t>(out, TAG_INT, (E)field.val);
+            else
+                PutArg<uint64_t>(out, TAG_UINT, (E)field.val);
+        }
+        else if constexpr (std::is_integral<U>::value && std::is_signed<U>::value)
+        {
+            PutArg<int64_t>(out, TAG_INT, field.val);
+        }
+        else if constexpr (std::is_integral<U>::value)
+        {
+            PutArg<uint64_t>(out, TAG_UINT, field.val);
+        }
+        else if constexpr (std::is_same<U, long double>::value)
+        {
+            PutArg<long double>(out, TAG_LDOUBLE, field.val);
+        }
+        else if constexpr (std::is_floating_point<U>::value)
+        {
+            PutArg<double>(out, TAG_DOUBLE, field.val);
+        }
+        else if constexpr (KindOf<U>() == KIND_STR)
+        {
+            PutStr(out, ToView(field.val));
+        }
+        else
+        {
+            static_assert(KindOf<U>() == KIND_PTR, "kv字段的值只支持整数,浮点数,布尔,字符串和指针");
+            PutArg<const void *>(out, TAG_PTR, field.val);
+        }
+    }
+
+    // 打包tuple中从第N个开始的字段
+    template <size_t N, class Tuple, size_t... I>
+    void PackFields(std::string &out, const Tuple &args, std::index_sequence<I...>)
+    {
+        (PackField(out, std::get<N + I>(args)), ...);
+    }
+
+    // 只打包格式串参数,即tuple的前几个
+    template <class S, class Tuple, size_t... I>
+    void PackPrefix(std::string &out, const Tuple &args, std::index_sequence<I...>)
+    {
+        PackImpl<S>(out, std::index_sequence<I...>(), std::get<I>(args)...);
+    }
+
+    // 只格式化格式串参数
+    template <class S, class Tuple, size_t... I>
+    void FormatPrefix(std::string &out, const Tuple &args, std::index_sequence<I...>)
+    {
+        FormatImpl<S>(out, std::index_sequence<I...>(), std::get<I>(args)...);
+    }
+
+    // 线程局部的字段打包缓冲区,不能延迟格式化时使用,容量重复使用
+    std::string &FieldScratch()
+    {
+        static thread_local std::string scratch;
+        return scratch;
+    }
+
+    // 需要转义的字符表: 0--原样输出, 'u'--\u00XX, 其他--反斜杠加该字符
+    struct EscapeTable
+    {
+        char json[256];
+        bool logfmt_quote[256]; // logfmt中出现这些字符时值需要加引号
+
+        constexpr EscapeTable()
+            : json(), logfmt_quote()
+        {
+            for (int c = 0; c < 0x20; ++c)
+            {
+                json[c] = 'u';
+                logfmt_quote[c] = true;
+            }
+            json[(int)'\b'] = 'b';
+            json[(int)'\f'] = 'f';
+            json[(int)'\n'] = 'n';
+            json[(int)'\r'] = 'r';
+            json[(int)'\t'] = 't';
+            json[(int)'"'] = '"';
+            json[(int)'\\'] = '\\';
+            logfmt_quote[(int)' '] = true;
+            logfmt_quote[(int)'='] = true;
+            logfmt_quote[(int)'"'] = true;
+            logfmt_quote[(int)'\\'] = true;
+            logfmt_quote[0x7F] = true;
+        }
+    };
+
+    constexpr EscapeTable ESCAPE_TABLE;
+
+    // 把str按JSON字符串的规则转义写到p,返回写入后的位置,最多写6 * len字节;不加引号
+    // UTF-8的多字节字符原样输出,连续的普通字符一次memcpy
+    char *JsonEscape(char *p, const char *str, size_t len)
+    {
+        const char *end = str + len;
+        while (str < end)
+        {
+            const char *run = str;
+            while (str < end && ESCAPE_TABLE.json[(unsigned char)*str] == 0)
+            {
+                ++str;
+            }
+            memcpy(p, run, str - run);
+            p += str - run;
+            if (str == end)
+            {
+                break;
+            }
+            char esc = ESCAPE_TABLE.json[(unsigned char)*str];
+            *p++ = '\\';
+            *p++ = esc;
+            if (esc == 'u')
+            {
+                static const char hex[] = "0123456789abcdef";
+                *p++ = '0';
+                *p++ = '0';
+                *p++ = hex[(unsigned char)*str >> 4];
+                *p++ = hex[*str & 15];
+            }
+            ++str;
+        }
+        return p;
+    }
+
+    // 按logfmt的规则写一个值:不含空格,等号,引号和控制字符时原样输出,否则加引号并按JSON规则转义
+    char *LogfmtValue(char *p, const char *str, size_t len)
+    {
+        bool quote = len == 0;
+        for (size_t i = 0; i < len && !quote; ++i)
+        {
+            quote = ESCAPE_TABLE.logfmt_quote[(unsigned char)str[i]];
+        }
+        if (!quote)
+        {
+            memcpy(p, str, len);
+            return p + len;
+        }
+        *p++ = '"';
+        p = JsonEscape(p, str, len);
+        *p++ = '"';
+        return p;
+    }
+
+    // 写一个有限的double,结果能精确还原成v;日志里的数值大多只有几位小数,
+    // 能表示成不超过FIELD_FAST_DIGITS位小数的先用整数转换,其余交给std::to_chars求最短表示
+    char *DoubleTo(char *p, double v)
+    {
+        static const double pow10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+        double a = std::fabs(v);
+        if (a < 1e9)
+        {
+            for (int k = 0; k <= FIELD_FAST_DIGITS; ++k)
+            {
+                uint64_t m = (uint64_t)(a * pow10[k] + 0.5);
+                if ((double)m / pow10[k] != a)
+                {
+                    continue;
+                }
+                if (std::signbit(v))
+                {
+                    *p++ = '-';
+                }
+                p += Utoa(p, m / (uint64_t)pow10[k]);
+                if (k > 0)
+                {
+                    *p++ = '.';
+                    uint64_t frac = m % (uint64_t)pow10[k];
+                    for (int i = k - 1; i >= 0; --i, frac /= 10)
+                    {
+                        p[i] = '0' + frac % 10;
+                    }
+                    p += k;
+                }
+                return p;
+            }
+        }
+        return std::to_chars(p, p + 32, v).ptr; // 最短的能精确还原的表示
+    }
+
+    // 渲染字段的风格
+    enum FieldStyle
+    {
+        FIELD_LOGFMT, // 每个字段输出为" key=value"
+        FIELD_JSON    // 每个字段输出为,"key":value
+    };
+
+    // 把打包的字段渲染到p,返回写入后的位置,最多写FIELD_EXPAND * len字节;遇到损坏的数据时停止
+    char *RenderFields(char *p, const char *fields, size_t len, FieldStyle style)
+    {
+        const char *end = fields + len;
+        while (fields + 2 <= end && *fields == TAG_FIELD)
+        {
+            size_t klen = (unsigned char)fields[1];
+            const char *key = fields + 2;
+            const char *val = key + klen;
+            if (val >= end)
+            {
+                break;
+            }
+            if (style == FIELD_JSON)
+            {
+                *p++ = ',';
+                *p++ = '"';
+                p = JsonEscape(p, key, klen);
+                *p++ = '"';
+                *p++ = ':';
+            }
+            else
+            {
+                *p++ = ' ';
+                p = LogfmtValue(p, key, klen);
+                *p++ = '=';
+            }
+            char tag = *val;
+            fields = val;
+            switch (tag)
+            {
+            case TAG_INT:
+                p += Itoa(p, GetArg<int64_t>(fields));
+                break;
+            case TAG_UINT:
+                p += Utoa(p, GetArg<uint64_t>(fields));
+                break;
+            case TAG_BOOL:
+            {
+                bool b = fields[1];
+                fields += 2;
+                memcpy(p, b ? "true" : "false", b ? 4 : 5);
+                p += b ? 4 : 5;
+                break;
+            }
+            case TAG_DOUBLE:
+            case TAG_LDOUBLE:
+            {
+                double d = 0;
+                long double ld = 0;
+                if (tag == TAG_DOUBLE)
+                    d = GetArg<double>(fields);
+                else
+                    d = ld = GetArg<long double>(fields);
+                if (!std::isfinite(d)) // JSON没有NaN和无穷
+                {
+                    const char *text = style == FIELD_JSON ? "null" : (std::isnan(d) ? "NaN" : (d > 0 ? "+Inf" : "-Inf"));
+                    size_t n = strlen(text);
+                    memcpy(p, text, n);
+                    p += n;
+                }
+                else if (tag == TAG_DOUBLE)
+                {
+                    p = DoubleTo(p, d);
+                }
+                else
+                {
+                    p = std::to_chars(p, p + 64, ld).ptr;
+                }
+                break;
+            }
+            case TAG_PTR:
+            {
+                const void *ptr = GetArg<const void *>(fields);
+                if (style == FIELD_JSON)
+                    *p++ = '"';
+                *p++ = '0';
+                *p++ = 'x';
+                p = std::to_chars(p, p + 16, (uintptr_t)ptr, 16).ptr;
+                if (style == FIELD_JSON)
+                    *p++ = '"';
+                break;
+            }
+            case TAG_STR:
+            {
+                uint32_t n;
+                memcpy(&n, fields + 1, sizeof(n));
+                const char *str = fields + 1 + sizeof(n);
+                fields = str + n;
+                if (style == FIELD_JSON)
+                {
+                    *p++ = '"';
+                    p = JsonEscape(p, str, n);
+                    *p++ = '"';
+                }
+                else
+                {
+                    p = LogfmtValue(p, str, n);
+                }
+                break;
+            }
+            default:
+                return p; // 数据损坏
+            }
+        }
+        return p;
+    }
+}
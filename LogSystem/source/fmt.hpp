@@ -0,0 +1,597 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <charconv>
+#include <type_traits>
+#include <utility>
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "util.hpp"
+
+// 类型安全的printf风格格式化
+// 编译期检查格式串中转换说明的个数、类型与参数是否匹配,运行时按参数类型直接编码,不经过vasprintf的格式串解析
+namespace wcm
+{
+#define FMT_NPOS ((size_t)-1)
+
+    // 长度修饰符
+    enum ArgLength
+    {
+        LEN_NONE,
+        LEN_HH,
+        LEN_H,
+        LEN_L,
+        LEN_LL,
+        LEN_J,
+        LEN_Z,
+        LEN_T,
+        LEN_BIGL
+    };
+
+    // 一个printf转换说明 -- %[标志][宽度][.精度][长度]转换字符
+    struct FmtSpec
+    {
+        size_t begin = 0;        // '%'的位置
+        size_t end = 0;          // 转换字符之后的位置
+        bool left = false;       // '-' 左对齐
+        bool plus = false;       // '+' 正数输出正号
+        bool space = false;      // ' ' 正数输出空格
+        bool alt = false;        // '#' 进制前缀等
+        bool zero = false;       // '0' 用0填充宽度
+        bool width_star = false; // 宽度由参数给出
+        bool prec_star = false;  // 精度由参数给出
+        int width = 0;
+        int prec = -1; // -1表示未指定
+        ArgLength len = LEN_NONE;
+        char conv = 0; // 转换字符,0表示解析失败
+    };
+
+    // 从f[pos](指向'%')开始解析一个转换说明,编译期和运行时都可以使用
+    constexpr FmtSpec ParseSpec(const char *f, size_t pos)
+    {
+        FmtSpec spec;
+        spec.begin = pos++;
+        bool flag = true;
+        while (flag)
+        {
+            switch (f[pos])
+            {
+            case '-': spec.left = true; break;
+            case '+': spec.plus = true; break;
+            case ' ': spec.space = true; break;
+            case '#': spec.alt = true; break;
+            case '0': spec.zero = true; break;
+            case '\'':
+            case 'I': break;
+            default: flag = false; continue;
+            }
+            ++pos;
+        }
+        if (f[pos] == '*')
+        {
+            spec.width_star = true;
+            ++pos;
+        }
+        else
+        {
+            while (f[pos] >= '0' && f[pos] <= '9')
+                spec.width = spec.width * 10 + (f[pos++] - '0');
+            if (f[pos] == '$') // 位置参数 %1$d,不支持
+                return spec;
+        }
+        if (f[pos] == '.')
+        {
+            ++pos;
+            spec.prec = 0;
+            if (f[pos] == '*')
+            {
+                spec.prec_star = true;
+                ++pos;
+            }
+            while (f[pos] >= '0' && f[pos] <= '9')
+                spec.prec = spec.prec * 10 + (f[pos++] - '0');
+        }
+        switch (f[pos])
+        {
+        case 'h':
+            spec.len = f[pos + 1] == 'h' ? LEN_HH : LEN_H;
+            pos += f[pos + 1] == 'h' ? 2 : 1;
+            break;
+        case 'l':
+            spec.len = f[pos + 1] == 'l' ? LEN_LL : LEN_L;
+            pos += f[pos + 1] == 'l' ? 2 : 1;
+            break;
+        case 'q': spec.len = LEN_LL; ++pos; break;
+        case 'j': spec.len = LEN_J; ++pos; break;
+        case 'z':
+        case 'Z': spec.len = LEN_Z; ++pos; break;
+        case 't': spec.len = LEN_T; ++pos; break;
+        case 'L': spec.len = LEN_BIGL; ++pos; break;
+        }
+        spec.conv = f[pos];
+        spec.end = f[pos] ? pos + 1 : pos;
+        return spec;
+    }
+
+    // 从f[pos]开始找下一个需要参数的转换说明,跳过%%,找不到返回FMT_NPOS
+    constexpr size_t NextSpec(const char *f, size_t pos)
+    {
+        while (f[pos])
+        {
+            if (f[pos] != '%')
+            {
+                ++pos;
+                continue;
+            }
+            if (f[pos + 1] == '%')
+            {
+                pos += 2;
+                continue;
+            }
+            return pos;
+        }
+        return FMT_NPOS;
+    }
+
+    // 格式串中第idx个转换说明,不存在时conv为0
+    constexpr FmtSpec SpecAt(const char *f, size_t idx)
+    {
+        size_t pos = NextSpec(f, 0);
+        while (pos != FMT_NPOS)
+        {
+            FmtSpec spec = ParseSpec(f, pos);
+            if (idx-- == 0 || spec.conv == 0)
+                return spec;
+            pos = NextSpec(f, spec.end);
+        }
+        return FmtSpec();
+    }
+
+    // 格式串中转换说明的个数
+    constexpr size_t CountSpecs(const char *f)
+    {
+        size_t cnt = 0;
+        size_t pos = NextSpec(f, 0);
+        while (pos != FMT_NPOS)
+        {
+            FmtSpec spec = ParseSpec(f, pos);
+            ++cnt;
+            if (spec.conv == 0)
+                break;
+            pos = NextSpec(f, spec.end);
+        }
+        return cnt;
+    }
+
+    // 类型安全接口支持的转换说明: 不支持'*'宽度精度、位置参数、%n和%m
+    constexpr bool ValidFormat(const char *f)
+    {
+        size_t pos = NextSpec(f, 0);
+        while (pos != FMT_NPOS)
+        {
+            FmtSpec spec = ParseSpec(f, pos);
+            if (spec.conv == 0 || spec.width_star || spec.prec_star)
+                return false;
+            bool known = false;
+            for (const char *c = "diouxXcspfFeEgGaA"; *c; ++c)
+                known = known || *c == spec.conv;
+            if (!known)
+                return false;
+            pos = NextSpec(f, spec.end);
+        }
+        return true;
+    }
+
+    // 参数类型分类
+    enum ArgKind
+    {
+        KIND_NONE,  // 不支持的类型
+        KIND_INT,   // 整数,字符,布尔,枚举
+        KIND_FLOAT, // 浮点数
+        KIND_STR,   // 字符串
+        KIND_PTR    // 指针
+    };
+
+    template <class T>
+    constexpr ArgKind KindOf()
+    {
+        using U = typename std::decay<T>::type;
+        if (std::is_integral<U>::value || std::is_enum<U>::value)
+            return KIND_INT;
+        if (std::is_floating_point<U>::value)
+            return KIND_FLOAT;
+        if (std::is_same<U, const char *>::value || std::is_same<U, char *>::value ||
+            std::is_same<U, std::string>::value || std::is_same<U, std::string_view>::value)
+            return KIND_STR;
+        if (std::is_pointer<U>::value || std::is_null_pointer<U>::value)
+            return KIND_PTR;
+        return KIND_NONE;
+    }
+
+    // 类型为T的参数能否用转换字符conv输出
+    template <class T>
+    constexpr bool Accepts(char conv)
+    {
+        constexpr ArgKind kind = KindOf<T>();
+        const char *convs = "";
+        switch (kind)
+        {
+        case KIND_INT: convs = "diouxXc"; break;
+        case KIND_FLOAT: convs = "fFeEgGaA"; break;
+        case KIND_STR: convs = std::is_pointer<typename std::decay<T>::type>::value ? "sp" : "s"; break;
+        case KIND_PTR: convs = "p"; break;
+        default: break;
+        }
+        for (; *convs; ++convs)
+        {
+            if (*convs == conv)
+                return true;
+        }
+        return false;
+    }
+
+    // 用snprintf把一个值按spec格式追加到out后面,只用于不常见的写法
+    template <class... Args>
+    void AppendPrintf(std::string &out, const char *spec, Args... args)
+    {
+        char tmp[128];
+        int n = snprintf(tmp, sizeof(tmp), spec, args...);
+        if (n < 0)
+            return;
+        if ((size_t)n < sizeof(tmp))
+        {
+            out.append(tmp, n);
+            return;
+        }
+        size_t old = out.size();
+        out.resize(old + n + 1);
+        snprintf(&out[old], n + 1, spec, args...);
+        out.resize(old + n);
+    }
+
+    // 按宽度和对齐方式输出一个转换结果: prefix(符号或进制前缀) + zeros个'0' + body
+    // zero_pad表示'0'标志是否生效(整数指定了精度时、inf/nan时不生效)
+    void AppendPadded(std::string &out, const FmtSpec &spec, const char *prefix, size_t prefix_len,
+                      size_t zeros, const char *body, size_t body_len, bool zero_pad)
+    {
+        size_t len = prefix_len + zeros + body_len;
+        size_t pad = (size_t)spec.width > len ? spec.width - len : 0;
+        bool fill_zero = zero_pad && spec.zero && !spec.left;
+        if (!spec.left && !fill_zero)
+            out.append(pad, ' ');
+        out.append(prefix, prefix_len);
+        if (fill_zero)
+            out.append(pad, '0');
+        out.append(zeros, '0');
+        out.append(body, body_len);
+        if (spec.left)
+            out.append(pad, ' ');
+    }
+
+    // %d %i
+    void EncodeSigned(std::string &out, const FmtSpec &spec, long long val)
+    {
+        unsigned long long abs = val < 0 ? 0ULL - (unsigned long long)val : val;
+        char sign = val < 0 ? '-' : spec.plus ? '+' : spec.space ? ' ' : 0;
+        char digits[24];
+        size_t n = (spec.prec == 0 && abs == 0) ? 0 : Utoa(digits, abs);
+        size_t zeros = spec.prec > (int)n ? spec.prec - n : 0;
+        AppendPadded(out, spec, &sign, sign ? 1 : 0, zeros, digits, n, spec.prec < 0);
+    }
+
+    // %u %o %x %X
+    void EncodeUnsigned(std::string &out, const FmtSpec &spec, unsigned long long val)
+    {
+        char digits[24];
+        size_t n = 0;
+        if (spec.prec != 0 || val != 0)
+        {
+            if (spec.conv == 'u')
+            {
+                n = Utoa(digits, val);
+            }
+            else
+            {
+                n = std::to_chars(digits, digits + sizeof(digits), val, spec.conv == 'o' ? 8 : 16).ptr - digits;
+                if (spec.conv == 'X')
+                {
+                    for (size_t i = 0; i < n; ++i)
+                        digits[i] = toupper(digits[i]);
+                }
+            }
+        }
+        size_t zeros = spec.prec > (int)n ? spec.prec - n : 0;
+        const char *prefix = "";
+        size_t prefix_len = 0;
+        if (spec.alt && spec.conv == 'o' && zeros == 0 && (n == 0 || digits[0] != '0'))
+        {
+            zeros = 1; // %#o保证以0开头
+        }
+        else if (spec.alt && spec.conv != 'o' && spec.conv != 'u' && val != 0)
+        {
+            prefix = spec.conv == 'x' ? "0x" : "0X";
+            prefix_len = 2;
+        }
+        AppendPadded(out, spec, prefix, prefix_len, zeros, digits, n, spec.prec < 0);
+    }
+
+    // %c
+    void EncodeChar(std::string &out, const FmtSpec &spec, int c)
+    {
+        char ch = (unsigned char)c;
+        AppendPadded(out, spec, "", 0, 0, &ch, 1, false);
+    }
+
+    // %s
+    void EncodeStr(std::string &out, const FmtSpec &spec, const char *str, size_t len)
+    {
+        if (spec.prec >= 0 && (size_t)spec.prec < len)
+            len = spec.prec;
+        // 没有宽度的%s最常见,直接拷贝
+        if (spec.width == 0)
+        {
+            out.append(str, len);
+            return;
+        }
+        AppendPadded(out, spec, "", 0, 0, str, len, false);
+    }
+
+    // %p,与glibc一致,空指针输出(nil)
+    void EncodePtr(std::string &out, const FmtSpec &spec, const void *ptr)
+    {
+        if (ptr == nullptr)
+        {
+            AppendPadded(out, spec, "", 0, 0, "(nil)", 5, false);
+            return;
+        }
+        char digits[24];
+        size_t n = std::to_chars(digits, digits + sizeof(digits), (uintptr_t)ptr, 16).ptr - digits;
+        size_t zeros = spec.prec > (int)n ? spec.prec - n : 0;
+        AppendPadded(out, spec, "0x", 2, zeros, digits, n, spec.prec < 0);
+    }
+
+    // 把spec还原成printf格式串,用于交给snprintf处理的不常见写法
+    void SpecText(char *buf, const FmtSpec &spec, const char *length)
+    {
+        char *p = buf;
+        *p++ = '%';
+        if (spec.left) *p++ = '-';
+        if (spec.plus) *p++ = '+';
+        if (spec.space) *p++ = ' ';
+        if (spec.alt) *p++ = '#';
+        if (spec.zero) *p++ = '0';
+        if (spec.width > 0)
+            p += Utoa(p, spec.width);
+        if (spec.prec >= 0)
+        {
+            *p++ = '.';
+            p += Utoa(p, spec.prec);
+        }
+        while (*length)
+            *p++ = *length++;
+        *p++ = spec.conv;
+        *p = '\0';
+    }
+
+    // %f %F %e %E %g %G %a %A,用std::to_chars按精度转换,结果与printf一致
+    template <class T>
+    void EncodeFloat(std::string &out, const FmtSpec &spec, T val)
+    {
+        char conv = spec.conv;
+        char buf[512];
+        std::to_chars_result res = {buf, std::errc::value_too_large};
+        // '#'标志和十六进制浮点数的规则与to_chars不同,交给snprintf
+        if (!spec.alt && conv != 'a' && conv != 'A')
+        {
+            std::chars_format fmt = (conv == 'f' || conv == 'F')   ? std::chars_format::fixed
+                                    : (conv == 'e' || conv == 'E') ? std::chars_format::scientific
+                                                                   : std::chars_format::general;
+            res = std::to_chars(buf, buf + sizeof(buf), val, fmt, spec.prec < 0 ? 6 : spec.prec);
+        }
+        if (res.ec != std::errc())
+        {
+            char text[64];
+            SpecText(text, spec, std::is_same<T, long double>::value ? "L" : "");
+            AppendPrintf(out, text, val);
+            return;
+        }
+        char *body = buf;
+        size_t n = res.ptr - buf;
+        char sign = spec.plus ? '+' : spec.space ? ' ' : 0;
+        if (*body == '-')
+        {
+            sign = '-';
+            ++body;
+            --n;
+        }
+        if (conv >= 'A' && conv <= 'Z')
+        {
+            for (size_t i = 0; i < n; ++i)
+                body[i] = toupper(body[i]);
+        }
+        AppendPadded(out, spec, &sign, sign ? 1 : 0, 0, body, n, std::isfinite(val));
+    }
+
+    // 没有长度修饰符时按整数提升后的类型转换,比int宽的参数不会被截断;有长度修饰符时与printf一样截断
+    template <class T>
+    long long CastSigned(ArgLength len, T val)
+    {
+        switch (len)
+        {
+        case LEN_HH: return (signed char)val;
+        case LEN_H: return (short)val;
+        case LEN_L: return (long)val;
+        case LEN_LL: return (long long)val;
+        case LEN_J: return (intmax_t)val;
+        case LEN_Z: return (ssize_t)val;
+        case LEN_T: return (ptrdiff_t)val;
+        default: return (typename std::make_signed<decltype(+val)>::type)val;
+        }
+    }
+
+    template <class T>
+    unsigned long long CastUnsigned(ArgLength len, T val)
+    {
+        switch (len)
+        {
+        case LEN_HH: return (unsigned char)val;
+        case LEN_H: return (unsigned short)val;
+        case LEN_L: return (unsigned long)val;
+        case LEN_LL: return (unsigned long long)val;
+        case LEN_J: return (uintmax_t)val;
+        case LEN_Z: return (size_t)val;
+        case LEN_T: return (typename std::make_unsigned<ptrdiff_t>::type)val;
+        default: return (typename std::make_unsigned<decltype(+val)>::type)val;
+        }
+    }
+
+    std::string_view ToView(const char *str)
+    {
+        return str == nullptr ? std::string_view("(null)") : std::string_view(str); // 与glibc的printf行为一致
+    }
+
+    // %s的C字符串参数: 指定了精度时最多读prec字节,参数可以是不以'\0'结尾的缓冲区;空指针与glibc一致,精度小于6时输出空串
+    std::string_view ToView(const char *str, int prec)
+    {
+        if (str == nullptr)
+            return prec < 0 || prec >= 6 ? "(null)" : "";
+        return std::string_view(str, prec < 0 ? strlen(str) : strnlen(str, prec));
+    }
+
+    std::string_view ToView(const std::string &str)
+    {
+        return str;
+    }
+
+    std::string_view ToView(std::string_view str)
+    {
+        return str;
+    }
+
+    // 按转换说明把一个参数编码后追加到out
+    template <class T>
+    void EncodeArg(std::string &out, const FmtSpec &spec, const T &arg)
+    {
+        using U = typename std::decay<T>::type;
+        constexpr ArgKind kind = KindOf<U>();
+        if constexpr (std::is_enum<U>::value)
+        {
+            EncodeArg(out, spec, (typename std::underlying_type<U>::type)arg);
+        }
+        else if constexpr (kind == KIND_INT)
+        {
+            if (spec.conv == 'c')
+                EncodeChar(out, spec, (int)arg);
+            else if (spec.conv == 'd' || spec.conv == 'i')
+                EncodeSigned(out, spec, CastSigned(spec.len, arg));
+            else
+                EncodeUnsigned(out, spec, CastUnsigned(spec.len, arg));
+        }
+        else if constexpr (kind == KIND_FLOAT)
+        {
+            if (std::is_same<U, long double>::value || spec.len == LEN_BIGL)
+                EncodeFloat(out, spec, (long double)arg);
+            else
+                EncodeFloat(out, spec, (double)arg);
+        }
+        else if constexpr (kind == KIND_STR && std::is_pointer<U>::value)
+        {
+            if (spec.conv == 'p')
+            {
+                EncodePtr(out, spec, (const void *)arg);
+                return;
+            }
+            std::string_view str = ToView((const char *)arg, spec.prec);
+            EncodeStr(out, spec, str.data(), str.size());
+        }
+        else if constexpr (kind == KIND_STR)
+        {
+            std::string_view str = ToView(arg);
+            EncodeStr(out, spec, str.data(), str.size());
+        }
+        else
+        {
+            EncodePtr(out, spec, (const void *)arg);
+        }
+    }
+
+    // 追加格式串中两个转换说明之间的普通字符,%%还原成%
+    void AppendLiteral(std::string &out, const char *str, size_t len)
+    {
+        const char *end = str + len;
+        while (str < end)
+        {
+            const char *pct = (const char *)memchr(str, '%', end - str);
+            if (pct == nullptr)
+            {
+                out.append(str, end - str);
+                return;
+            }
+            out.append(str, pct - str + 1);
+            str = pct + 2;
+        }
+    }
+
+    // 格式串载体: 宏WCM_FMT生成一个继承FmtString的类型,用静态constexpr函数get()返回格式串,使格式串能在编译期被检查
+    // 只能用字符串字面量,格式串在进程内一直有效,异步日志器可以只记录它的指针
+    struct FmtString
+    {
+    };
+
+#define WCM_FMT(fmt) [] { struct _fmt_string : wcm::FmtString { static constexpr const char *get() { return fmt; } }; return _fmt_string(); }()
+
+    template <class S, class... Args, size_t... I>
+    constexpr bool ArgsMatch(std::index_sequence<I...>)
+    {
+        return (Accepts<Args>(SpecAt(S::get(), I).conv) && ... && true);
+    }
+
+    // 编译期检查格式串S与参数Args是否匹配
+    template <class S, class... Args>
+    void CheckFormat()
+    {
+        static_assert(ValidFormat(S::get()), "日志格式串中有不支持的转换说明(不支持'*'宽度精度、位置参数、%n和%m)");
+        static_assert(CountSpecs(S::get()) == sizeof...(Args), "日志格式串中转换说明的个数与参数个数不一致");
+        static_assert(ArgsMatch<S, Args...>(std::index_sequence_for<Args...>()), "日志参数类型与格式串中的转换说明不匹配");
+    }
+
+    // 第I个转换说明之前的普通字符的起始位置
+    template <class S, size_t I>
+    constexpr size_t LiteralBegin()
+    {
+        if constexpr (I == 0)
+            return 0;
+        else
+            return SpecAt(S::get(), I - 1).end;
+    }
+
+    template <class S, size_t I, class T>
+    void FormatOne(std::string &out, const T &arg)
+    {
+        constexpr FmtSpec spec = SpecAt(S::get(), I);
+        constexpr size_t lit = LiteralBegin<S, I>();
+        AppendLiteral(out, S::get() + lit, spec.begin - lit);
+        EncodeArg(out, spec, arg);
+    }
+
+    template <class S, class... Args, size_t... I>
+    void FormatImpl(std::string &out, std::index_sequence<I...>, const Args &...args)
+    {
+        (FormatOne<S, I>(out, args), ...);
+        constexpr size_t lit = LiteralBegin<S, sizeof...(I)>();
+        constexpr size_t len = std::char_traits<char>::length(S::get());
+        AppendLiteral(out, S::get() + lit, len - lit);
+    }
+
+    // 按格式串S格式化参数,追加到out后面;转换说明在编译期已经解析好,运行时只做编码
+    template <class S, class... Args>
+    void FormatTo(std::string &out, const Args &...args)
+    {
+        FormatImpl<S>(out, std::index_sequence_for<Args...>(), args...);
+    }
+}
@@ -5,11 +5,23 @@
 #include <vector>
 #include <sstream>
 #include <cassert>
+#include <cstring>
+#include <atomic>
 #include "message.hpp"
+#include "util.hpp"
+#include "field.hpp"
 
-// 控制日志格式化输出:%d--日期, %t--缩进, %T--线程id, %p--日志等级, %c--日志器名称, %f--文件名, %l--行号, %m--有效载荷, %n--换行
+// 控制日志格式化输出:%d--日期(子格式见DateFormatterItem), %t--缩进, %T--线程id, %N--线程名(见SetThreadName), %p--日志等级, %c--日志器名称, %f--文件名, %l--行号, %m--有效载荷, %n--换行
+// 结构化输出: %k--结构化字段(logfmt风格的" key=value"), %K--整条日志输出为一行logfmt, %J--整条日志输出为一个JSON对象
 namespace wcm
 {
+#define DATE_CACHE_CNT 8 // 每个线程缓存的日期个数,按格式化项编号映射
+#define DATE_SLOT_CNT 4  // 一个日期格式中最多支持的秒以下字段个数
+#define STRUCT_DATE "%Y-%m-%dT%H:%M:%S.%6N%z" // %K和%J中时间的格式(ISO 8601)
+#define STRUCT_FIXED 256                       // %K和%J中与消息内容无关的部分(时间,键名,等级,行号,线程id)的最大长度
+#define JSON_PATTERN "%J%n"                    // 每行一个JSON对象
+#define LOGFMT_PATTERN "%K%n"                  // 每行一条logfmt
+
     class FormatterItem
     {
     public:
@@ -18,25 +30,171 @@ namespace wcm
     };
 
     // 输出日期
+    // 子格式除strftime支持的格式外,还支持秒以下的部分: %3N--毫秒, %6N--微秒, %9N或%N--纳秒(与date命令一致)
+    // 每个线程缓存当前这一秒渲染好的日期,同一秒内只需要改写秒以下的数字,不用再调用localtime_r和strftime
     class DateFormatterItem : public FormatterItem
     {
     public:
         DateFormatterItem(const std::string &fmt = "%H:%M:%S")
-            : _fmt(fmt)
+            : _fmt(fmt), _id(NewId())
         {
+            ParseFmt();
         }
 
         void Output(std::ostream &out, const LogMsg &msg) override
+        {
+            char s[128];
+            out.write(s, Format(s, msg));
+        }
+
+        // 将日期写入out,返回写入的字节数,out至少要有128字节空间
+        size_t Format(char *out, const LogMsg &msg)
+        {
+            DateCache &cache = LocalCache()[_id % DATE_CACHE_CNT];
+            // 缓存的不是这一秒的日期,重新渲染
+            if (cache.id != _id || cache.sec != msg._time.tv_sec)
+            {
+                Render(cache, msg._time.tv_sec);
+            }
+            memcpy(out, cache.buf, cache.len);
+            // 改写秒以下的数字
+            for (int i = 0; i < cache.slot_cnt; ++i)
+            {
+                long val = msg._time.tv_nsec / Pow10(9 - cache.slots[i].digits);
+                char *p = out + cache.slots[i].pos + cache.slots[i].digits;
+                for (int j = 0; j < cache.slots[i].digits; ++j)
+                {
+                    *--p = '0' + val % 10;
+                    val /= 10;
+                }
+            }
+            return cache.len;
+        }
+
+    private:
+        // 日期格式拆分后的一段: strftime子格式,或者秒以下字段
+        struct Segment
+        {
+            std::string strf; // strftime子格式,为空时表示秒以下字段
+            int digits;       // 秒以下字段的位数
+        };
+
+        // 一个秒以下字段在渲染结果中的位置
+        struct Slot
+        {
+            int pos;
+            int digits;
+        };
+
+        // 线程局部的日期缓存
+        struct DateCache
+        {
+            size_t id = 0;     // 所属格式化项的编号,0表示空
+            time_t sec = 0;    // 缓存的是哪一秒
+            size_t len = 0;    // 渲染结果长度
+            int slot_cnt = 0;  // 秒以下字段个数
+            Slot slots[DATE_SLOT_CNT];
+            char buf[128];     // 渲染结果,秒以下字段先用0占位
+        };
+
+        // 每个格式化项的唯一编号,缓存用它而不是对象地址来区分,防止地址复用读到别的格式
+        static size_t NewId()
+        {
+            static std::atomic<size_t> id(0);
+            return ++id;
+        }
+
+        static DateCache *LocalCache()
+        {
+            static thread_local DateCache cache[DATE_CACHE_CNT];
+            return cache;
+        }
+
+        static long Pow10(int n)
+        {
+            long val = 1;
+            while (n-- > 0)
+                val *= 10;
+            return val;
+        }
+
+        // 把_fmt拆分成strftime子格式和秒以下字段
+        void ParseFmt()
+        {
+            std::string strf;
+            int slots = 0;
+            size_t i = 0;
+            while (i < _fmt.size())
+            {
+                if (_fmt[i] != '%' || i + 1 == _fmt.size())
+                {
+                    strf += _fmt[i++];
+                    continue;
+                }
+                // %N 或 %1N ~ %9N
+                int digits = 0;
+                size_t len = 0;
+                if (_fmt[i + 1] == 'N')
+                {
+                    digits = 9;
+                    len = 2;
+                }
+                else if (_fmt[i + 1] >= '1' && _fmt[i + 1] <= '9' && i + 2 < _fmt.size() && _fmt[i + 2] == 'N')
+                {
+                    digits = _fmt[i + 1] - '0';
+                    len = 3;
+                }
+                if (digits == 0 || slots == DATE_SLOT_CNT)
+                {
+                    // 其他格式字符(包括%%)原样交给strftime
+                    strf += _fmt.substr(i, 2);
+                    i += 2;
+                    continue;
+                }
+                if (!strf.empty())
+                {
+                    _segments.push_back({strf, 0});
+                    strf.clear();
+                }
+                _segments.push_back({"", digits});
+                slots++;
+                i += len;
+            }
+            if (!strf.empty())
+            {
+                _segments.push_back({strf, 0});
+            }
+        }
+
+        // 渲染sec这一秒的日期到缓存中
+        void Render(DateCache &cache, time_t sec)
         {
             struct tm tm;
-            localtime_r(&msg._time, &tm); // 将时间戳格式化进结构体tm
-            char s[128] = {'\0'};
-            strftime(s, 127, _fmt.c_str(), &tm); // 将struct tm按照指定格式_fmt输出
-            out << s;
+            localtime_r(&sec, &tm); // 将时间戳格式化进结构体tm
+            cache.id = _id;
+            cache.sec = sec;
+            cache.len = 0;
+            cache.slot_cnt = 0;
+            for (const auto &seg : _segments)
+            {
+                size_t left = 127 - cache.len;
+                if (!seg.strf.empty())
+                {
+                    cache.len += strftime(cache.buf + cache.len, left, seg.strf.c_str(), &tm); // 将struct tm按照指定格式输出
+                }
+                else if ((size_t)seg.digits < left)
+                {
+                    cache.slots[cache.slot_cnt++] = {(int)cache.len, seg.digits};
+                    memset(cache.buf + cache.len, '0', seg.digits);
+                    cache.len += seg.digits;
+                }
+            }
         }
 
     private:
         std::string _fmt; // 控制时间输出格式
+        size_t _id;       // 格式化项编号
+        std::vector<Segment> _segments;
     };
 
     // 输出缩进
@@ -55,7 +213,17 @@ namespace wcm
     public:
         void Output(std::ostream &out, const LogMsg &msg)
         {
-            out << msg._tid;
+            out.write(msg._thread->tid_str, msg._thread->tid_len);
+        }
+    };
+
+    // 输出线程名
+    class ThreadNameFormatterItem : public FormatterItem
+    {
+    public:
+        void Output(std::ostream &out, const LogMsg &msg)
+        {
+            out.write(msg._thread->name, msg._thread->name_len);
         }
     };
 
@@ -119,6 +287,100 @@ namespace wcm
         }
     };
 
+    // 输出结构化字段
+    class FieldsFormatterItem : public FormatterItem
+    {
+    public:
+        void Output(std::ostream &out, const LogMsg &msg)
+        {
+            std::vector<char> buf(FIELD_EXPAND * msg._fields_len);
+            out.write(buf.data(), RenderFields(buf.data(), msg._fields, msg._fields_len, FIELD_LOGFMT) - buf.data());
+        }
+    };
+
+    // 整条日志输出为logfmt(%K)或JSON对象(%J),键名固定为time,level,logger,file,line,tid,msg,后面是结构化字段
+    // 所有字符串就地转义写进输出缓冲区,写入前已按最坏情况预留了空间
+    class StructFormatterItem : public FormatterItem
+    {
+    public:
+        StructFormatterItem(FieldStyle style)
+            : _style(style), _date(std::make_shared<DateFormatterItem>(STRUCT_DATE))
+        {
+        }
+
+        void Output(std::ostream &out, const LogMsg &msg)
+        {
+            std::vector<char> buf(MaxSize(msg));
+            out.write(buf.data(), Format(buf.data(), msg));
+        }
+
+        // 最多需要的字节数
+        static size_t MaxSize(const LogMsg &msg)
+        {
+            return STRUCT_FIXED + 6 * (msg._logger_name.size() + msg._file.size() + msg._payload.size()) + FIELD_EXPAND * msg._fields_len;
+        }
+
+        // 写入buf,返回写入的字节数,buf至少要有MaxSize(msg)字节空间
+        size_t Format(char *buf, const LogMsg &msg)
+        {
+            char *p = buf;
+            const char *level = LevelStr(msg._level);
+            if (_style == FIELD_JSON)
+            {
+                p = Append(p, "{\"time\":\"");
+                p += _date->Format(p, msg);
+                p = Append(p, "\",\"level\":\"");
+                p = Append(p, level);
+                p = Append(p, "\",\"logger\":\"");
+                p = JsonEscape(p, msg._logger_name.data(), msg._logger_name.size());
+                p = Append(p, "\",\"file\":\"");
+                p = JsonEscape(p, msg._file.data(), msg._file.size());
+                p = Append(p, "\",\"line\":");
+                p += Itoa(p, msg._line);
+                p = Append(p, ",\"tid\":");
+                memcpy(p, msg._thread->tid_str, msg._thread->tid_len);
+                p += msg._thread->tid_len;
+                p = Append(p, ",\"msg\":\"");
+                p = JsonEscape(p, msg._payload.data(), msg._payload.size());
+                *p++ = '"';
+                p = RenderFields(p, msg._fields, msg._fields_len, FIELD_JSON);
+                *p++ = '}';
+            }
+            else
+            {
+                p = Append(p, "time=");
+                p += _date->Format(p, msg);
+                p = Append(p, " level=");
+                p = Append(p, level);
+                p = Append(p, " logger=");
+                p = LogfmtValue(p, msg._logger_name.data(), msg._logger_name.size());
+                p = Append(p, " file=");
+                p = LogfmtValue(p, msg._file.data(), msg._file.size());
+                p = Append(p, " line=");
+                p += Itoa(p, msg._line);
+                p = Append(p, " tid=");
+                memcpy(p, msg._thread->tid_str, msg._thread->tid_len);
+                p += msg._thread->tid_len;
+                p = Append(p, " msg=");
+                p = LogfmtValue(p, msg._payload.data(), msg._payload.size());
+                p = RenderFields(p, msg._fields, msg._fields_len, FIELD_LOGFMT);
+            }
+            return p - buf;
+        }
+
+    private:
+        static char *Append(char *p, const char *str)
+        {
+            size_t len = strlen(str);
+            memcpy(p, str, len);
+            return p + len;
+        }
+
+    private:
+        FieldStyle _style;
+        std::shared_ptr<DateFormatterItem> _date;
+    };
+
     // 输出其他字符
     class OtherFormatterItem : public FormatterItem
     {
@@ -137,17 +399,47 @@ namespace wcm
         std::string _other;
     };
 
+    // 编译后的格式化指令,Formatter::Format()按顺序执行,不经过虚函数和ostream
+    enum FormatOpCode
+    {
+        OP_DATE,
+        OP_TAB,
+        OP_TID,
+        OP_THREAD,
+        OP_LEVEL,
+        OP_LOGGER,
+        OP_FILE,
+        OP_LINE,
+        OP_PAYLOAD,
+        OP_NLINE,
+        OP_FIELDS,
+        OP_STRUCT,
+        OP_OTHER
+    };
+
+    struct FormatOp
+    {
+        FormatOpCode code;
+        size_t off; // OP_OTHER: 在_literals中的起始位置, OP_DATE: 在_dates中的下标, OP_STRUCT: 在_structs中的下标
+        size_t len; // OP_OTHER: 字符串长度
+    };
+
     // 根据默认格式化组织日志消息
     class Formatter
     {
     public:
         using ptr = std::shared_ptr<Formatter>;
-        Formatter(const std::string &pattern = "[%c][%d{%H:%M:%S}][%p][%f:%l][%T] %m%n")
-            : _pattern(pattern)
+        Formatter(const std::string &pattern = "[%c][%d{%H:%M:%S}][%p][%f:%l][%T] %m%k%n")
+            : _pattern(pattern), _fixed_size(0), _logger_cnt(0), _file_cnt(0), _payload_cnt(0), _fields_cnt(0)
         {
             assert(ParsePattern());
         }
 
+        const std::string &Pattern() const
+        {
+            return _pattern;
+        }
+
         // 将日志信息以字符串的形式返回
         std::string Output(const LogMsg &msg)
         {
@@ -169,12 +461,91 @@ namespace wcm
             return out;
         }
 
+        // 将日志信息写入buf,返回写入的字节数,buf至少要有MaxSize(msg)字节空间
+        // 按编译好的指令数组直接memcpy,不经过ostream,也不分配内存
+        size_t Format(char *buf, const LogMsg &msg)
+        {
+            char *p = buf;
+            for (const auto &op : _ops)
+            {
+                switch (op.code)
+                {
+                case OP_OTHER:
+                    memcpy(p, _literals.data() + op.off, op.len);
+                    p += op.len;
+                    break;
+                case OP_DATE:
+                    p += _dates[op.off]->Format(p, msg);
+                    break;
+                case OP_TAB:
+                    *p++ = '\t';
+                    break;
+                case OP_NLINE:
+                    *p++ = '\n';
+                    break;
+                case OP_TID:
+                    memcpy(p, msg._thread->tid_str, msg._thread->tid_len);
+                    p += msg._thread->tid_len;
+                    break;
+                case OP_THREAD:
+                    memcpy(p, msg._thread->name, msg._thread->name_len);
+                    p += msg._thread->name_len;
+                    break;
+                case OP_LEVEL:
+                {
+                    const char *level = LevelStr(msg._level);
+                    size_t len = strlen(level);
+                    memcpy(p, level, len);
+                    p += len;
+                    break;
+                }
+                case OP_LOGGER:
+                    memcpy(p, msg._logger_name.data(), msg._logger_name.size());
+                    p += msg._logger_name.size();
+                    break;
+                case OP_FILE:
+                    memcpy(p, msg._file.data(), msg._file.size());
+                    p += msg._file.size();
+                    break;
+                case OP_LINE:
+                    p += Itoa(p, msg._line);
+                    break;
+                case OP_PAYLOAD:
+                    memcpy(p, msg._payload.data(), msg._payload.size());
+                    p += msg._payload.size();
+                    break;
+                case OP_FIELDS:
+                    p = RenderFields(p, msg._fields, msg._fields_len, FIELD_LOGFMT);
+                    break;
+                case OP_STRUCT:
+                    p += _structs[op.off]->Format(p, msg);
+                    break;
+                }
+            }
+            return p - buf;
+        }
+
+        // 将日志信息追加到out后面,out的容量够用时不会分配内存
+        void Format(std::string &out, const LogMsg &msg)
+        {
+            size_t old = out.size();
+            out.resize(old + MaxSize(msg));
+            out.resize(old + Format(&out[old], msg));
+        }
+
+        // 格式化一条日志最多需要的字节数
+        size_t MaxSize(const LogMsg &msg)
+        {
+            return _fixed_size + _logger_cnt * msg._logger_name.size() + _file_cnt * msg._file.size() + _payload_cnt * msg._payload.size() +
+                   _fields_cnt * FIELD_EXPAND * msg._fields_len + _structs.size() * StructFormatterItem::MaxSize(msg);
+        }
+
     private:
         // 解析_pattern,将对应格式化字符的类对象添加到_items
         // aaa%%[%d{%H:%M:%S}][%c] %m%n
         bool ParsePattern()
         {
-            int i = 0;
+            size_t i = 0;
             std::string key;
             std::string val;
             while (i < _pattern.size())
@@ -201,7 +572,7 @@ namespace wcm
                 // 走到这表示遇到格式化字符,先将之前的其他字符添加到_items
                 if (key.empty() && !val.empty())
                 {
-                    _items.push_back(CreateItem(key, val));
+                    AddItem(key, val);
                     val.clear();
                 }
                 i++; // 表示跳过%,直接到格式化字符的位置
@@ -230,7 +601,7 @@ namespace wcm
                     }
                     // 走到这表示遇到},跳过
                     i++;
-                    _items.push_back(CreateItem(key, val)); // 添加到_items
+                    AddItem(key, val); // 添加到_items
                     // 清空数据,以免影响后续的数据
                     key.clear();
                     val.clear();
@@ -240,7 +611,7 @@ namespace wcm
                 {
                     key += _pattern[i];
                     i++;
-                    _items.push_back(CreateItem(key, val)); // 添加到_items
+                    AddItem(key, val); // 添加到_items
                     // 清空数据,以免影响后续的数据
                     key.clear();
                 }
@@ -248,6 +619,75 @@ namespace wcm
             return true;
         }
 
+        // 创建格式化字符对应的类添加到_items,同时编译出对应的格式化指令添加到_ops
+        void AddItem(const std::string &key, const std::string &val)
+        {
+            FormatterItem::ptr item = CreateItem(key, val);
+            _items.push_back(item);
+            FormatOp op = {OP_OTHER, 0, 0};
+            if (key == "d")
+            {
+                op.code = OP_DATE;
+                op.off = _dates.size();
+                _dates.push_back(std::static_pointer_cast<DateFormatterItem>(item));
+                _fixed_size += 128;
+            }
+            else if (key == "t" || key == "n")
+            {
+                op.code = key == "t" ? OP_TAB : OP_NLINE;
+                _fixed_size += 1;
+            }
+            else if (key == "T" || key == "l")
+            {
+                op.code = key == "T" ? OP_TID : OP_LINE;
+                _fixed_size += 20; // 64位整数最长20个字符
+            }
+            else if (key == "N")
+            {
+                op.code = OP_THREAD;
+                _fixed_size += THREAD_NAME_MAX;
+            }
+            else if (key == "p")
+            {
+                op.code = OP_LEVEL;
+                _fixed_size += 6; // 最长的等级字符串"UNKNOW"
+            }
+            else if (key == "c")
+            {
+                op.code = OP_LOGGER;
+                _logger_cnt++;
+            }
+            else if (key == "f")
+            {
+                op.code = OP_FILE;
+                _file_cnt++;
+            }
+            else if (key == "m")
+            {
+                op.code = OP_PAYLOAD;
+                _payload_cnt++;
+            }
+            else if (key == "k")
+            {
+                op.code = OP_FIELDS;
+                _fields_cnt++;
+            }
+            else if (key == "K" || key == "J")
+            {
+                op.code = OP_STRUCT;
+                op.off = _structs.size();
+                _structs.push_back(std::static_pointer_cast<StructFormatterItem>(item));
+            }
+            else
+            {
+                op.off = _literals.size();
+                op.len = val.size();
+                _literals += val;
+                _fixed_size += val.size();
+            }
+            _ops.push_back(op);
+        }
+
         // 根据格式化字符创建对应类
         FormatterItem::ptr CreateItem(const std::string &key, const std::string &val)
         {
@@ -257,6 +697,8 @@ namespace wcm
                 return FormatterItem::ptr(new TabFormatterItem());
             if (key == "T")
                 return FormatterItem::ptr(new TidFormatterItem());
+            if (key == "N")
+                return FormatterItem::ptr(new ThreadNameFormatterItem());
             if (key == "p")
                 return FormatterItem::ptr(new LevelFormatterItem());
             if (key == "c")
@@ -269,6 +711,12 @@ namespace wcm
                 return FormatterItem::ptr(new PayloadFormatterItem());
             if (key == "n")
                 return FormatterItem::ptr(new NLineFormatterItem());
+            if (key == "k")
+                return FormatterItem::ptr(new FieldsFormatterItem());
+            if (key == "K")
+                return FormatterItem::ptr(new StructFormatterItem(FIELD_LOGFMT));
+            if (key == "J")
+                return FormatterItem::ptr(new StructFormatterItem(FIELD_JSON));
             if (key.empty())
                 return FormatterItem::ptr(new OtherFormatterItem(val));
             std::cerr << "无效的格式化设置: '%%" << key << "'." << std::endl; //表示设置了无效的格式化字符
@@ -278,5 +726,12 @@ namespace wcm
     private:
         std::string _pattern;                   // 格式化控制输出字符串
         std::vector<FormatterItem::ptr> _items; // 按顺序输出_items里的内容
+
+        std::vector<FormatOp> _ops;                                // 编译后的格式化指令
+        std::string _literals;                                     // 所有其他字符拼在一起,指令记录偏移和长度
+        std::vector<std::shared_ptr<DateFormatterItem>> _dates;    // 日期格式化项
+        std::vector<std::shared_ptr<StructFormatterItem>> _structs; // %K和%J格式化项
+        size_t _fixed_size;                                        // 与消息内容无关的最大输出长度
+        size_t _logger_cnt, _file_cnt, _payload_cnt, _fields_cnt;  // 各变长字段在格式中出现的次数
     };
 }
\ No newline at end of file
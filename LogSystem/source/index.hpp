@@ -0,0 +1,233 @@
+// 文本日志文件的旁路索引
+// 日志器格式化一批记录时顺便统计每INDEX_BLOCK字节左右一段的时间范围和出现过的等级(BatchInfo),
+// 开启索引的FileSink/RollFileSink写完数据后把这些统计追加到日志文件名加.idx的索引文件,只是每批一次write
+// tools/logquery读索引,只读取时间范围和等级都可能匹配的段,不用从头扫描整个日志文件
+//
+// 索引文件格式: 文件头"WCMIDX\1",然后是定长的IndexEntry,按offset递增
+// 没有被任何条目覆盖的区间(开启索引之前写的内容,或者不经过日志器直接写入的数据)视为可能匹配
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "level.hpp"
+
+namespace wcm
+{
+#define INDEX_BLOCK 16 * 1024 // 索引中一段的大致字节数,段总是从行首开始
+#define INDEX_MAGIC "WCMIDX\1" // 文件头,连同结尾的'\0'共8字节
+#define INDEX_MAGIC_LEN 8
+#define INDEX_SUFFIX ".idx"
+
+    // 一段日志的统计
+    struct IndexMark
+    {
+        size_t offset;    // 在这批数据中的起始位置
+        int64_t min_time; // 最早的日志时间,纳秒
+        int64_t max_time; // 最晚的日志时间,纳秒
+        uint32_t level_mask; // 出现过的等级,第i位对应等级i
+        uint32_t lines;   // 日志条数
+    };
+
+    // 一批格式化好的日志的统计,由日志器在格式化时填写,交给落地方式
+    struct BatchInfo
+    {
+        levels level = levels::UNKNOW; // 这批数据中的最高等级
+        std::vector<IndexMark> marks;  // 各段的统计,按offset递增
+
+        void Clear()
+        {
+            level = levels::UNKNOW;
+            marks.clear();
+        }
+
+        // 这批数据的pos位置开始是一条时间为time,等级为l的日志;离上一段开头超过INDEX_BLOCK字节时开始新的一段
+        void Add(size_t pos, const struct timespec &time, levels l)
+        {
+            int64_t t = time.tv_sec * 1000000000l + time.tv_nsec;
+            if (marks.empty() || pos - marks.back().offset >= INDEX_BLOCK)
+            {
+                marks.push_back(IndexMark{pos, t, t, 0, 0});
+            }
+            IndexMark &m = marks.back();
+            m.min_time = std::min(m.min_time, t);
+            m.max_time = std::max(m.max_time, t);
+            m.level_mask |= 1u << l;
+            m.lines++;
+            level = std::max(level, l);
+        }
+    };
+
+    // 索引文件中的一个条目,描述日志文件中[offset, offset + len)这一段
+    struct IndexEntry
+    {
+        uint64_t offset;
+        uint64_t len;
+        int64_t min_time;
+        int64_t max_time;
+        uint32_t level_mask;
+        uint32_t lines;
+    };
+
+    // 追加写一个日志文件的索引
+    // 先写日志数据再写索引,崩溃时索引可能比数据多出最后一批,读的时候按日志文件实际大小截断
+    class IndexWriter
+    {
+    public:
+        IndexWriter()
+            : _fd(-1), _offset(0)
+        {
+        }
+
+        ~IndexWriter()
+        {
+            Close();
+        }
+
+        // 为日志文件log_path打开索引,之后写入的数据从日志文件当前的末尾开始
+        bool Open(const std::string &log_path)
+        {
+            Close();
+            struct stat st;
+            _offset = stat(log_path.c_str(), &st) == 0 ? st.st_size : 0;
+            std::string path = log_path + INDEX_SUFFIX;
+            _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (_fd < 0)
+            {
+                std::cerr << "打开索引文件" << path << "失败" << std::endl;
+                return false;
+            }
+            if (lseek(_fd, 0, SEEK_END) == 0 && write(_fd, INDEX_MAGIC, INDEX_MAGIC_LEN) != INDEX_MAGIC_LEN)
+            {
+                Close();
+                return false;
+            }
+            return true;
+        }
+
+        void Close()
+        {
+            if (_fd >= 0)
+            {
+                close(_fd);
+                _fd = -1;
+            }
+        }
+
+        bool IsOpen() const
+        {
+            return _fd >= 0;
+        }
+
+        // 日志文件刚写入了一批长度为len的数据,info是它的统计
+        void Append(const BatchInfo &info, size_t len)
+        {
+            if (_fd < 0)
+            {
+                return;
+            }
+            _buf.clear();
+            for (size_t i = 0; i < info.marks.size(); ++i)
+            {
+                const IndexMark &m = info.marks[i];
+                size_t end = i + 1 < info.marks.size() ? info.marks[i + 1].offset : len;
+                if (end <= m.offset || end > len)
+                {
+                    continue; // 统计与数据对不上,宁可不索引
+                }
+                IndexEntry e = {_offset + m.offset, end - m.offset, m.min_time, m.max_time, m.level_mask, m.lines};
+                _buf.append((const char *)&e, sizeof(e));
+            }
+            if (!_buf.empty() && write(_fd, _buf.data(), _buf.size()) != (ssize_t)_buf.size())
+            {
+                std::cerr << "写索引文件失败,不再写索引" << std::endl;
+                Close();
+            }
+            _offset += len;
+        }
+
+        // 日志文件写入了一批没有统计的数据,这一段在索引中留空
+        void Skip(size_t len)
+        {
+            _offset += len;
+        }
+
+    private:
+        int _fd;
+        uint64_t _offset; // 日志文件当前的大小
+        std::string _buf; // 一批条目,复用避免每批申请内存
+    };
+
+    // 读取日志文件log_path的索引,只保留不超出日志文件大小的完整条目;没有索引或格式不对时返回false
+    bool LoadIndex(const std::string &log_path, uint64_t log_size, std::vector<IndexEntry> &entries)
+    {
+        entries.clear();
+        std::string path = log_path + INDEX_SUFFIX;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        char magic[INDEX_MAGIC_LEN];
+        bool ok = read(fd, magic, INDEX_MAGIC_LEN) == INDEX_MAGIC_LEN && memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LEN) == 0;
+        IndexEntry e;
+        while (ok && read(fd, &e, sizeof(e)) == sizeof(e))
+        {
+            if (e.offset + e.len > log_size)
+            {
+                break;
+            }
+            entries.push_back(e);
+        }
+        close(fd);
+        return ok;
+    }
+
+    // 日志文件中需要读取的一段
+    struct IndexRange
+    {
+        uint64_t offset;
+        uint64_t len;
+    };
+
+    // 根据索引找出可能包含[from, to]时间范围内(纳秒,闭区间),等级在mask中的日志的区间,相邻的区间合并
+    // 没有被索引覆盖的区间,以及含有不知道等级的数据(直接交给log()的文本)的段总是包含在结果中
+    std::vector<IndexRange> QueryIndex(const std::vector<IndexEntry> &entries, uint64_t log_size, int64_t from, int64_t to, uint32_t mask)
+    {
+        mask |= 1u << levels::UNKNOW;
+        std::vector<IndexRange> ranges;
+        auto add = [&](uint64_t offset, uint64_t len) {
+            if (len == 0)
+                return;
+            if (!ranges.empty() && ranges.back().offset + ranges.back().len == offset)
+                ranges.back().len += len;
+            else
+                ranges.push_back(IndexRange{offset, len});
+        };
+        uint64_t pos = 0; // 已经处理到的位置
+        for (const auto &e : entries)
+        {
+            if (e.offset < pos)
+            {
+                continue; // 与前面的条目重叠,索引已损坏,跳过
+            }
+            add(pos, e.offset - pos);
+            if (e.max_time >= from && e.min_time <= to && (e.level_mask & mask))
+            {
+                add(e.offset, e.len);
+            }
+            pos = e.offset + e.len;
+        }
+        if (log_size > pos)
+        {
+            add(pos, log_size - pos);
+        }
+        return ranges;
+    }
+}
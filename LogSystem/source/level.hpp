@@ -1,6 +1,19 @@
 #pragma once
 #include <iostream>
 
+// 与levels枚举值一一对应,供预处理器比较
+#define WCM_LEVEL_DEBUG 1
+#define WCM_LEVEL_INFO 2
+#define WCM_LEVEL_WARN 3
+#define WCM_LEVEL_ERROR 4
+#define WCM_LEVEL_FATAL 5
+#define WCM_LEVEL_OFF 6
+
+// 编译期最低输出等级,低于它的日志语句在编译期被整体移除,例如 -DWCM_ACTIVE_LEVEL=WCM_LEVEL_INFO
+#ifndef WCM_ACTIVE_LEVEL
+#define WCM_ACTIVE_LEVEL WCM_LEVEL_DEBUG
+#endif
+
 namespace wcm
 {
     //日志等级 -- 日志等级大于等于设置等级的允许输出
@@ -14,6 +27,7 @@ namespace wcm
         FATAL,
         OFF
     };
+    static_assert(levels::DEBUG == WCM_LEVEL_DEBUG && levels::OFF == WCM_LEVEL_OFF, "WCM_LEVEL_*与levels不一致");
 
     //将输出等级字符串化
     const char* LevelStr(levels l)
@@ -26,6 +40,7 @@ namespace wcm
         case ERROR: return "ERROR";
         case FATAL: return "FATAL";
         case OFF: return "OFF";
+        default: break;
         }
         return "UNKNOW";
     }
@@ -0,0 +1,195 @@
+// 调用点级别的日志限流
+// log.hpp中的LOG_RATE/LOG_EVERY_N/LOG_DEDUP宏在每个调用点用函数局部静态变量保存一份状态,
+// 判断发生在格式化和参数编码之前,被限掉的日志只花几次原子操作
+#pragma once
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include "util.hpp"
+#include "fmt.hpp"
+#include "field.hpp"
+#include "logger.hpp"
+
+namespace wcm
+{
+#define DUP_REPORT_INTERVAL 1000 // 同一条消息一直重复时,"重复了N次"记录之间的最短间隔,毫秒
+#define DUP_CHECK_EVERY 64       // 连续重复时每多少次检查一次是否该报告
+
+    // 令牌桶限流:每秒补充rate个令牌,最多积攒burst个
+    // 用GCRA算法实现,整个桶只是一个"理论到达时间",一次CAS完成判断和扣减,不加锁
+    class RateLimit
+    {
+    public:
+        RateLimit(double rate, size_t burst)
+            : _interval(rate > 0 ? (uint64_t)(1e9 / rate) : 0), _tat(0), _suppressed(0)
+        {
+            _tolerance = _interval * (burst > 0 ? burst - 1 : 0);
+        }
+
+        // 这一条是否可以输出;可以输出时suppressed为上次输出以来被限掉的条数
+        bool Allow(size_t &suppressed)
+        {
+            uint64_t now = SteadyNs();
+            uint64_t tat = _tat.load(std::memory_order_relaxed);
+            while (1)
+            {
+                uint64_t next = std::max(tat, now);
+                if (next - now > _tolerance)
+                {
+                    _suppressed.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (_tat.compare_exchange_weak(tat, next + _interval, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            suppressed = _suppressed.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+
+    private:
+        uint64_t _interval;  // 每个令牌的时间,纳秒
+        uint64_t _tolerance; // 允许提前的时间,即burst-1个令牌
+        std::atomic<uint64_t> _tat;        // 理论到达时间,单调时钟纳秒
+        std::atomic<size_t> _suppressed;   // 上次输出以来被限掉的条数
+    };
+
+    // 1/N采样:每n条输出第1条
+    class Sampler
+    {
+    public:
+        Sampler(size_t n)
+            : _n(n), _cnt(0)
+        {
+        }
+
+        bool Allow()
+        {
+            return _n <= 1 || _cnt.fetch_add(1, std::memory_order_relaxed) % _n == 0;
+        }
+
+    private:
+        size_t _n;
+        std::atomic<size_t> _cnt;
+    };
+
+    // 线程局部的参数打包缓冲区,LOG_DEDUP比较参数时使用,容量重复使用
+    std::string &DedupScratch()
+    {
+        static thread_local std::string scratch;
+        return scratch;
+    }
+
+    // 连续重复消息折叠:同一调用点的格式串固定,参数相同就是同一条消息,不需要格式化就能比较
+    // 参数按record.hpp的格式打包后逐字节比较,%s按字符串内容、%p按指针值,与输出的结果一致
+    // 与上一条相同时不输出,换成新消息时先报告上一条重复了多少次;一直重复时每DUP_REPORT_INTERVAL毫秒报告一次
+    // 还没报告的次数在日志器析构或调用点的静态对象析构(进程退出)时补报
+    class Dedup : public LoggerFinisher
+    {
+    public:
+        using Report = void (*)(Logger *logger, size_t repeats); // 以调用点的等级和位置输出"重复了N次"
+
+        Dedup()
+            : _seen(false), _repeats(0), _report(0), _bound(false), _logger(nullptr), _func(nullptr)
+        {
+        }
+
+        // 进程退出时日志器还在就补报
+        ~Dedup()
+        {
+            std::unique_lock<std::mutex> lock(FinisherMutex());
+            if (_logger != nullptr)
+            {
+                _logger->RemoveFinisher(this);
+                Finish(_logger);
+            }
+        }
+
+        // 返回这一条是否输出;repeats不为0时调用者应先输出"上一条日志重复了repeats次"
+        // 第一次调用时把调用点登记到logger上,调用点只对应一个日志器
+        template <class S, class... Args>
+        bool Allow(Logger *logger, Report func, size_t &repeats, const Args &...args)
+        {
+            constexpr size_t n = sizeof...(Args) - FieldCount<Args...>(); // 格式串参数的个数
+            auto tup = std::forward_as_tuple(args...);
+            std::string &key = DedupScratch();
+            key.clear();
+            PackPrefix<S>(key, tup, std::make_index_sequence<n>());
+            PackFields<n>(key, tup, std::make_index_sequence<sizeof...(Args) - n>());
+            if (!_bound.load(std::memory_order_acquire))
+            {
+                Bind(logger, func);
+            }
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (!_seen || key != _last)
+            {
+                _seen = true;
+                _last = key;
+                repeats = _repeats;
+                _repeats = 0;
+                _report = SteadyNs();
+                return true;
+            }
+            // 每DUP_CHECK_EVERY次重复才读一次时钟
+            if (++_repeats % DUP_CHECK_EVERY != 0)
+            {
+                return false;
+            }
+            uint64_t now = SteadyNs();
+            if (now - _report >= DUP_REPORT_INTERVAL * 1000000ul)
+            {
+                repeats = _repeats;
+                _repeats = 0;
+                _report = now;
+            }
+            return false;
+        }
+
+        // 日志器析构或者调用点析构时补报还没报告的重复次数,调用者持有FinisherMutex()
+        void Finish(Logger *logger) override
+        {
+            _logger = nullptr;
+            size_t repeats = 0;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                std::swap(repeats, _repeats);
+            }
+            if (repeats != 0)
+            {
+                _func(logger, repeats);
+            }
+        }
+
+    private:
+        void Bind(Logger *logger, Report func)
+        {
+            std::unique_lock<std::mutex> lock(FinisherMutex());
+            if (_bound.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+            _logger = logger;
+            _func = func;
+            logger->AddFinisher(this);
+            _bound.store(true, std::memory_order_release);
+        }
+
+        std::mutex _mutex;    // 保护下面四项
+        bool _seen;           // 是否已经有过上一条
+        std::string _last;    // 上一条消息打包后的参数
+        size_t _repeats;      // 还没报告的重复次数
+        uint64_t _report;     // 上次报告或者换消息的时间
+        std::atomic<bool> _bound; // 是否已经登记到日志器
+        Logger *_logger;      // 登记的日志器,日志器析构后为nullptr,由FinisherMutex()保护
+        Report _func;
+    };
+}
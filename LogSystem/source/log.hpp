@@ -1,5 +1,6 @@
 #pragma once
 #include "logger.hpp"
+#include "limit.hpp"
 
 namespace wcm
 {
@@ -15,17 +16,182 @@ namespace wcm
         return LoggerManager::GetInstancce().Root();
     }
 
-//宏函数代理
-#define debug(fmt, ...) debug(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define info(fmt, ...) info(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define warn(fmt, ...) warn(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define error(fmt, ...) error(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define fatal(fmt, ...) fatal(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
+    // 运行时设置一个名字及其所有子孙日志器的等级,名字按'.'分层,如SetLevel("db", levels::DEBUG)
+    void SetLevel(const std::string &name, levels level)
+    {
+        LoggerManager::GetInstancce().SetLevel(name, level);
+    }
+
+    // 取消一个名字的等级设置
+    void ResetLevel(const std::string &name)
+    {
+        LoggerManager::GetInstancce().ResetLevel(name);
+    }
+
+    // 获取默认日志器的裸指针,供宏使用,避免加锁和shared_ptr引用计数
+    Logger *RootPtr()
+    {
+        return LoggerManager::GetInstancce().RootPtr();
+    }
+
+    // 获取指定日志器的裸指针,不存在返回nullptr,注册过的日志器一直有效
+    Logger *GetLoggerPtr(const std::string &name)
+    {
+        return LoggerManager::GetInstancce().GetLoggerPtr(name);
+    }
+
+    // 宏在调用点缓存的日志器句柄,记下查找时日志器表的版本号
+    struct LoggerCache
+    {
+        std::atomic<uint64_t> generation{0}; // 0表示还没有缓存,日志器表的版本号从1开始
+        std::atomic<Logger *> logger{nullptr};
+    };
+
+    // 查找并缓存日志器:版本号没变时只有两次原子读和一次比较
+    // 有日志器注册(包括同名替换)后版本号改变,下次调用重新查找,不会一直使用被替换的日志器
+    // 日志器还没注册时退回默认日志器,不缓存,下次调用再查找
+    Logger *CachedLogger(LoggerCache &cache, const char *name)
+    {
+        uint64_t generation = LoggerManager::Generation().load(std::memory_order_acquire);
+        if (cache.generation.load(std::memory_order_acquire) == generation)
+        {
+            return cache.logger.load(std::memory_order_relaxed);
+        }
+        Logger *logger = GetLoggerPtr(name);
+        if (logger == nullptr)
+        {
+            return RootPtr();
+        }
+        cache.logger.store(logger, std::memory_order_relaxed);
+        cache.generation.store(generation, std::memory_order_release);
+        return logger;
+    }
+
+//宏函数代理 -- 走类型安全接口,格式串必须是字符串字面量,编译期检查转换说明与参数是否匹配
+//需要运行时格式串时可以加括号绕过宏: (logger->debug)(__FILE__, __LINE__, fmt, ...)
+#define debug(fmt, ...) debug(__FILE__, __LINE__, WCM_FMT(fmt), ##__VA_ARGS__)
+#define info(fmt, ...) info(__FILE__, __LINE__, WCM_FMT(fmt), ##__VA_ARGS__)
+#define warn(fmt, ...) warn(__FILE__, __LINE__, WCM_FMT(fmt), ##__VA_ARGS__)
+#define error(fmt, ...) error(__FILE__, __LINE__, WCM_FMT(fmt), ##__VA_ARGS__)
+#define fatal(fmt, ...) fatal(__FILE__, __LINE__, WCM_FMT(fmt), ##__VA_ARGS__)
 
 //宏函数默认使用默认日志器输出
-#define DEBUG(fmt, ...) wcm::RootLogger()->debug(fmt, ##__VA_ARGS__)
-#define INFO(fmt, ...) wcm::RootLogger()->info(fmt, ##__VA_ARGS__)
-#define WARN(fmt, ...) wcm::RootLogger()->warn(fmt, ##__VA_ARGS__)
-#define ERROR(fmt, ...) wcm::RootLogger()->error(fmt, ##__VA_ARGS__)
-#define FATAL(fmt, ...) wcm::RootLogger()->fatal(fmt, ##__VA_ARGS__)
+//先用一次relaxed原子读判断等级,等级不够时不会对参数求值;低于WCM_ACTIVE_LEVEL的语句在编译期整体移除
+//宏内部给成员函数名加了括号,避免再次被上面的代理宏展开
+#define WCM_LOG(logger, level, func, fmt, ...)                                   \
+    do                                                                           \
+    {                                                                            \
+        wcm::Logger *_wcm_logger = (logger);                                     \
+        if (_wcm_logger->Enabled(level))                                         \
+            (_wcm_logger->func)(__FILE__, __LINE__, WCM_FMT(fmt), ##__VA_ARGS__); \
+    } while (0)
+
+//指定日志器名(字符串字面量)的句柄,每个调用点用函数局部静态变量缓存,只在第一次调用和有日志器注册之后查表
+#define WCM_LOGGER(name)                                    \
+    ([]() -> wcm::Logger * {                                \
+        static wcm::LoggerCache _wcm_cache;                 \
+        return wcm::CachedLogger(_wcm_cache, name);         \
+    }())
+
+#if WCM_ACTIVE_LEVEL <= WCM_LEVEL_DEBUG
+#define DEBUG(fmt, ...) WCM_LOG(wcm::RootPtr(), wcm::levels::DEBUG, debug, fmt, ##__VA_ARGS__)
+#define LOGGER_DEBUG(name, fmt, ...) WCM_LOG(WCM_LOGGER(name), wcm::levels::DEBUG, debug, fmt, ##__VA_ARGS__)
+#else
+#define DEBUG(fmt, ...) (void)0
+#define LOGGER_DEBUG(name, fmt, ...) (void)0
+#endif
+#if WCM_ACTIVE_LEVEL <= WCM_LEVEL_INFO
+#define INFO(fmt, ...) WCM_LOG(wcm::RootPtr(), wcm::levels::INFO, info, fmt, ##__VA_ARGS__)
+#define LOGGER_INFO(name, fmt, ...) WCM_LOG(WCM_LOGGER(name), wcm::levels::INFO, info, fmt, ##__VA_ARGS__)
+#else
+#define INFO(fmt, ...) (void)0
+#define LOGGER_INFO(name, fmt, ...) (void)0
+#endif
+#if WCM_ACTIVE_LEVEL <= WCM_LEVEL_WARN
+#define WARN(fmt, ...) WCM_LOG(wcm::RootPtr(), wcm::levels::WARN, warn, fmt, ##__VA_ARGS__)
+#define LOGGER_WARN(name, fmt, ...) WCM_LOG(WCM_LOGGER(name), wcm::levels::WARN, warn, fmt, ##__VA_ARGS__)
+#else
+#define WARN(fmt, ...) (void)0
+#define LOGGER_WARN(name, fmt, ...) (void)0
+#endif
+#if WCM_ACTIVE_LEVEL <= WCM_LEVEL_ERROR
+#define ERROR(fmt, ...) WCM_LOG(wcm::RootPtr(), wcm::levels::ERROR, error, fmt, ##__VA_ARGS__)
+#define LOGGER_ERROR(name, fmt, ...) WCM_LOG(WCM_LOGGER(name), wcm::levels::ERROR, error, fmt, ##__VA_ARGS__)
+#else
+#define ERROR(fmt, ...) (void)0
+#define LOGGER_ERROR(name, fmt, ...) (void)0
+#endif
+#if WCM_ACTIVE_LEVEL <= WCM_LEVEL_FATAL
+#define FATAL(fmt, ...) WCM_LOG(wcm::RootPtr(), wcm::levels::FATAL, fatal, fmt, ##__VA_ARGS__)
+#define LOGGER_FATAL(name, fmt, ...) WCM_LOG(WCM_LOGGER(name), wcm::levels::FATAL, fatal, fmt, ##__VA_ARGS__)
+#else
+#define FATAL(fmt, ...) (void)0
+#define LOGGER_FATAL(name, fmt, ...) (void)0
+#endif
+
+//调用点限流 -- level写等级名(DEBUG/INFO/WARN/ERROR/FATAL),每个调用点有一份自己的静态状态
+//判断顺序: 编译期等级 -> 日志器等级 -> 调用点限流 -> 格式化,被限掉的日志不会格式化也不会进入缓冲区
+//被限掉的条数在下一条放行时以同等级输出一行说明
+#define WCM_FUNC_DEBUG debug
+#define WCM_FUNC_INFO info
+#define WCM_FUNC_WARN warn
+#define WCM_FUNC_ERROR error
+#define WCM_FUNC_FATAL fatal
+
+//令牌桶限流: 平均每秒最多rate条,最多连续输出burst条
+#define LOG_RATE(logger, level, rate, burst, fmt, ...)                                                          \
+    do                                                                                                          \
+    {                                                                                                           \
+        if (WCM_LEVEL_##level < WCM_ACTIVE_LEVEL)                                                               \
+            break;                                                                                              \
+        wcm::Logger *_wcm_logger = (logger);                                                                    \
+        if (!_wcm_logger->Enabled(wcm::levels::level))                                                          \
+            break;                                                                                              \
+        static wcm::RateLimit _wcm_limit((rate), (burst));                                                      \
+        size_t _wcm_suppressed = 0;                                                                             \
+        if (!_wcm_limit.Allow(_wcm_suppressed))                                                                 \
+            break;                                                                                              \
+        if (_wcm_suppressed != 0)                                                                               \
+            (_wcm_logger->WCM_FUNC_##level)(__FILE__, __LINE__, WCM_FMT("此处%zu条日志因限流被丢弃"), _wcm_suppressed); \
+        (_wcm_logger->WCM_FUNC_##level)(__FILE__, __LINE__, WCM_FMT(fmt), ##__VA_ARGS__);                      \
+    } while (0)
+
+//1/N采样: 每n条只输出第1条
+#define LOG_EVERY_N(logger, level, n, fmt, ...)                                            \
+    do                                                                                     \
+    {                                                                                      \
+        if (WCM_LEVEL_##level < WCM_ACTIVE_LEVEL)                                          \
+            break;                                                                         \
+        wcm::Logger *_wcm_logger = (logger);                                               \
+        if (!_wcm_logger->Enabled(wcm::levels::level))                                     \
+            break;                                                                         \
+        static wcm::Sampler _wcm_sampler((n));                                             \
+        if (_wcm_sampler.Allow())                                                          \
+            (_wcm_logger->WCM_FUNC_##level)(__FILE__, __LINE__, WCM_FMT(fmt), ##__VA_ARGS__); \
+    } while (0)
+
+//连续重复折叠: 参数与这个调用点上一条相同时不输出,换成新消息或一直重复超过DUP_REPORT_INTERVAL毫秒时输出重复次数
+//参数只求值一次,先打包比较,相同时不格式化;日志器析构或进程退出时补报还没报告的重复次数
+#define LOG_DEDUP(logger, level, fmt, ...)                                                                         \
+    do                                                                                                             \
+    {                                                                                                              \
+        if (WCM_LEVEL_##level < WCM_ACTIVE_LEVEL)                                                                  \
+            break;                                                                                                 \
+        wcm::Logger *_wcm_logger = (logger);                                                                       \
+        if (!_wcm_logger->Enabled(wcm::levels::level))                                                             \
+            break;                                                                                                 \
+        static wcm::Dedup _wcm_dedup;                                                                              \
+        [&](const auto &..._wcm_args) {                                                                            \
+            size_t _wcm_repeats = 0;                                                                               \
+            auto _wcm_report = [](wcm::Logger *_wcm_l, size_t _wcm_n) {                                            \
+                (_wcm_l->WCM_FUNC_##level)(__FILE__, __LINE__, WCM_FMT("上一条日志重复了%zu次"), _wcm_n);           \
+            };                                                                                                     \
+            auto _wcm_fmt = WCM_FMT(fmt);                                                                          \
+            bool _wcm_allow = _wcm_dedup.Allow<decltype(_wcm_fmt)>(_wcm_logger, _wcm_report, _wcm_repeats, _wcm_args...); \
+            if (_wcm_repeats != 0)                                                                                 \
+                _wcm_report(_wcm_logger, _wcm_repeats);                                                            \
+            if (_wcm_allow)                                                                                        \
+                (_wcm_logger->WCM_FUNC_##level)(__FILE__, __LINE__, _wcm_fmt, _wcm_args...);                       \
+        }(__VA_ARGS__);                                                                                            \
+    } while (0)
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <pthread.h>
 #include <atomic>
 #include <vector>
+#include <algorithm>
 #include "level.hpp"
 #include "sink.hpp"
 #include "formatter.hpp"
@@ -11,174 +12,817 @@
 #include <stdio.h>
 #include <mutex>
 #include "looper.hpp"
+#include "backend.hpp"
+#include "worker.hpp"
+#include "record.hpp"
+#include "binlog.hpp"
+#include "fmt.hpp"
+#include "crash.hpp"
 #include <unordered_map>
+#include <type_traits>
 
 namespace wcm
 {
-    class Logger
+#define LOGV_INLINE 512 // printf风格接口栈上格式化缓冲区的大小,更长的有效载荷使用线程局部的缓冲区
+#define WCM_INLINE inline __attribute__((always_inline)) // 日志调用的快速路径,强制内联到调用点
+#define WCM_COLD __attribute__((noinline, cold))          // 等级判断通过后的慢速路径,不内联,放到冷代码段
+
+    // 参数传给慢速路径的方式:标量按值传递,调用点不用为了取地址把循环变量等写回栈上
+    template <class T>
+    using ColdArg = typename std::conditional<std::is_scalar<T>::value, T, const T &>::type;
+
+    class Logger;
+
+    // 日志器停止前还要写出日志的对象,比如LOG_DEDUP调用点还没报告的重复次数
+    // 日志器析构开始时(仍能正常输出)对登记过的对象调用Finish(),之后不再使用它们
+    class LoggerFinisher
+    {
+    public:
+        virtual void Finish(Logger *logger) = 0;
+
+    protected:
+        ~LoggerFinisher()
+        {
+        }
+    };
+
+    // 保护所有日志器的收尾对象登记表,登记和注销都很少发生,共用一把锁
+    // 不释放: 静态对象析构时日志器和收尾对象还可能用到它
+    std::mutex &FinisherMutex()
+    {
+        static std::mutex *mutex = new std::mutex;
+        return *mutex;
+    }
+
+    class Logger : public CrashDrainable
     {
     public:
         using ptr = std::shared_ptr<Logger>;
-        Logger(const std::string &name, levels level, const std::vector<Sink::ptr> &sinks)
-            : _name(name), _level(level), _sinks(sinks.begin(), sinks.end()), _fmter(std::make_shared<Formatter>())
+        Logger(const std::string &name, levels level, const std::vector<Sink::ptr> &sinks, const Formatter::ptr &fmter)
+            : _name(name), _level(level), _base_level(level), _fmter(fmter)
+        {
+            // 二进制落地方式接收未格式化的记录,与文本落地方式分开存放
+            for (const auto &e : sinks)
+            {
+                if (e->Binary())
+                    _bin_sinks.push_back(e);
+                else
+                    _sinks.push_back(e);
+            }
+        }
+
+        const std::string &Name() const
+        {
+            return _name;
+        }
+
+        // 构建时指定的等级,层级中没有为它或它的祖先设置等级时生效
+        levels BaseLevel() const
+        {
+            return _base_level;
+        }
+
+        // 某个等级的日志当前是否会输出,只有一次relaxed原子读,宏在求值参数之前先调用它
+        bool Enabled(levels level) const
+        {
+            return level >= _level.load(std::memory_order_relaxed);
+        }
+
+        // 运行时修改日志器的输出等级
+        void SetLevel(levels level)
+        {
+            _level.store(level, std::memory_order_relaxed);
+        }
+
+        // 类型安全的接口,log.hpp中的宏会把格式串包装成FmtString类型调用它们:编译期检查格式串,运行时按参数类型直接编码
+        template <class S, class... Args, typename std::enable_if<std::is_base_of<FmtString, S>::value, int>::type = 0>
+        WCM_INLINE void debug(const char *file, size_t line, S s, const Args &...args)
+        {
+            logat<levels::DEBUG>(file, line, s, args...);
+        }
+
+        template <class S, class... Args, typename std::enable_if<std::is_base_of<FmtString, S>::value, int>::type = 0>
+        WCM_INLINE void info(const char *file, size_t line, S s, const Args &...args)
+        {
+            logat<levels::INFO>(file, line, s, args...);
+        }
+
+        template <class S, class... Args, typename std::enable_if<std::is_base_of<FmtString, S>::value, int>::type = 0>
+        WCM_INLINE void warn(const char *file, size_t line, S s, const Args &...args)
+        {
+            logat<levels::WARN>(file, line, s, args...);
+        }
+
+        template <class S, class... Args, typename std::enable_if<std::is_base_of<FmtString, S>::value, int>::type = 0>
+        WCM_INLINE void error(const char *file, size_t line, S s, const Args &...args)
+        {
+            logat<levels::ERROR>(file, line, s, args...);
+        }
+
+        template <class S, class... Args, typename std::enable_if<std::is_base_of<FmtString, S>::value, int>::type = 0>
+        WCM_INLINE void fatal(const char *file, size_t line, S s, const Args &...args)
+        {
+            logat<levels::FATAL>(file, line, s, args...);
+        }
+
+        // 各等级类型安全接口的公共入口:强制内联到调用点,只有一次relaxed原子读,一次比较和一次跳转
+        // 等级够了才调用不内联的logslow(),格式化和入队的代码不会在每个调用点展开,热循环中关闭的日志几乎不占指令缓存
+        template <levels L, class S, class... Args>
+        WCM_INLINE void logat(const char *file, size_t line, S, const Args &...args)
         {
+            CheckArgs<S, Args...>(); // 编译期检查格式串与参数,kv字段放在最后
+            if constexpr (L >= WCM_ACTIVE_LEVEL) // 低于编译期等级时函数体为空
+            {
+                if (Enabled(L))
+                {
+                    logslow<L, S, Args...>(file, line, args...);
+                }
+            }
         }
 
-        void debug(const char *file, size_t line, const std::string &fmt, ...)
+        // printf风格的不定参接口,格式串可以是运行时的字符串
+        // 不定参函数无法内联,等级判断之后只做va_start,其余工作交给logva()
+        void debug(const char *file, size_t line, const char *fmt, ...)
         {
-            // 判断当前等级是否可以输出
-            if (levels::DEBUG < _level)
+            if (!Enabled(levels::DEBUG))
             {
                 return;
             }
-            // 获取不定参
             va_list ap;
             va_start(ap, fmt);
-            char *res;
-            vasprintf(&res, fmt.c_str(), ap);
+            logva(levels::DEBUG, file, line, fmt, ap);
             va_end(ap);
-            LogMsg msg(_name, Time(), levels::DEBUG, file, line, res); // 填充日志消息属性
-            std::stringstream ss;
-            _fmter->Output(ss, msg);
-            log(ss.str().c_str(), ss.str().size());
-            free(res); // vasprintf()函数会为res开辟一块存储空间,记得释放
         }
 
-        void info(const char *file, size_t line, const std::string &fmt, ...)
+        void info(const char *file, size_t line, const char *fmt, ...)
         {
-            // 判断当前等级是否可以输出
-            if (levels::INFO < _level)
+            if (!Enabled(levels::INFO))
             {
                 return;
             }
-            // 获取不定参
             va_list ap;
             va_start(ap, fmt);
-            char *res;
-            vasprintf(&res, fmt.c_str(), ap);
+            logva(levels::INFO, file, line, fmt, ap);
             va_end(ap);
-            LogMsg msg(_name, Time(), levels::INFO, file, line, res); // 填充日志消息属性
-            std::stringstream ss;
-            _fmter->Output(ss, msg);
-            log(ss.str().c_str(), ss.str().size());
-            free(res); // vasprintf()函数会为res开辟一块存储空间,记得释放
         }
 
-        void warn(const char *file, size_t line, const std::string &fmt, ...)
+        void warn(const char *file, size_t line, const char *fmt, ...)
         {
-            // 判断当前等级是否可以输出
-            if (levels::WARN < _level)
+            if (!Enabled(levels::WARN))
             {
                 return;
             }
-            // 获取不定参
             va_list ap;
             va_start(ap, fmt);
-            char *res;
-            vasprintf(&res, fmt.c_str(), ap);
+            logva(levels::WARN, file, line, fmt, ap);
             va_end(ap);
-            LogMsg msg(_name, Time(), levels::WARN, file, line, res); // 填充日志消息属性
-            std::stringstream ss;
-            _fmter->Output(ss, msg);
-            log(ss.str().c_str(), ss.str().size());
-            free(res); // vasprintf()函数会为res开辟一块存储空间,记得释放
         }
 
-        void error(const char *file, size_t line, const std::string &fmt, ...)
+        void error(const char *file, size_t line, const char *fmt, ...)
         {
-            // 判断当前等级是否可以输出
-            if (levels::ERROR < _level)
+            if (!Enabled(levels::ERROR))
             {
                 return;
             }
-            // 获取不定参
             va_list ap;
             va_start(ap, fmt);
-            char *res;
-            vasprintf(&res, fmt.c_str(), ap);
+            logva(levels::ERROR, file, line, fmt, ap);
             va_end(ap);
-            LogMsg msg(_name, Time(), levels::ERROR, file, line, res); // 填充日志消息属性
-            std::stringstream ss;
-            _fmter->Output(ss, msg);
-            log(ss.str().c_str(), ss.str().size());
-            free(res); // vasprintf()函数会为res开辟一块存储空间,记得释放
         }
 
-        void fatal(const char *file, size_t line, const std::string &fmt, ...)
+        void fatal(const char *file, size_t line, const char *fmt, ...)
         {
-            // 判断当前等级是否可以输出
-            if (levels::FATAL < _level)
+            if (!Enabled(levels::FATAL))
             {
                 return;
             }
-            // 获取不定参
             va_list ap;
             va_start(ap, fmt);
-            char *res;
-            vasprintf(&res, fmt.c_str(), ap);
+            logva(levels::FATAL, file, line, fmt, ap);
             va_end(ap);
-            LogMsg msg(_name, Time(), levels::FATAL, file, line, res); // 填充日志消息属性
-            std::stringstream ss;
-            _fmter->Output(ss, msg);
-            log(ss.str().c_str(), ss.str().size());
-            free(res); // vasprintf()函数会为res开辟一块存储空间,记得释放
+        }
+
+        // 生成有效载荷后交给logpayload(),异步日志器会重写它把格式化工作交给后台线程
+        virtual void logv(levels level, const char *file, size_t line, const char *fmt, va_list ap)
+        {
+            // 先格式化到栈上的缓冲区,大多数日志放得下,不申请内存;放不下时再格式化到线程局部的缓冲区,容量保留下来重复使用
+            char buf[LOGV_INLINE];
+            va_list cp;
+            va_copy(cp, ap);
+            int n = vsnprintf(buf, sizeof(buf), fmt, cp);
+            va_end(cp);
+            if (n < 0)
+            {
+                return;
+            }
+            if ((size_t)n < sizeof(buf))
+            {
+                logpayload(level, file, line, buf, n, nullptr, 0);
+                return;
+            }
+            std::string &payload = PayloadScratch();
+            payload.resize(n);
+            vsnprintf(&payload[0], n + 1, fmt, ap);
+            logpayload(level, file, line, payload.data(), payload.size(), nullptr, 0);
         }
 
         virtual void log(const char *data, size_t len) = 0;
 
+        // 同步刷新:等调用前写入的日志都交给了落地方式,再让落地方式写出用户态缓冲;fatal()输出后自动调用
+        virtual void Flush()
+        {
+        }
+
+        // 登记收尾对象,调用者持有FinisherMutex()
+        void AddFinisher(LoggerFinisher *finisher)
+        {
+            if (std::find(_finishers.begin(), _finishers.end(), finisher) == _finishers.end())
+                _finishers.push_back(finisher);
+        }
+
+        // 注销收尾对象,收尾对象先于日志器析构时调用,调用者持有FinisherMutex()
+        void RemoveFinisher(LoggerFinisher *finisher)
+        {
+            _finishers.erase(std::remove(_finishers.begin(), _finishers.end(), finisher), _finishers.end());
+        }
+
+        // 收到致命信号时调用(见crash.hpp):写出各文本落地方式用户态缓冲中的数据
+        void CrashDrain() override
+        {
+            for (const auto &e : _sinks)
+            {
+                e->logcrash(nullptr, 0);
+            }
+        }
+
     protected:
+        // 子类析构开始时调用,此时日志器还能正常输出,让收尾对象写出最后的日志
+        void Finish()
+        {
+            std::unique_lock<std::mutex> lock(FinisherMutex());
+            std::vector<LoggerFinisher *> finishers;
+            finishers.swap(_finishers);
+            for (auto e : finishers)
+            {
+                e->Finish(this);
+            }
+        }
+
+        // 等级判断通过之后的类型安全路径,每个调用点的参数类型组合只生成一份,不内联
+        template <levels L, class S, class... Args>
+        WCM_COLD void logslow(const char *file, size_t line, ColdArg<Args>... args)
+        {
+            logt<S>(L, file, line, args...);
+            if constexpr (L == levels::FATAL)
+            {
+                Flush(); // 进程可能随后就退出,等这条以及之前的日志都写出
+            }
+        }
+
+        // 等级判断通过之后的printf风格路径
+        WCM_COLD void logva(levels level, const char *file, size_t line, const char *fmt, va_list ap)
+        {
+            logv(level, file, line, fmt, ap);
+            if (level == levels::FATAL)
+            {
+                Flush();
+            }
+        }
+
+        // 类型安全接口的公共部分:能延迟格式化时只打包原始参数,否则直接编码出有效载荷
+        // 参数末尾的kv字段总是打包成二进制,跟在格式串参数或有效载荷后面
+        template <class S, class... Args>
+        void logt(levels level, const char *file, size_t line, const Args &...args)
+        {
+            constexpr size_t n = sizeof...(Args) - FieldCount<Args...>(); // 格式串参数的个数
+            auto tup = std::forward_as_tuple(args...);
+            if (deferrable())
+            {
+                std::string &rec = RecordScratch();
+                rec.resize(sizeof(RecordHead)); // 先占住头部的位置
+                PackPrefix<S>(rec, tup, std::make_index_sequence<n>());
+                size_t fields = rec.size() - sizeof(RecordHead);
+                PackFields<n>(rec, tup, std::make_index_sequence<sizeof...(Args) - n>());
+                logrecord(level, file, line, S::get(), rec, fields); // 格式串是字面量,只记录指针是安全的
+                return;
+            }
+            std::string &payload = PayloadScratch();
+            payload.clear();
+            FormatPrefix<S>(payload, tup, std::make_index_sequence<n>());
+            if constexpr (n == sizeof...(Args))
+            {
+                logpayload(level, file, line, payload.data(), payload.size(), nullptr, 0);
+            }
+            else
+            {
+                std::string &fields = FieldScratch();
+                fields.clear();
+                PackFields<n>(fields, tup, std::make_index_sequence<sizeof...(Args) - n>());
+                logpayload(level, file, line, payload.data(), payload.size(), fields.data(), fields.size());
+            }
+        }
+
+        // 有效载荷已生成,组织成完整的日志交给log()输出;fields是打包的结构化字段
+        virtual void logpayload(levels level, const char *file, size_t line, const char *payload, size_t len, const char *fields, size_t fields_len)
+        {
+            LogMsg msg(_name, TimeSpec(), level, file, line, std::string_view(payload, len)); // 填充日志消息属性,只引用不拷贝
+            msg._fields = fields;
+            msg._fields_len = fields_len;
+            static thread_local std::string out; // 线程局部的输出缓冲区,容量保留下来重复使用
+            static thread_local BatchInfo info;
+            out.clear();
+            info.Clear();
+            info.Add(0, msg._time, level);
+            _fmter->Format(out, msg);
+            logformatted(out.data(), out.size(), info);
+        }
+
+        // 输出格式化好的数据,info用于按等级处理和建立索引的落地方式
+        virtual void logformatted(const char *data, size_t len, const BatchInfo &info)
+        {
+            log(data, len);
+        }
+
+        // 是否支持把原始参数打包交给后台线程格式化
+        virtual bool deferrable()
+        {
+            return false;
+        }
+
+        // 输出打包好的原始参数,rec开头预留了RecordHead的位置,fields是结构化字段在记录体中的起始位置
+        virtual void logrecord(levels level, const char *file, size_t line, const char *fmt, std::string &rec, size_t fields)
+        {
+        }
+
+        // 填写rec开头预留的记录头,fields为npos表示没有结构化字段
+        void FillHead(RecordType type, levels level, const char *file, size_t line, const char *fmt, std::string &rec, size_t fields = std::string::npos)
+        {
+            RecordHead head;
+            head.size = rec.size();
+            head.type = type;
+            head.level = level;
+            head.line = line;
+            head.fields = std::min(fields, rec.size() - sizeof(head));
+            head.time = TimeSpec();
+            head.thread = CurrentThread();
+            head.file = file;
+            head.fmt = fmt;
+            memcpy(&rec[0], &head, sizeof(head));
+        }
+
+        // 把一批记录格式化成文本追加到out,同时把每条日志的位置,时间和等级记到info,交给按等级刷盘和建立索引的落地方式
+        // out和info要由调用者一起清空,info中的位置是相对out开头的
+        void FormatRecords(const char *data, size_t len, std::string &out, BatchInfo &info)
+        {
+            size_t pos = 0;
+            while (pos + sizeof(RecordHead) <= len)
+            {
+                RecordHead head;
+                memcpy(&head, data + pos, sizeof(head));
+                const char *body = data + pos + sizeof(head);
+                size_t body_len = head.size - sizeof(head);
+                pos += head.size;
+                info.Add(out.size(), head.time, (levels)head.level);
+                if (head.type == RecordType::FORMATTED)
+                {
+                    out.append(body, body_len);
+                    continue;
+                }
+                size_t fields = std::min((size_t)head.fields, body_len);
+                std::string_view payload(body, fields); // 已生成的有效载荷直接引用记录中的数据
+                if (head.type == RecordType::DEFERRED)
+                {
+                    _payload.clear();
+                    DecodeArgs(_payload, head.fmt, body, fields);
+                    payload = _payload;
+                }
+                LogMsg msg(_name, head.time, (levels)head.level, head.file, head.line, payload, head.thread);
+                msg._fields = body + fields;
+                msg._fields_len = body_len - fields;
+                _fmter->Format(out, msg);
+            }
+        }
+
+        // 把一批记录交给各二进制落地方式
+        void WriteRecords(const char *data, size_t len)
+        {
+            for (const auto &e : _bin_sinks)
+            {
+                e->logrecords(_name, _fmter->Pattern(), data, len);
+            }
+        }
+
         std::string _name; // 日志器名
         std::mutex _mutex;
-        std::atomic<levels> _level;    // 日志器允许输出等级
-        std::vector<Sink::ptr> _sinks; // 落地方式数组
+        std::atomic<levels> _level;    // 日志器允许输出等级,层级等级变化时由LoggerManager直接写入生效值
+        levels _base_level;            // 构建时指定的等级
+        std::vector<Sink::ptr> _sinks; // 文本落地方式数组
+        std::vector<Sink::ptr> _bin_sinks; // 二进制落地方式数组
         Formatter::ptr _fmter;
+        std::string _payload; // FormatRecords解码出的有效载荷,异步日志器只在后台线程使用,同步日志器在锁内使用
+        BatchInfo _info;      // FormatRecords记下的统计,使用规则同_payload
+        std::vector<LoggerFinisher *> _finishers; // 收尾对象,由FinisherMutex()保护
     };
 
     // 同步日志器
     class SyncLogger : public Logger
     {
     public:
-        SyncLogger(const std::string &name, levels level, const std::vector<Sink::ptr> &sinks)
-            : Logger(name, level, sinks)
+        SyncLogger(const std::string &name, levels level, const std::vector<Sink::ptr> &sinks, const Formatter::ptr &fmter)
+            : Logger(name, level, sinks, fmter)
         {
         }
 
+        ~SyncLogger()
+        {
+            Finish();
+            CrashUnregister(this);
+        }
+
+        void Flush() override
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (const auto &e : _sinks)
+            {
+                e->flush();
+            }
+            for (const auto &e : _bin_sinks)
+            {
+                e->flush();
+            }
+        }
+
         void log(const char *data, size_t len)
+        {
+            if (_bin_sinks.empty())
+            {
+                static thread_local BatchInfo info;
+                info.Clear();
+                info.Add(0, TimeSpec(), levels::UNKNOW);
+                logformatted(data, len, info);
+                return;
+            }
+            std::string &rec = RecordScratch();
+            rec.resize(sizeof(RecordHead));
+            rec.append(data, len);
+            FillHead(RecordType::FORMATTED, levels::UNKNOW, nullptr, 0, nullptr, rec);
+            Dispatch(rec);
+        }
+
+    protected:
+        void logformatted(const char *data, size_t len, const BatchInfo &info) override
         {
             std::unique_lock<std::mutex> lock(_mutex); // 进入函数自动上锁,出了函数作用域自动解锁
             for (const auto &e : _sinks)
             {
-                e->log(data, len);
+                e->logbatch(data, len, info);
+            }
+        }
+
+        // 有二进制落地方式时调用线程只打包参数生成记录,文本落地方式需要的文本由记录格式化得到
+        bool deferrable() override
+        {
+            return !_bin_sinks.empty();
+        }
+
+        void logrecord(levels level, const char *file, size_t line, const char *fmt, std::string &rec, size_t fields) override
+        {
+            FillHead(RecordType::DEFERRED, level, file, line, fmt, rec, fields);
+            Dispatch(rec);
+        }
+
+        void logpayload(levels level, const char *file, size_t line, const char *payload, size_t len, const char *fields, size_t fields_len) override
+        {
+            if (_bin_sinks.empty())
+            {
+                Logger::logpayload(level, file, line, payload, len, fields, fields_len);
+                return;
+            }
+            std::string &rec = RecordScratch();
+            rec.resize(sizeof(RecordHead));
+            rec.append(payload, len);
+            rec.append(fields, fields_len);
+            FillHead(RecordType::PAYLOAD, level, file, line, nullptr, rec, len);
+            Dispatch(rec);
+        }
+
+        // 一条记录交给二进制落地方式,格式化后交给文本落地方式
+        void Dispatch(const std::string &rec)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            WriteRecords(rec.data(), rec.size());
+            if (_sinks.empty())
+            {
+                return;
+            }
+            _out.clear();
+            _info.Clear();
+            FormatRecords(rec.data(), rec.size(), _out, _info);
+            for (const auto &e : _sinks)
+            {
+                e->logbatch(_out.data(), _out.size(), _info);
             }
         }
+
+        std::string _out; // 格式化好的一条日志,在锁内使用
+    };
+
+#define DROP_REPORT_INTERVAL 1000 // 有日志被丢弃时,两条"丢弃了N条日志"记录之间的最短间隔,毫秒
+
+    // 异步日志器的配置,由LoggerBuilder的各Build函数填写
+    struct AsyncConfig
+    {
+        AsyncType safe = AsyncType::SAFE;                 // 缓冲区工作模式
+        OverflowPolicy overflow = OverflowPolicy::BLOCK;  // 有界缓冲区写满时的策略
+        size_t timeout = 0;                               // BLOCK_TIMEOUT策略的等待时间,毫秒
+        bool deferred = false;                            // 是否延迟格式化,开启后格式串必须是静态存储的字符串
+        bool sink_workers = false;                        // 每个落地方式一个输出线程,慢的落地方式不会拖慢其他落地方式
+        BufferConfig buffers;                             // 缓冲区池的个数,大小以及是否使用大页
+        FlushConfig flush;                                // 后台线程的批量刷新条件
+        Backend::ptr backend;                             // 不为空时挂在共享后台上,不创建自己的线程,上面的模式/缓冲区/刷新配置不起作用
     };
 
     // 异步日志器
+    // 调用线程只把日志的原始信息打包成二进制记录(见record.hpp)放进缓冲区,格式化工作全部由后台线程完成
     class AsyncLogger : public Logger
     {
     public:
-        AsyncLogger(const std::string &name, levels level, const std::vector<Sink::ptr> &sinks, AsyncType safe = AsyncType::SAFE)
-            : Logger(name, level, sinks), _looper(std::make_shared<AsyncLooper>(std::bind(&AsyncLogger::CallBack, this, std::placeholders::_1), safe))
+        AsyncLogger(const std::string &name, levels level, const std::vector<Sink::ptr> &sinks, const Formatter::ptr &fmter, const AsyncConfig &conf = AsyncConfig())
+            : Logger(name, level, sinks, fmter), _deferred(conf.deferred), _reported(0), _report_time(0), _cb_thread(std::thread::id())
         {
+            if (conf.sink_workers)
+            {
+                _pool = std::make_shared<BufferPool>();
+                for (const auto &e : _sinks)
+                {
+                    _workers.push_back(std::make_shared<SinkWorker>(e));
+                }
+            }
+            // 工作器最后创建,回调用到的成员都已经准备好
+            func_t callback = std::bind(&AsyncLogger::CallBack, this, std::placeholders::_1);
+            if (conf.backend)
+                _looper = std::make_shared<BackendQueue>(conf.backend, callback, conf.overflow, conf.timeout);
+            else
+                _looper = std::make_shared<AsyncLooper>(callback, conf.safe, conf.overflow, conf.timeout, conf.buffers, conf.flush);
+        }
+
+        // 先写出收尾日志再停止工作线程,此时回调用到的成员都还有效;最后补报还没报告的丢弃条数
+        ~AsyncLogger()
+        {
+            Finish();
+            CrashUnregister(this);
+            _looper->Stop();
+            if (!ReportDropped(_report, true))
+            {
+                return;
+            }
+            WriteRecords(_report.data(), _report.size());
+            std::string out;
+            _info.Clear();
+            FormatRecords(_report.data(), _report.size(), out, _info);
+            if (_workers.empty())
+            {
+                for (const auto &e : _sinks)
+                    e->logbatch(out.data(), out.size(), _info);
+                return;
+            }
+            SharedBuffer buff = _pool->Get();
+            buff->swap(out);
+            for (const auto &e : _workers)
+                e->Push(buff, _info);
         }
 
-        // 主线程只需要把日志消息push进缓冲区即可
+        // 等后台线程处理完调用前写入的记录,再刷新落地方式
+        // 没有sink_workers时落地方式只在后台线程持有_mutex时被调用,这里持有同一把锁刷新;有时由各输出线程先输出完积压的数据
+        void Flush() override
+        {
+            if (_cb_thread.load(std::memory_order_relaxed) == std::this_thread::get_id())
+            {
+                return; // 落地方式在回调中输出了FATAL,此时持有锁,不能等自己
+            }
+            _looper->Flush();
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (const auto &e : _bin_sinks)
+                {
+                    e->flush();
+                }
+                if (_workers.empty())
+                {
+                    for (const auto &e : _sinks)
+                    {
+                        e->flush();
+                    }
+                }
+            }
+            for (const auto &e : _workers)
+            {
+                e->Flush();
+            }
+        }
+
+        // 先写出落地方式用户态缓冲和输出线程积压的数据,再把缓冲队列中还没处理的记录补写出去
+        void CrashDrain() override
+        {
+            if (_workers.empty())
+            {
+                Logger::CrashDrain();
+            }
+            for (const auto &e : _workers)
+            {
+                e->CrashDrain();
+            }
+            CrashWriter out(_name, _sinks);
+            _looper->Visit(CrashWriter::Visit, &out);
+        }
+
+        // 因缓冲区满被丢弃的日志总条数
+        size_t Dropped()
+        {
+            return _looper->Dropped();
+        }
+
+        // 各落地方式的积压情况,顺序与落地方式相同,没有开启sink_workers时为空
+        std::vector<SinkStat> SinkStats()
+        {
+            std::vector<SinkStat> stats;
+            for (const auto &e : _workers)
+            {
+                stats.push_back(e->Stat());
+            }
+            return stats;
+        }
+
+        // 开启延迟格式化时只拷贝格式串指针和原始参数,否则在调用线程生成有效载荷,Formatter的工作都留给后台线程
+        void logv(levels level, const char *file, size_t line, const char *fmt, va_list ap) override
+        {
+            if (_deferred)
+            {
+                std::string &rec = RecordScratch();
+                rec.resize(sizeof(RecordHead)); // 先占住头部的位置
+                va_list cp;
+                va_copy(cp, ap);
+                bool ok = EncodeArgs(rec, fmt, cp);
+                va_end(cp);
+                if (ok)
+                {
+                    logrecord(level, file, line, fmt, rec, std::string::npos);
+                    return;
+                }
+            }
+            Logger::logv(level, file, line, fmt, ap);
+        }
+
+        // 直接输出已经格式化好的数据
         void log(const char *data, size_t len)
         {
-            _looper->Push(data, len);
+            std::string &rec = RecordScratch();
+            RecordHead head;
+            memset(&head, 0, sizeof(head));
+            head.size = sizeof(head) + len;
+            head.type = RecordType::FORMATTED;
+            head.fields = len;
+            head.time = TimeSpec(); // 只用于索引
+            head.thread = CurrentThread();
+            rec.assign((const char *)&head, sizeof(head));
+            rec.append(data, len);
+            _looper->Push(rec.data(), rec.size());
         }
 
-        // 由异步工作器执行真实的消息落地工作
+    protected:
+        // 类型安全接口的格式串一定是字面量,总是延迟格式化
+        bool deferrable() override
+        {
+            return true;
+        }
+
+        void logrecord(levels level, const char *file, size_t line, const char *fmt, std::string &rec, size_t fields) override
+        {
+            PushRecord(RecordType::DEFERRED, level, file, line, fmt, rec, fields);
+        }
+
+        void logpayload(levels level, const char *file, size_t line, const char *payload, size_t len, const char *fields, size_t fields_len) override
+        {
+            std::string &rec = RecordScratch();
+            rec.resize(sizeof(RecordHead));
+            rec.append(payload, len);
+            rec.append(fields, fields_len);
+            PushRecord(RecordType::PAYLOAD, level, file, line, nullptr, rec, len);
+        }
+
+        // 填写rec开头的记录头并放进缓冲区
+        void PushRecord(RecordType type, levels level, const char *file, size_t line, const char *fmt, std::string &rec, size_t fields)
+        {
+            FillHead(type, level, file, line, fmt, rec, fields);
+            _looper->Push(rec.data(), rec.size());
+        }
+
+    public:
+        // 由异步工作器执行真实的消息落地工作:二进制落地方式直接拿到这批记录,
+        // 文本落地方式需要的文本批量解码格式化后一次性交给各落地方式
+        // 开启sink_workers时格式化到共享缓冲区,交给各落地方式的输出线程后立即返回
+        // 持有_mutex,只与Flush()竞争,每批一次
         void CallBack(Buffer &buffer)
         {
-            for (const auto &e : _sinks)
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cb_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+            Process(buffer);
+            _cb_thread.store(std::thread::id(), std::memory_order_relaxed);
+        }
+
+    private:
+        void Process(Buffer &buffer)
+        {
+            const char *data = buffer.begin();
+            size_t len = buffer.ReadAbleSize();
+            WriteRecords(data, len);
+            bool report = ReportDropped(_report, false);
+            if (report)
+            {
+                WriteRecords(_report.data(), _report.size());
+            }
+            if (_sinks.empty())
             {
-                e->log(buffer.begin(), buffer.ReadAbleSize());
+                return;
+            }
+            if (_workers.empty())
+            {
+                Decode(data, len, report, _out);
+                for (const auto &e : _sinks)
+                {
+                    e->logbatch(_out.data(), _out.size(), _info);
+                }
+                return;
+            }
+            SharedBuffer out = _pool->Get();
+            Decode(data, len, report, *out);
+            if (out->empty())
+            {
+                return;
+            }
+            for (const auto &e : _workers)
+            {
+                e->Push(out, _info);
             }
         }
 
-    private:
-        AsyncLooper::ptr _looper; // 异步工作器
+        // 格式化一批记录到out,report为true时在后面追加丢弃统计,统计记在_info
+        void Decode(const char *data, size_t len, bool report, std::string &out)
+        {
+            out.clear();
+            _info.Clear();
+            FormatRecords(data, len, out, _info);
+            if (report)
+            {
+                FormatRecords(_report.data(), _report.size(), out, _info);
+            }
+        }
+
+        // 有日志因缓冲区满被丢弃时,最多每DROP_REPORT_INTERVAL毫秒生成一条WARN记录放进rec,说明新丢弃了多少条
+        // 返回是否生成了记录
+        bool ReportDropped(std::string &rec, bool force)
+        {
+            size_t dropped = _looper->Dropped();
+            if (dropped == _reported)
+            {
+                return false;
+            }
+            uint64_t now = SteadyNs();
+            if (!force && now - _report_time < DROP_REPORT_INTERVAL * 1000000ul)
+            {
+                return false;
+            }
+            rec.resize(sizeof(RecordHead));
+            rec.append(std::to_string(dropped - _reported)).append("条日志因缓冲区满被丢弃");
+            const char *sep = "(";
+            for (int l = levels::UNKNOW; l < levels::OFF; ++l)
+            {
+                size_t cnt = _looper->Dropped((levels)l);
+                if (cnt != _reported_level[l])
+                {
+                    rec.append(sep).append(LevelStr((levels)l)).append(":");
+                    rec.append(std::to_string(cnt - _reported_level[l]));
+                    _reported_level[l] = cnt;
+                    sep = " ";
+                }
+            }
+            rec.append(")");
+            _reported = dropped;
+            _report_time = now;
+            FillHead(RecordType::PAYLOAD, levels::WARN, __FILE__, __LINE__, nullptr, rec);
+            return true;
+        }
+
+        bool _deferred;           // 是否延迟格式化,开启后格式串必须是字符串字面量等静态存储的字符串
+        size_t _reported;         // 已经报告过的丢弃条数
+        size_t _reported_level[levels::OFF] = {}; // 各等级已经报告过的丢弃条数
+        uint64_t _report_time;    // 上次报告丢弃条数的时间
+        std::string _out;         // 后台线程格式化好的一批日志,容量重复使用
+        std::string _report;      // 丢弃统计记录
+        BufferPool::ptr _pool;    // 开启sink_workers时批数据的共享缓冲池
+        std::vector<SinkWorker::ptr> _workers; // 各落地方式的输出线程,在工作器之后析构,先输出完剩余的日志
+        std::atomic<std::thread::id> _cb_thread; // 正在执行回调的线程
+        Looper::ptr _looper; // 异步工作器,放在最后,析构时先停止工作线程再释放其他成员
     };
 
     // 日志器类型 -- 同步,异步
@@ -192,7 +836,7 @@ namespace wcm
     {
     public:
         LoggerBuilder()
-            : _type(LoggerType::Sync), _level(levels::DEBUG), _safe(AsyncType::SAFE)
+            : _type(LoggerType::Sync), _level(levels::DEBUG), _crash(false)
         {
         }
 
@@ -218,26 +862,106 @@ namespace wcm
             _sinks.push_back(SinkFactory::CreateSink<SinkType>(std::forward<Args>(args)...));
         }
 
-        void BuildFormatter(std::string &pattern)
+        // 添加一个已经创建好的落地方式,可以在多个日志器间共享
+        void BuildSink(const Sink::ptr &sink)
+        {
+            _sinks.push_back(sink);
+        }
+
+        void BuildFormatter(const std::string &pattern)
         {
             _fmter = std::make_shared<Formatter>(pattern);
         }
 
         void BuildUnSafe()
         {
-            _safe = AsyncType::UNSAFE;
+            _async.safe = AsyncType::UNSAFE;
+        }
+
+        // 异步日志器使用每线程无锁环形缓冲区,ring是每个生产者线程的环大小,向上取整到2的整数次幂
+        void BuildLockFree(size_t ring = RING_SIZE)
+        {
+            _async.safe = AsyncType::LOCKFREE;
+            _async.buffers.ring = ring;
+        }
+
+        // 异步日志器延迟格式化,调用线程只拷贝格式串指针和原始参数,格式串必须是静态存储的字符串
+        void BuildDeferred()
+        {
+            _async.deferred = true;
+        }
+
+        // 异步日志器的每个落地方式使用独立的输出线程
+        void BuildSinkWorkers()
+        {
+            _async.sink_workers = true;
+        }
+
+        // 异步日志器的缓冲区池:count个size字节的缓冲区轮流使用,写入突发时可以排队多个缓冲区等待落地
+        // huge为true时优先使用大页,减少大缓冲区的缺页和TLB开销
+        void BuildBuffers(size_t count, size_t size = BUFF_SIZE, bool huge = false)
+        {
+            _async.buffers.count = count;
+            _async.buffers.size = size;
+            _async.buffers.huge = huge;
+        }
+
+        // 异步日志器挂在共享后台上,由后台固定数量的线程处理,不再各自创建线程和缓冲区
+        // 模块很多、每个模块一个日志器时,线程数和内存只随后台的配置(默认随核数)变化
+        void BuildBackend(const Backend::ptr &backend = Backend::Default())
+        {
+            _async.backend = backend;
+        }
+
+        // 异步日志器的批量刷新:后台线程攒够bytes字节或者最早的一条等待了latency毫秒才处理一批,二者先到为准
+        // 写入更少更大,上下文切换更少,一条日志最多延迟latency毫秒落地;latency为0(默认)时有数据就立即处理
+        // bytes为0表示不按字节数提前处理,只按latency攒批(缓冲区写满时仍立即处理)
+        void BuildFlush(size_t bytes, size_t latency)
+        {
+            _async.flush.bytes = bytes;
+            _async.flush.latency = latency;
+        }
+
+        // 异步日志器缓冲区写满时的策略,timeout是BLOCK_TIMEOUT策略的等待时间,毫秒
+        // 不安全模式下缓冲区无限扩容,不使用该策略
+        void BuildOverflow(OverflowPolicy policy, size_t timeout = 0)
+        {
+            _async.overflow = policy;
+            _async.timeout = timeout;
+        }
+
+        // 进程收到SIGSEGV/SIGABRT/SIGBUS时,把缓冲区中还没输出的日志直接写到文本落地方式的文件,见crash.hpp
+        // 第一次开启时安装信号处理函数;同步日志器只需写出落地方式的用户态缓冲
+        void BuildCrashDrain()
+        {
+            _crash = true;
         }
 
         // 建造日志器
         virtual Logger::ptr Build() = 0;
 
     protected:
+        // 开启了BuildCrashDrain()时登记新建的日志器,日志器析构时自己取消登记
+        void RegisterCrash(Logger *logger)
+        {
+            if (!_crash)
+            {
+                return;
+            }
+            InstallCrashHandler();
+            if (!CrashRegister(logger))
+            {
+                std::cerr << "登记致命信号处理的日志器超过" << CRASH_SLOTS << "个,日志器" << _name << "不再登记" << std::endl;
+            }
+        }
+
         LoggerType _type;              // 日志器类型
         std::string _name;             // 日志器名
         std::atomic<levels> _level;    // 日志器允许输出等级
         std::vector<Sink::ptr> _sinks; // 落地方式数组
         Formatter::ptr _fmter;
-        AsyncType _safe; // 异步日志器的工作模式
+        AsyncConfig _async; // 异步日志器的配置
+        bool _crash;        // 是否在致命信号时补写缓冲区中的日志
     };
 
     class LocalLoggerBuilder : public LoggerBuilder
@@ -262,14 +986,17 @@ namespace wcm
                 _fmter = std::make_shared<Formatter>();
             }
 
+            Logger::ptr logger;
             if (_type == LoggerType::Async)
             {
-                return std::make_shared<AsyncLogger>(_name, _level, _sinks, _safe);
+                logger = std::make_shared<AsyncLogger>(_name, _level, _sinks, _fmter, _async);
             }
             else
             {
-                return std::make_shared<SyncLogger>(_name, _level, _sinks);
+                logger = std::make_shared<SyncLogger>(_name, _level, _sinks, _fmter);
             }
+            RegisterCrash(logger.get());
+            return logger;
         }
     };
     
@@ -288,49 +1015,157 @@ namespace wcm
         //根据日志器名查看某一日志器是否存在
         bool Count(const std::string& name)
         {
-            std::unique_lock<std::mutex> lock(_mutex);
-            return _loggers.count(name);
+            return Snapshot()->count(name);
         }
 
         //添加日志器
+        //写时复制:拷贝一份新的日志器表再发布,旧表和被同名替换的日志器都保留到进程退出,读者拿到的指针一直有效
         void Push(const std::string& name, const Logger::ptr& logger)
         {
             std::unique_lock<std::mutex> lock(_mutex);
-            _loggers[name] = logger;
+            const Registry *old = _registry.load(std::memory_order_relaxed);
+            Registry *next = new Registry(*old);
+            auto it = next->find(name);
+            if (it != next->end())
+            {
+                _replaced.push_back(it->second);
+            }
+            (*next)[name] = logger;
+            _retired.emplace_back(next);
+            _registry.store(next, std::memory_order_release);
+            Generation().fetch_add(1, std::memory_order_release); //先发布新表再增加版本号,看到新版本号的读者一定能查到新表
+            logger->SetLevel(Resolve(name, logger->BaseLevel())); //按层级中已有的设置确定等级
         }
 
-        //根据日志器名获取一个日志器
-        Logger::ptr GetLogger(const std::string& name)
+        //日志器表的版本号,每次注册日志器加1,宏在调用点缓存的句柄据此判断是否过期
+        //常量初始化的函数局部静态变量,读取时没有初始化检查
+        static std::atomic<uint64_t>& Generation()
+        {
+            static std::atomic<uint64_t> generation(1);
+            return generation;
+        }
+
+        //运行时设置一个名字及其所有子孙日志器的等级,名字按'.'分层
+        //"db"影响"db","db.pool","db.pool.conn",不影响"dbx";更具体的设置优先;空名字表示所有日志器
+        //设置可以早于日志器注册,之后注册的日志器也会继承;只在设置时遍历一次日志器表,判断等级仍然只有一次原子读
+        void SetLevel(const std::string& name, levels level)
         {
             std::unique_lock<std::mutex> lock(_mutex);
-            //首先判断该日志器是否存在,不存在返回空
-            const auto& it = _loggers.find(name);
-            if(it != _loggers.end())
-            {
-                return _loggers[name];
-            }
-            return Logger::ptr();
+            _overrides[name] = level;
+            Apply(name);
         }
 
-        //获取默认日志器
-        Logger::ptr Root()
+        //取消一个名字的等级设置,它和子孙恢复为上层的设置,没有上层设置时恢复为构建时的等级
+        void ResetLevel(const std::string& name)
         {
             std::unique_lock<std::mutex> lock(_mutex);
+            _overrides.erase(name);
+            Apply(name);
+        }
+
+        //根据日志器名获取一个日志器,不存在返回空;只读当前的日志器表,不加锁
+        Logger::ptr GetLogger(const std::string& name)
+        {
+            const Registry *reg = Snapshot();
+            const auto it = reg->find(name);
+            return it != reg->end() ? it->second : Logger::ptr();
+        }
+
+        //根据日志器名获取日志器的裸指针,不存在返回nullptr;不加锁也不改引用计数
+        //注册过的日志器不会被释放,指针可以一直缓存,宏用它缓存句柄
+        Logger *GetLoggerPtr(const std::string& name)
+        {
+            const Registry *reg = Snapshot();
+            const auto it = reg->find(name);
+            return it != reg->end() ? it->second.get() : nullptr;
+        }
+
+        //获取默认日志器,默认日志器不会被替换,不需要加锁
+        Logger::ptr Root()
+        {
             return _root;
         }
+
+        //默认日志器在构造时创建且不会被替换,可以不加锁、不拷贝shared_ptr直接使用
+        Logger *RootPtr()
+        {
+            return _root.get();
+        }
     private:
+        using Registry = std::unordered_map<std::string, Logger::ptr>;
+
         LoggerManager()
         {
             std::unique_ptr<LoggerBuilder> up(new LocalLoggerBuilder());
             up->BuildName("root");
             _root = up->Build();
-            _loggers["root"] = _root;
+            Registry *reg = new Registry();
+            (*reg)["root"] = _root;
+            _retired.emplace_back(reg);
+            _registry.store(reg, std::memory_order_release);
+        }
+
+        //当前的日志器表
+        const Registry *Snapshot()
+        {
+            return _registry.load(std::memory_order_acquire);
+        }
+
+        //name是否是prefix本身或者它的子孙
+        static bool InScope(const std::string& prefix, const std::string& name)
+        {
+            if (prefix.empty())
+            {
+                return true;
+            }
+            return name.compare(0, prefix.size(), prefix) == 0 && (name.size() == prefix.size() || name[prefix.size()] == '.');
+        }
+
+        //从name开始逐级向上找最近的等级设置,都没有时返回base,调用时持有锁
+        levels Resolve(std::string name, levels base)
+        {
+            while (1)
+            {
+                auto it = _overrides.find(name);
+                if (it != _overrides.end())
+                {
+                    return it->second;
+                }
+                if (name.empty())
+                {
+                    return base;
+                }
+                size_t pos = name.rfind('.');
+                name.resize(pos == std::string::npos ? 0 : pos);
+            }
+        }
+
+        //重新计算prefix及其子孙日志器的等级并写入,调用时持有锁
+        void Apply(const std::string& prefix)
+        {
+            for (const auto& e : *Snapshot())
+            {
+                if (InScope(prefix, e.first))
+                {
+                    e.second->SetLevel(Resolve(e.first, e.second->BaseLevel()));
+                }
+            }
+            for (const auto& e : _replaced)
+            {
+                if (InScope(prefix, e->Name()))
+                {
+                    e->SetLevel(Resolve(e->Name(), e->BaseLevel())); //宏可能还缓存着被替换的日志器
+                }
+            }
         }
 
     private:
-        std::mutex _mutex;
+        std::mutex _mutex; //只在添加日志器和设置层级等级时使用,串行化写者
         Logger::ptr _root; //默认日志器
-        std::unordered_map<std::string, Logger::ptr> _loggers; //日志器组
+        std::atomic<const Registry *> _registry; //当前发布的日志器表
+        std::vector<std::unique_ptr<Registry>> _retired; //发布过的所有日志器表,日志器注册次数有限,不回收
+        std::vector<Logger::ptr> _replaced; //被同名替换下来的日志器,保证缓存的裸指针不会悬空
+        std::unordered_map<std::string, levels> _overrides; //运行时按名字设置的等级,对该名字及其子孙生效
     };
 
     class GlobalLoggerBuilder : public LoggerBuilder
@@ -359,12 +1194,13 @@ namespace wcm
             Logger::ptr logger; 
             if (_type == LoggerType::Async)
             {
-                logger = std::make_shared<AsyncLogger>(_name, _level, _sinks, _safe);
+                logger = std::make_shared<AsyncLogger>(_name, _level, _sinks, _fmter, _async);
             }
             else
             {
-                logger = std::make_shared<SyncLogger>(_name, _level, _sinks);
+                logger = std::make_shared<SyncLogger>(_name, _level, _sinks, _fmter);
             }
+            RegisterCrash(logger.get());
             LoggerManager::GetInstancce().Push(_name, logger);
             return logger;
         }
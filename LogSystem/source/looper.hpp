@@ -7,26 +7,169 @@
 #include <memory>
 #include <thread>
 #include <atomic>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <chrono>
 #include "buffer.hpp"
+#include "ringbuffer.hpp"
+#include "record.hpp"
 
 namespace wcm
 {
+#define RING_SPIN 64       // 无锁模式下环满时生产者让出CPU重试的次数,之后睡眠等消费者取走数据
+#define RING_PARK_MAX 100  // 生产者睡眠等待的最长时间,毫秒,到时重新检查,防止意外错过唤醒
+
     using func_t = std::function<void(Buffer &)>; // 回调函数类型
 
     // 启用安全状态(不允许扩容)还是不安全状态(允许扩容,用于极限测试)
+    // LOCKFREE: 每个生产者线程写入自己的无锁环形缓冲区,生产者之间不再争抢同一把锁
     enum AsyncType
     {
         SAFE,
-        UNSAFE
+        UNSAFE,
+        LOCKFREE
+    };
+
+    // 有界缓冲区(SAFE和LOCKFREE)写满时的处理策略,被丢弃的日志按等级计数
+    enum OverflowPolicy
+    {
+        BLOCK,         // 阻塞等待消费者腾出空间
+        BLOCK_TIMEOUT, // 阻塞等待,超时后丢弃这条
+        DROP_NEWEST,   // 丢弃新来的这条
+        DROP_OLDEST,   // 丢弃缓冲区中最早的记录腾出空间;无锁模式下生产者不能动消费者一侧的数据,退化为DROP_NEWEST
+        DROP_BY_LEVEL  // DEBUG/INFO只能用到缓冲区的3/4,WARN可以用满,都放不下时丢弃;ERROR/FATAL从不丢弃
+    };
+
+    // 缓冲区池的配置,SAFE/UNSAFE模式下总共有count个缓冲区轮流使用,有界模式的内存上限是count * size
+    // 无锁模式的数据在各线程的环里排队,只用到一个输入缓冲区和一个读取缓冲区,count不起作用
+    struct BufferConfig
+    {
+        size_t count = 2;        // 缓冲区个数,至少为2
+        size_t size = BUFF_SIZE; // 每个缓冲区的大小
+        bool huge = false;       // 是否使用大页
+        size_t ring = RING_SIZE; // 无锁模式下每个生产者线程的环形缓冲区大小,向上取整到2的整数次幂
+    };
+
+    // 消费者的批量刷新条件:攒够bytes字节,或者最早的一条数据已经等待了latency毫秒,二者先到为准
+    // latency为0时有数据就立即处理,bytes不起作用;latency不为0而bytes为0时没有字节阈值,按缓冲区大小算,只靠latency触发
+    // 写满排队的缓冲区、生产者等待空间和停止时总是立即处理
+    struct FlushConfig
+    {
+        size_t bytes = 0;   // 刷新阈值,字节,为0或超过缓冲区大小时按缓冲区大小算
+        size_t latency = 0; // 最大延迟,毫秒
+    };
+
+    // 异步日志器的缓冲队列: AsyncLooper自带工作线程, BackendQueue挂在共享的后台线程池上
+    // 两者都按记录丢弃并按等级计数
+    class Looper
+    {
+    public:
+        using ptr = std::shared_ptr<Looper>;
+        virtual ~Looper() {}
+
+        // 放入一条记录,data开头是RecordHead
+        virtual void Push(const char *data, size_t len) = 0;
+
+        // 处理完所有剩余数据后停止,可以重复调用
+        virtual void Stop() = 0;
+
+        // 阻塞到调用前写入的数据都已经回调完毕,期间不等批量刷新条件;在回调中调用时直接返回
+        virtual void Flush() = 0;
+
+        // 一段待处理的数据,环形缓冲区绕回时由a和b两块拼成
+        using visit_t = void (*)(const char *a, size_t alen, const char *b, size_t blen, void *arg);
+
+        // 致命信号处理函数调用(见crash.hpp):不加锁地按写入顺序访问还没回调完的数据,包括正在回调的那一批
+        // 其他线程可能还在修改这些数据,只保证尽力而为
+        virtual void Visit(visit_t visit, void *arg) = 0;
+
+        // 因缓冲区满被丢弃的某个等级的日志条数
+        size_t Dropped(levels level)
+        {
+            return _dropped[level].load(std::memory_order_relaxed);
+        }
+
+        // 因缓冲区满被丢弃的日志总条数
+        size_t Dropped()
+        {
+            size_t total = 0;
+            for (auto &e : _dropped)
+            {
+                total += e.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+    protected:
+        Looper()
+        {
+            for (auto &e : _dropped)
+            {
+                e = 0;
+            }
+        }
+
+        // 缓冲区中的每条数据都是一条记录,开头是RecordHead
+        static levels RecordLevel(const char *data)
+        {
+            return (levels)(uint8_t)data[offsetof(RecordHead, level)];
+        }
+
+        static uint32_t RecordSize(const char *data)
+        {
+            uint32_t size;
+            memcpy(&size, data + offsetof(RecordHead, size), sizeof(size));
+            return size;
+        }
+
+        void Drop(const char *data)
+        {
+            _dropped[RecordLevel(data)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // 丢弃缓冲区中的记录直到剩余数据加上len不超过容量,每条都计数
+        void DropFront(Buffer &buff, size_t len)
+        {
+            while (!buff.Empty() && buff.ReadAbleSize() + len > buff.Capacity())
+            {
+                Drop(buff.begin());
+                buff.MoveRIDX(RecordSize(buff.begin()));
+            }
+        }
+
+    private:
+        std::atomic<size_t> _dropped[levels::OFF + 1]; // 各等级被丢弃的条数
     };
 
-    class AsyncLooper
+    class AsyncLooper : public Looper
     {
     public:
         using ptr = std::shared_ptr<AsyncLooper>;
-        AsyncLooper(func_t callback, AsyncType safe = AsyncType::SAFE)
-            : _safe(safe), _sflag(false), _callback(callback), _thread(std::thread(&AsyncLooper::ThreadRoutine, this))
+        // timeout: BLOCK_TIMEOUT策略下最长等待的毫秒数
+        AsyncLooper(func_t callback, AsyncType safe = AsyncType::SAFE, OverflowPolicy policy = OverflowPolicy::BLOCK, size_t timeout = 0,
+                    const BufferConfig &buffers = BufferConfig(), const FlushConfig &flush = FlushConfig())
+            : _safe(safe), _policy(policy), _timeout(timeout), _conf(buffers), _pending(0), _flush(flush), _waiting(false), _wake_bytes(1),
+              _sflag(false), _idle(false), _id(NewId()), _ring_gen(0), _ring_waiters(0), _pop_cnt(0), _swap_cnt(0), _taken(0), _done(0), _flushing(0), _callback(callback)
         {
+            _conf.count = std::max<size_t>(_conf.count, 2);
+            _conf.ring = RingCapacity(_conf.ring);
+            _flush.bytes = _flush.bytes == 0 ? _conf.size : std::min(_flush.bytes, _conf.size);
+            _pro_buffer.reset(new Buffer(_conf.size, _conf.huge));
+            if (_safe == AsyncType::LOCKFREE)
+            {
+                _con_buffer.reset(new Buffer(_conf.size, _conf.huge));
+            }
+            else
+            {
+                for (size_t i = 1; i < _conf.count; ++i)
+                {
+                    _free.emplace_back(new Buffer(_conf.size, _conf.huge));
+                }
+            }
+            // 工作线程最后启动,保证它看到的成员都已经初始化完毕
+            _thread = std::thread(&AsyncLooper::ThreadRoutine, this);
         }
 
         ~AsyncLooper()
@@ -35,64 +178,584 @@ namespace wcm
         }
 
         // 停止工作
-        void Stop()
+        void Stop() override
         {
+            if (!_thread.joinable())
+            {
+                return; // 已经停止过了
+            }
             _sflag = true;
-            _con_cv.notify_all(); // 唤醒所有消费者线程,做完其应做工作后赶紧退出
+            {
+                std::unique_lock<std::mutex> lock(_mutex); // 加锁通知,防止消费者检查完条件还没睡下时错过唤醒
+                _con_cv.notify_all(); // 唤醒所有消费者线程,做完其应做工作后赶紧退出
+            }
             _thread.join();
         }
 
-        void Push(const char *data, size_t len)
+        void Push(const char *data, size_t len) override
+        {
+            if (_safe == AsyncType::LOCKFREE)
+            {
+                PushRing(data, len);
+                return;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            // 有界模式下按策略等待空间或者丢弃,不安全模式没有空闲缓冲区时直接扩容
+            if (_safe == AsyncType::UNSAFE)
+            {
+                Room(len);
+            }
+            else if (!Reserve(lock, data, len))
+            {
+                Drop(data);
+                return;
+            }
+            _pro_buffer->Push(data, len);
+            // 只在消费者睡眠并且数据达到它等待的量时才唤醒,避免每条日志一次系统调用
+            if (_waiting && (_pending + _pro_buffer->ReadAbleSize() >= _wake_bytes || !_full.empty()))
+            {
+                WakeConsumer();
+            }
+        }
+
+        // SAFE/UNSAFE模式下等此刻排队的缓冲区和输入缓冲区都被取走并回调完,或者消费者已经没有数据可处理
+        // 无锁模式下等消费者开始并完成新的一轮:那一轮会取空所有环,包括调用线程的环
+        void Flush() override
         {
+            if (!_thread.joinable() || std::this_thread::get_id() == _thread.get_id())
+            {
+                return;
+            }
             std::unique_lock<std::mutex> lock(_mutex);
-            // 如果输入缓冲区空间还够则允许输入新数据,否则阻塞,等待消费者唤醒
-            if (_safe == AsyncType::SAFE)
+            _flushing++;
+            if (_safe == AsyncType::LOCKFREE)
+            {
+                size_t target = _swap_cnt + 1;
+                _idle.store(false, std::memory_order_relaxed);
+                _con_cv.notify_one();
+                _pro_cv.wait(lock, [&]()
+                             { return _done >= target; });
+            }
+            else
             {
+                size_t target = _taken + _full.size() + (_pro_buffer->Empty() ? 0 : 1);
+                WakeConsumer();
+                // DROP_OLDEST可能丢掉排队的缓冲区,到不了target,这时等消费者手里和队列里都没有数据
                 _pro_cv.wait(lock, [&]()
-                             { return len <= _pro_buffer.WriteAbleSize(); });
+                             { return _done >= target || (_done == _taken && _full.empty() && _pro_buffer->Empty()); });
+            }
+            _flushing--;
+        }
+
+        void Visit(visit_t visit, void *arg) override
+        {
+            auto buff = [&](Buffer *b)
+            {
+                if (b != nullptr && !b->Empty())
+                    visit(b->begin(), b->ReadAbleSize(), nullptr, 0, arg);
+            };
+            buff(_con_buffer.get());
+            for (auto &e : _full)
+            {
+                buff(e.get());
+            }
+            buff(_pro_buffer.get());
+            if (_safe == AsyncType::LOCKFREE)
+            {
+                for (auto &ring : _rings)
+                {
+                    ring->Peek([&](const char *a, size_t alen, const char *b, size_t blen)
+                               { visit(a, alen, b, blen, arg); });
+                }
             }
-            _pro_buffer.Push(data, len);
-            _con_cv.notify_one(); // 唤醒一个消费者
         }
 
     private:
+        // 保证输入缓冲区能放下len字节:放得下或者为空时直接返回true,否则把它排进待处理队列换一个空闲缓冲区
+        // 没有空闲缓冲区时返回false,调用时持有锁
+        bool Room(size_t len)
+        {
+            // 缓冲区为空时总是允许写入,超过容量的单条记录也不会永远阻塞
+            if (_pro_buffer->Empty() || _pro_buffer->ReadAbleSize() + len <= _pro_buffer->Capacity())
+            {
+                return true;
+            }
+            if (_free.empty())
+            {
+                WakeConsumer(); // 生产者要等空间了,不再等刷新条件
+                return false;
+            }
+            _pending += _pro_buffer->ReadAbleSize();
+            _full.push_back(std::move(_pro_buffer));
+            _pro_buffer = std::move(_free.back());
+            _free.pop_back();
+            return true;
+        }
+
+        // 唤醒正在睡眠的消费者,同一次睡眠只通知一次,调用时持有锁
+        void WakeConsumer()
+        {
+            if (_waiting)
+            {
+                _waiting = false;
+                _con_cv.notify_one();
+            }
+        }
+
+        // 消费者睡眠直到被唤醒或者到达deadline,生产者写入的数据达到wake字节时才唤醒它,调用时持有锁
+        void Sleep(std::unique_lock<std::mutex> &lock, size_t wake, std::chrono::steady_clock::time_point deadline)
+        {
+            _wake_bytes = wake;
+            _waiting = true;
+            if (deadline == std::chrono::steady_clock::time_point::max())
+                _con_cv.wait(lock);
+            else
+                _con_cv.wait_until(lock, deadline);
+            _waiting = false;
+        }
+
+        // SAFE/UNSAFE模式下消费者等到可以取走一批数据,返回false表示已经停止并且没有剩余数据,调用时持有锁
+        bool WaitBatch(std::unique_lock<std::mutex> &lock)
+        {
+            auto deadline = std::chrono::steady_clock::time_point::max();
+            while (1)
+            {
+                size_t ready = _pending + _pro_buffer->ReadAbleSize();
+                if (ready == 0)
+                {
+                    if (_sflag)
+                    {
+                        return false;
+                    }
+                    Sleep(lock, 1, std::chrono::steady_clock::time_point::max()); // 来了第一条数据就醒来开始计时
+                    continue;
+                }
+                if (_sflag || !_full.empty() || _free.empty() || ready >= _flush.bytes || _flush.latency == 0 || _flushing > 0)
+                {
+                    return true;
+                }
+                auto now = std::chrono::steady_clock::now();
+                if (deadline == std::chrono::steady_clock::time_point::max())
+                {
+                    deadline = now + std::chrono::milliseconds(_flush.latency);
+                }
+                else if (now >= deadline)
+                {
+                    return true;
+                }
+                Sleep(lock, _flush.bytes, deadline);
+            }
+        }
+
+        // 有界模式下按策略为一条记录腾出空间,返回false表示这条记录应当被丢弃,调用时持有锁
+        bool Reserve(std::unique_lock<std::mutex> &lock, const char *data, size_t len)
+        {
+            auto room = [&]() { return Room(len); };
+            switch (_policy)
+            {
+            case OverflowPolicy::BLOCK:
+                _pro_cv.wait(lock, room);
+                return true;
+            case OverflowPolicy::BLOCK_TIMEOUT:
+                return _pro_cv.wait_for(lock, std::chrono::milliseconds(_timeout), room);
+            case OverflowPolicy::DROP_NEWEST:
+                return Room(len);
+            case OverflowPolicy::DROP_OLDEST:
+                if (len > _pro_buffer->Capacity())
+                {
+                    return false;
+                }
+                // 先整个丢弃最早排队的缓冲区,没有排队的缓冲区时丢弃输入缓冲区开头的记录
+                while (!Room(len))
+                {
+                    if (_full.empty())
+                    {
+                        DropFront(*_pro_buffer, len);
+                        _pro_buffer->Compact();
+                        continue;
+                    }
+                    std::unique_ptr<Buffer> &oldest = _full.front();
+                    _pending -= oldest->ReadAbleSize();
+                    DropFront(*oldest, oldest->Capacity());
+                    oldest->Clear();
+                    _free.push_back(std::move(oldest));
+                    _full.pop_front();
+                }
+                return true;
+            case OverflowPolicy::DROP_BY_LEVEL:
+            {
+                levels level = RecordLevel(data);
+                if (level >= levels::ERROR)
+                {
+                    Room(len);
+                    return true; // 没有空闲缓冲区时输入缓冲区扩容
+                }
+                // 生产者能用的总容量,不含消费者正在处理的那一个
+                size_t total = (_conf.count - 1) * _conf.size;
+                size_t limit = level >= levels::WARN ? total : total / 4 * 3;
+                return _pending + _pro_buffer->ReadAbleSize() + len <= limit && Room(len);
+            }
+            }
+            return true;
+        }
+
+        // 每个异步工作器的唯一编号,线程局部缓存用它而不是对象地址来区分工作器,防止地址复用
+        static size_t NewId()
+        {
+            static std::atomic<size_t> id(0);
+            return ++id;
+        }
+
+        // 线程局部的环形缓冲区表,线程退出时关闭自己的所有环,由消费者回收
+        // 环只归工作器所有,这里只保存weak_ptr,工作器销毁后环随之释放,不会被线程一直占着
+        struct LocalRings
+        {
+            size_t last_id = 0;             // 最近一次使用的工作器编号
+            RingBuffer *last_ring = nullptr; // 最近一次使用的环,绝大多数调用只需比较一次编号
+            std::unordered_map<size_t, std::weak_ptr<RingBuffer>> rings;
+
+            ~LocalRings()
+            {
+                for (auto &e : rings)
+                {
+                    if (std::shared_ptr<RingBuffer> ring = e.second.lock())
+                    {
+                        ring->Close();
+                    }
+                }
+            }
+        };
+
+        // 获取当前线程在本工作器中的环形缓冲区,第一次调用时创建并注册
+        RingBuffer *LocalRing()
+        {
+            static thread_local LocalRings local;
+            if (local.last_id == _id)
+            {
+                return local.last_ring;
+            }
+            // 本工作器还在运行,它的环没有关闭,不会被回收,lock()一定成功
+            auto it = local.rings.find(_id);
+            std::shared_ptr<RingBuffer> ring = it != local.rings.end() ? it->second.lock() : nullptr;
+            if (ring == nullptr)
+            {
+                // 顺带清掉已经销毁的工作器留下的表项
+                for (auto e = local.rings.begin(); e != local.rings.end();)
+                {
+                    e = e->second.expired() ? local.rings.erase(e) : std::next(e);
+                }
+                ring = std::make_shared<RingBuffer>(_conf.ring);
+                {
+                    std::unique_lock<std::mutex> lock(_ring_mutex);
+                    _rings.push_back(ring);
+                    _ring_gen++; // 通知消费者环的集合变化了
+                }
+                local.rings[_id] = ring;
+            }
+            local.last_id = _id;
+            local.last_ring = ring.get();
+            return local.last_ring;
+        }
+
+        // 无锁模式下的生产者路径:只写自己的环,不加锁,消费者睡眠时才去唤醒
+        void PushRing(const char *data, size_t len)
+        {
+            RingBuffer *ring = LocalRing();
+            // 超过环容量的超大消息退化为加锁路径
+            if (len > ring->Capacity())
+            {
+                PushLarge(ring, data, len);
+                return;
+            }
+            if (_policy == OverflowPolicy::DROP_BY_LEVEL && RecordLevel(data) < levels::WARN && ring->Size() + len > ring->Capacity() / 4 * 3)
+            {
+                Drop(data);
+                return;
+            }
+            if (!ring->TryPush(data, len))
+            {
+                // 环满了,按策略丢弃或者等待消费者取走数据
+                bool wait = _policy == OverflowPolicy::BLOCK || _policy == OverflowPolicy::BLOCK_TIMEOUT ||
+                            (_policy == OverflowPolicy::DROP_BY_LEVEL && RecordLevel(data) >= levels::ERROR);
+                auto deadline = std::chrono::steady_clock::time_point::max();
+                if (_policy == OverflowPolicy::BLOCK_TIMEOUT)
+                {
+                    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout);
+                }
+                do
+                {
+                    if (!wait || !WaitRing([&]() { return ring->Size() + len <= ring->Capacity(); }, deadline))
+                    {
+                        Drop(data);
+                        return;
+                    }
+                } while (!ring->TryPush(data, len));
+            }
+            // 与消费者设置_idle后再检查环形成对称的屏障,保证不会丢失唤醒
+            // 消费者手里已有未达到刷新阈值的数据时,本线程的环攒够剩下的量才唤醒它,否则它到最大延迟时自己醒来
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_idle.load(std::memory_order_relaxed) && ring->Size() >= _wake_bytes.load(std::memory_order_relaxed))
+            {
+                WakeUp();
+            }
+        }
+
+        // 超大消息:等本线程的环被取空,写入加锁的输入缓冲区,并等到它被消费者取走,以保证同一线程内的消息顺序
+        void PushLarge(RingBuffer *ring, const char *data, size_t len)
+        {
+            WaitRing([&]() { return ring->Empty(); }, std::chrono::steady_clock::time_point::max());
+            std::unique_lock<std::mutex> lock(_mutex);
+            _pro_buffer->Push(data, len);
+            size_t cnt = _swap_cnt;
+            _con_cv.notify_one();
+            _pro_cv.wait(lock, [&]()
+                         { return _swap_cnt != cnt; });
+        }
+
+        // 等待消费者从本线程的环中取走数据直到ready()成立,返回false表示到deadline仍不成立
+        // 先唤醒消费者并让出CPU重试几次,仍不成立时在_pro_cv上睡眠,消费者取走环中数据后唤醒,不占用CPU也不反复抢锁
+        template <class Pred>
+        bool WaitRing(Pred ready, std::chrono::steady_clock::time_point deadline)
+        {
+            for (int i = 0; i < RING_SPIN; ++i)
+            {
+                if (ready())
+                {
+                    return true;
+                }
+                if (i == 0)
+                {
+                    WakeUp(); // 确保消费者醒着
+                }
+                std::this_thread::yield();
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            // 先登记再检查,与消费者取走数据后的屏障配对:要么这里看到空间已经腾出,要么消费者看到有人在等
+            _ring_waiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            _idle.store(false, std::memory_order_relaxed);
+            _con_cv.notify_one();
+            bool ok;
+            while (!(ok = ready()))
+            {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline)
+                {
+                    break;
+                }
+                size_t seen = _pop_cnt;
+                _pro_cv.wait_until(lock, std::min(deadline, now + std::chrono::milliseconds(RING_PARK_MAX)), [&]()
+                                   { return _pop_cnt != seen; });
+            }
+            _ring_waiters.fetch_sub(1);
+            return ok;
+        }
+
+        // 唤醒可能正在睡眠的消费者,清掉_idle让其他生产者不必重复通知
+        void WakeUp()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _idle.store(false, std::memory_order_relaxed);
+            _con_cv.notify_one();
+        }
+
+        // 无锁模式下消费者取一轮数据:先取加锁的输入缓冲区,再依次取空各个环,返回是否取到数据,round是这一轮的编号
+        bool DrainRings(std::vector<std::shared_ptr<RingBuffer>> &rings, size_t &gen, size_t &round)
+        {
+            // 环的集合变化时才重新拷贝一份,平时不碰_ring_mutex
+            if (gen != _ring_gen.load(std::memory_order_acquire))
+            {
+                std::unique_lock<std::mutex> lock(_ring_mutex);
+                // 回收已退出线程的且已取空的环
+                _rings.erase(std::remove_if(_rings.begin(), _rings.end(), [](const std::shared_ptr<RingBuffer> &r)
+                                            { return r->Closed() && r->Empty(); }),
+                             _rings.end());
+                rings = _rings;
+                gen = _ring_gen.load(std::memory_order_relaxed);
+            }
+            bool got = false;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (!_pro_buffer->Empty())
+                {
+                    _con_buffer->Push(_pro_buffer->begin(), _pro_buffer->ReadAbleSize());
+                    _pro_buffer->Clear();
+                    got = true;
+                }
+                round = ++_swap_cnt;
+                _pro_cv.notify_all();
+            }
+            bool closed = false;
+            for (auto &ring : rings)
+            {
+                got = ring->PopTo(*_con_buffer) > 0 || got;
+                closed = closed || ring->Closed();
+            }
+            if (closed)
+            {
+                _ring_gen++; // 有线程退出了,下一轮顺带回收它的环
+            }
+            // 环中腾出了空间,唤醒在WaitRing()中睡眠的生产者
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (got && _ring_waiters.load(std::memory_order_relaxed) > 0)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _pop_cnt++;
+                _pro_cv.notify_all();
+            }
+            return got;
+        }
+
+        // 无锁模式下的线程入口函数
+        void RingRoutine()
+        {
+            std::vector<std::shared_ptr<RingBuffer>> rings; // 消费者持有的环集合快照
+            size_t gen = 0;
+            auto deadline = std::chrono::steady_clock::time_point::max(); // 手里最早的数据必须写出的时间
+            while (1)
+            {
+                size_t round;
+                DrainRings(rings, gen, round);
+                // 有线程在等Flush时这一轮取到的数据立即处理,处理完告诉它这一轮已经结束
+                bool flush = _flushing.load(std::memory_order_relaxed) > 0;
+                bool has = !_con_buffer->Empty();
+                if (has)
+                {
+                    bool due = _sflag || flush || _flush.latency == 0 || _con_buffer->ReadAbleSize() >= _flush.bytes;
+                    if (!due)
+                    {
+                        auto now = std::chrono::steady_clock::now();
+                        if (deadline == std::chrono::steady_clock::time_point::max())
+                            deadline = now + std::chrono::milliseconds(_flush.latency);
+                        due = now >= deadline;
+                    }
+                    if (due)
+                    {
+                        _callback(*_con_buffer);
+                        _con_buffer->Clear();
+                        deadline = std::chrono::steady_clock::time_point::max();
+                        if (flush)
+                            RoundDone(round);
+                        continue;
+                    }
+                }
+                else if (flush)
+                {
+                    RoundDone(round);
+                    continue;
+                }
+                // 停止标志为true且所有数据都已取完才退出
+                else if (_sflag)
+                {
+                    break;
+                }
+                // 先声明自己要睡眠,再检查一次,避免生产者在这期间写入的数据无人处理
+                // 手里有未达到阈值的数据时睡到最大延迟为止,期间某个环攒够剩下的量才会被唤醒
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake_bytes.store(has ? _flush.bytes - _con_buffer->ReadAbleSize() : 1, std::memory_order_relaxed);
+                _idle.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                bool empty = _pro_buffer->Empty();
+                for (auto &ring : rings)
+                {
+                    empty = empty && ring->Empty();
+                }
+                if (_flushing > 0)
+                {
+                    // 刚开始等Flush的线程需要新的一轮,不睡眠
+                }
+                else if (has && !_sflag)
+                {
+                    _con_cv.wait_until(lock, deadline);
+                }
+                else if (empty && !_sflag && gen == _ring_gen.load(std::memory_order_acquire))
+                {
+                    _con_cv.wait(lock); // 没有超时: 生产者写入后看到_idle就会唤醒,Flush和停止也会唤醒
+                }
+                _idle.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        // 无锁模式下第round轮已经处理完,唤醒等待Flush的线程
+        void RoundDone(size_t round)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done = round;
+            _pro_cv.notify_all();
+        }
+
         // 线程入口函数
         void ThreadRoutine()
         {
+            if (_safe == AsyncType::LOCKFREE)
+            {
+                RingRoutine();
+                return;
+            }
             while (1)
             {
-                // 该作用域用于增加效率,当_buffer交换后就可以解锁了
+                // 该作用域用于增加效率,取到缓冲区后就可以解锁了
                 {
                     std::unique_lock<std::mutex> lock(_mutex);
-                    // 只有当停止标志为true并且输入缓冲区为空时才退出,避免剩于数据未被处理
-                    if (_sflag && _pro_buffer.Empty())
+                    // 只有当停止标志为true并且所有缓冲区都为空时才退出,避免剩于数据未被处理
+                    if (!WaitBatch(lock))
                     {
                         break;
                     }
-                    _con_cv.wait(lock, [&]()
-                                 { return !_pro_buffer.Empty() || _sflag; });
-                    _con_buffer.Swap(_pro_buffer);
-
-                    // 如果输入缓冲区有数据可读或者已经处于停止状态了,那就赶紧读
-                    if (_safe == AsyncType::SAFE)
+                    // 先按顺序处理排队的缓冲区,没有排队的再取走输入缓冲区,此时池中一定有空闲的缓冲区
+                    if (!_full.empty())
+                    {
+                        _con_buffer = std::move(_full.front());
+                        _full.pop_front();
+                        _pending -= _con_buffer->ReadAbleSize();
+                    }
+                    else
                     {
-                        _pro_cv.notify_one(); // 唤醒生产者可以开始生产了
+                        _con_buffer = std::move(_pro_buffer);
+                        _pro_buffer = std::move(_free.back());
+                        _free.pop_back();
+                        _pro_cv.notify_all(); // 唤醒所有等待空间的生产者,换上了空的输入缓冲区
                     }
+                    _taken++;
                 }
-                _callback(_con_buffer); // 回调处理
-                _con_buffer.Clear();    // 处理完回调后清空缓冲区
+                _callback(*_con_buffer); // 回调处理
+                _con_buffer->Clear();    // 处理完回调后清空缓冲区,还回池中
+                std::unique_lock<std::mutex> lock(_mutex);
+                _free.push_back(std::move(_con_buffer));
+                _done++;
+                _pro_cv.notify_all(); // 等待空闲缓冲区的生产者和等待Flush的线程
             }
         }
 
     private:
         AsyncType _safe;
-        Buffer _pro_buffer; // 输入缓冲区
-        Buffer _con_buffer; // 读取缓冲区
+        OverflowPolicy _policy; // 有界缓冲区写满时的策略
+        size_t _timeout;        // BLOCK_TIMEOUT策略的等待时间,毫秒
+        BufferConfig _conf;                         // 缓冲区池的配置
+        std::unique_ptr<Buffer> _pro_buffer;        // 输入缓冲区
+        std::unique_ptr<Buffer> _con_buffer;        // 消费者正在处理的缓冲区,无锁模式下是固定的读取缓冲区
+        std::deque<std::unique_ptr<Buffer>> _full;  // 写满后排队等待消费者处理的缓冲区,按写入顺序
+        std::vector<std::unique_ptr<Buffer>> _free; // 空闲缓冲区池,消费者处理完的缓冲区还回这里
+        size_t _pending;                            // _full中排队的数据总字节数
+        FlushConfig _flush;                         // 批量刷新条件
+        bool _waiting;                              // SAFE/UNSAFE模式下消费者是否在睡眠等待数据
+        std::atomic<size_t> _wake_bytes;            // 消费者睡眠时,生产者写入多少字节才需要唤醒它
         std::mutex _mutex;
         std::condition_variable _pro_cv; // 生产者信号量
         std::condition_variable _con_cv; // 消费者信号量
         std::thread _thread;             // 工作线程
         std::atomic<bool> _sflag;        // 停止标志
+        std::atomic<bool> _idle;         // 无锁模式下消费者是否准备睡眠
+        size_t _id;                      // 工作器编号
+        std::mutex _ring_mutex;          // 保护_rings,只在线程注册和回收时使用
+        std::vector<std::shared_ptr<RingBuffer>> _rings; // 各生产者线程的环形缓冲区
+        std::atomic<size_t> _ring_gen;   // _rings的版本号,变化时消费者重新拷贝
+        std::atomic<size_t> _ring_waiters; // 在WaitRing()中睡眠等待环腾出空间的生产者数
+        size_t _pop_cnt;                 // 有生产者等待时,消费者取走环中数据的次数,修改时持有锁
+        size_t _swap_cnt;                // 消费者取走输入缓冲区的次数,超大消息据此等待;无锁模式下也是轮数
+        size_t _taken;                   // SAFE/UNSAFE模式下消费者取走的缓冲区个数
+        size_t _done;                    // 回调完的缓冲区个数,无锁模式下是最近一次处理完的轮数(只在有Flush等待时更新)
+        std::atomic<size_t> _flushing;   // 正在等待Flush的线程数,修改时持有锁
         func_t _callback;                // 回调函数
     };
 }
\ No newline at end of file
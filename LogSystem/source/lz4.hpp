@@ -0,0 +1,402 @@
+// 内置的LZ4流式压缩,输出标准LZ4帧格式(可以直接用lz4 -d解压),供RollFileSink压缩滚动文件
+// 帧内的块是相互依赖的:每个块都能引用前面64KB的历史数据,所以每批日志压成一个块就立刻写出,
+// 小批量也有接近整文件压缩的压缩率,进程崩溃时最多丢掉还没有写出的那一批
+// 每个块带XXH32校验,崩溃时写了一半的块能被识别出来,解码到最后一个完整的块为止
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace wcm
+{
+#define LZ4_MAGIC 0x184D2204        // 帧头魔数
+#define LZ4_BLOCK_MAX 64 * 1024     // 块的最大原始大小,帧头中声明为64KB
+#define LZ4_WINDOW 64 * 1024        // 匹配能引用的最远距离
+#define LZ4_HASH_BITS 14            // 哈希表大小为2^14项
+#define LZ4_MIN_MATCH 4             // 最短匹配长度
+#define LZ4_LAST_LITERALS 5         // 块末尾至少5字节字面量
+#define LZ4_MF_LIMIT 12             // 最后一个匹配必须在块末尾12字节之前开始
+#define LZ4_UNCOMPRESSED 0x80000000 // 块大小最高位为1表示块内是未压缩的原始数据
+
+    uint32_t Rotl32(uint32_t x, int r)
+    {
+        return (x << r) | (x >> (32 - r));
+    }
+
+    uint32_t Read32(const void *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    void AppendLE32(std::string &out, uint32_t v)
+    {
+        char b[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+        out.append(b, 4);
+    }
+
+    uint32_t ReadLE32(const char *p)
+    {
+        const unsigned char *u = (const unsigned char *)p;
+        return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+    }
+
+    // XXH32,LZ4帧格式用它做帧头和块的校验
+    uint32_t XXH32(const void *input, size_t len, uint32_t seed = 0)
+    {
+        const uint32_t P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u, P4 = 668265263u, P5 = 374761393u;
+        const unsigned char *p = (const unsigned char *)input;
+        const unsigned char *end = p + len;
+        uint32_t h;
+        if (len >= 16)
+        {
+            uint32_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+            for (; p + 16 <= end; p += 16)
+            {
+                v1 = Rotl32(v1 + Read32(p) * P2, 13) * P1;
+                v2 = Rotl32(v2 + Read32(p + 4) * P2, 13) * P1;
+                v3 = Rotl32(v3 + Read32(p + 8) * P2, 13) * P1;
+                v4 = Rotl32(v4 + Read32(p + 12) * P2, 13) * P1;
+            }
+            h = Rotl32(v1, 1) + Rotl32(v2, 7) + Rotl32(v3, 12) + Rotl32(v4, 18);
+        }
+        else
+        {
+            h = seed + P5;
+        }
+        h += (uint32_t)len;
+        for (; p + 4 <= end; p += 4)
+        {
+            h = Rotl32(h + Read32(p) * P3, 17) * P4;
+        }
+        for (; p < end; ++p)
+        {
+            h = Rotl32(h + (*p) * P5, 11) * P1;
+        }
+        h ^= h >> 15;
+        h *= P2;
+        h ^= h >> 13;
+        h *= P3;
+        h ^= h >> 16;
+        return h;
+    }
+
+    // 流式压缩器:Begin写帧头,每次Compress把一段数据压成若干个块追加到out,End写帧结束标记
+    // 保留最近LZ4_WINDOW字节作为历史,后面的块可以引用前面块里的内容
+    class Lz4Stream
+    {
+    public:
+        Lz4Stream()
+            : _win(LZ4_WINDOW + LZ4_BLOCK_MAX), _pos(0), _table(1 << LZ4_HASH_BITS, -1)
+        {
+        }
+
+        // 帧头:魔数,FLG(版本01,块相互依赖,带块校验),BD(块最大64KB),帧头校验
+        void Begin(std::string &out)
+        {
+            _pos = 0;
+            std::fill(_table.begin(), _table.end(), -1);
+            AppendLE32(out, LZ4_MAGIC);
+            char desc[2] = {0x50, 0x40};
+            out.append(desc, 2);
+            out.push_back((char)((XXH32(desc, 2) >> 8) & 0xFF));
+        }
+
+        // 帧结束标记,之后再写需要重新Begin
+        void End(std::string &out)
+        {
+            AppendLE32(out, 0);
+        }
+
+        void Compress(const char *data, size_t len, std::string &out)
+        {
+            while (len > 0)
+            {
+                size_t n = std::min(len, (size_t)LZ4_BLOCK_MAX);
+                if (_pos + n > _win.size())
+                {
+                    Slide();
+                }
+                memcpy(&_win[_pos], data, n);
+                CompressBlock(n, out);
+                _pos += n;
+                data += n;
+                len -= n;
+            }
+        }
+
+    private:
+        // 窗口满了,只保留最后LZ4_WINDOW字节,哈希表里的位置跟着平移
+        void Slide()
+        {
+            int32_t shift = _pos - LZ4_WINDOW;
+            memmove(&_win[0], &_win[shift], LZ4_WINDOW);
+            _pos = LZ4_WINDOW;
+            for (auto &e : _table)
+            {
+                e = e >= shift ? e - shift : -1;
+            }
+        }
+
+        static uint32_t Hash(uint32_t v)
+        {
+            return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        }
+
+        static void AppendLength(std::string &out, size_t len)
+        {
+            for (; len >= 255; len -= 255)
+            {
+                out.push_back((char)255);
+            }
+            out.push_back((char)len);
+        }
+
+        // 一个序列:字面量 + 匹配(match_len为0表示只有字面量,是块的最后一个序列)
+        static void AppendSequence(std::string &out, const char *lit, size_t lit_len, uint32_t offset, size_t match_len)
+        {
+            size_t ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+            out.push_back((char)((std::min(lit_len, (size_t)15) << 4) | std::min(ml, (size_t)15)));
+            if (lit_len >= 15)
+            {
+                AppendLength(out, lit_len - 15);
+            }
+            out.append(lit, lit_len);
+            if (match_len == 0)
+            {
+                return;
+            }
+            out.push_back((char)offset);
+            out.push_back((char)(offset >> 8));
+            if (ml >= 15)
+            {
+                AppendLength(out, ml - 15);
+            }
+        }
+
+        // 压缩窗口中[_pos, _pos + n)这一段,贪心匹配,匹配不到时步长逐渐增大以跳过难压缩的数据
+        void CompressBlock(size_t n, std::string &out)
+        {
+            size_t head = out.size();
+            AppendLE32(out, 0); // 块大小,压完回填
+            const char *w = _win.data();
+            int32_t start = _pos, end = _pos + n;
+            int32_t ip = start, anchor = start;
+            int32_t mflimit = end - LZ4_MF_LIMIT, matchlimit = end - LZ4_LAST_LITERALS;
+            while (ip < mflimit)
+            {
+                uint32_t h = Hash(Read32(w + ip));
+                int32_t ref = _table[h];
+                _table[h] = ip;
+                if (ref < 0 || ip - ref > 65535 || Read32(w + ref) != Read32(w + ip))
+                {
+                    ip += 1 + ((ip - anchor) >> 6);
+                    continue;
+                }
+                while (ip > anchor && ref > 0 && w[ip - 1] == w[ref - 1]) // 向前扩展
+                {
+                    --ip;
+                    --ref;
+                }
+                int32_t len = LZ4_MIN_MATCH;
+                while (ip + len < matchlimit && w[ref + len] == w[ip + len])
+                {
+                    ++len;
+                }
+                AppendSequence(out, w + anchor, ip - anchor, ip - ref, len);
+                ip += len;
+                anchor = ip;
+                if (ip < mflimit)
+                {
+                    _table[Hash(Read32(w + ip - 2))] = ip - 2;
+                }
+            }
+            AppendSequence(out, w + anchor, end - anchor, 0, 0);
+
+            size_t size = out.size() - head - 4;
+            if (size >= n) // 压不小就存原始数据
+            {
+                out.resize(head);
+                AppendLE32(out, n | LZ4_UNCOMPRESSED);
+                out.append(w + start, n);
+                size = n;
+            }
+            else
+            {
+                uint32_t v = size;
+                memcpy(&out[head], &v, 4); // 小端机器
+            }
+            AppendLE32(out, XXH32(out.data() + head + 4, size));
+        }
+
+    private:
+        std::vector<char> _win;       // 历史数据 + 当前块
+        int32_t _pos;                 // 窗口中已有数据的长度
+        std::vector<int32_t> _table;  // 4字节前缀的哈希 -> 在窗口中最近出现的位置
+    };
+
+    // 解码LZ4帧,支持多个帧首尾相连(追加写入时每次打开文件都开始一个新帧)
+    struct Lz4Scan
+    {
+        size_t valid = 0;  // 从文件开头到最后一个完整且校验正确的块(或帧结束标记)的字节数
+        bool open = false; // 最后一个帧没有结束标记,比如进程崩溃
+        bool error = false; // 在valid处遇到了截断或损坏的数据
+    };
+
+    // 解压data中的所有帧追加到out,遇到截断或损坏的块时停下,已经解出的数据保留
+    Lz4Scan Lz4Decode(const char *data, size_t len, std::string &out)
+    {
+        Lz4Scan scan;
+        size_t pos = 0;
+        while (pos + 4 <= len)
+        {
+            uint32_t magic = ReadLE32(data + pos);
+            if ((magic & 0xFFFFFFF0) == 0x184D2A50) // 可跳过的帧
+            {
+                if (pos + 8 > len || pos + 8 + ReadLE32(data + pos + 4) > len)
+                {
+                    break;
+                }
+                pos += 8 + ReadLE32(data + pos + 4);
+                scan.valid = pos;
+                continue;
+            }
+            if (magic != LZ4_MAGIC || pos + 7 > len)
+            {
+                break;
+            }
+            unsigned char flg = data[pos + 4];
+            bool block_sum = flg & 0x10, size_flag = flg & 0x08, content_sum = flg & 0x04, dict = flg & 0x01;
+            size_t desc_len = 2 + (size_flag ? 8 : 0) + (dict ? 4 : 0);
+            if ((flg >> 6) != 1 || pos + 4 + desc_len + 1 > len ||
+                (unsigned char)data[pos + 4 + desc_len] != ((XXH32(data + pos + 4, desc_len) >> 8) & 0xFF))
+            {
+                break;
+            }
+            pos += 4 + desc_len + 1;
+            scan.valid = pos;
+            scan.open = true;
+            size_t frame_begin = out.size(); // 块相互依赖时匹配可以引用本帧之前解出的数据
+            bool bad = false;
+            while (!bad)
+            {
+                if (pos + 4 > len)
+                {
+                    bad = true;
+                    break;
+                }
+                uint32_t size = ReadLE32(data + pos);
+                if (size == 0) // 帧结束
+                {
+                    pos += 4 + (content_sum ? 4 : 0);
+                    if (pos > len)
+                    {
+                        bad = true;
+                        break;
+                    }
+                    scan.valid = pos;
+                    scan.open = false;
+                    break;
+                }
+                bool raw = size & LZ4_UNCOMPRESSED;
+                size &= ~LZ4_UNCOMPRESSED;
+                const char *blk = data + pos + 4;
+                if (size > 4 * 1024 * 1024 || pos + 4 + size + (block_sum ? 4 : 0) > len ||
+                    (block_sum && ReadLE32(blk + size) != XXH32(blk, size)))
+                {
+                    bad = true;
+                    break;
+                }
+                size_t out_begin = out.size();
+                if (raw)
+                {
+                    out.append(blk, size);
+                }
+                else
+                {
+                    const unsigned char *ip = (const unsigned char *)blk, *iend = ip + size;
+                    while (ip < iend)
+                    {
+                        unsigned token = *ip++;
+                        size_t lit = token >> 4;
+                        if (lit == 15)
+                        {
+                            unsigned char b;
+                            do
+                            {
+                                if (ip >= iend)
+                                {
+                                    bad = true;
+                                    break;
+                                }
+                                b = *ip++;
+                                lit += b;
+                            } while (b == 255);
+                        }
+                        if (bad || lit > (size_t)(iend - ip))
+                        {
+                            bad = true;
+                            break;
+                        }
+                        out.append((const char *)ip, lit);
+                        ip += lit;
+                        if (ip >= iend) // 最后一个序列没有匹配
+                        {
+                            break;
+                        }
+                        if (iend - ip < 2)
+                        {
+                            bad = true;
+                            break;
+                        }
+                        size_t offset = ip[0] | (ip[1] << 8);
+                        ip += 2;
+                        size_t ml = (token & 15);
+                        if (ml == 15)
+                        {
+                            unsigned char b;
+                            do
+                            {
+                                if (ip >= iend)
+                                {
+                                    bad = true;
+                                    break;
+                                }
+                                b = *ip++;
+                                ml += b;
+                            } while (b == 255);
+                        }
+                        ml += LZ4_MIN_MATCH;
+                        if (bad || offset == 0 || offset > out.size() - frame_begin)
+                        {
+                            bad = true;
+                            break;
+                        }
+                        size_t from = out.size() - offset;
+                        for (size_t i = 0; i < ml; ++i) // 匹配可以和输出重叠,逐字节拷贝
+                        {
+                            out.push_back(out[from + i]);
+                        }
+                    }
+                }
+                if (bad)
+                {
+                    out.resize(out_begin);
+                    break;
+                }
+                pos += 4 + size + (block_sum ? 4 : 0);
+                scan.valid = pos;
+            }
+            if (bad)
+            {
+                break;
+            }
+        }
+        scan.error = scan.valid != len;
+        return scan;
+    }
+}
@@ -1,6 +1,9 @@
 #pragma once
 #include <iostream>
+#include <ctime>
+#include <string_view>
 #include "level.hpp"
+#include "thread.hpp"
 
 // 日志消息组织: [日志器名称][时间][日志等级][文件名:行号][线程id] 有效载荷
 namespace wcm
@@ -8,17 +11,20 @@ namespace wcm
     class LogMsg
     {
     public:
-        LogMsg(std::string logger_name, time_t time, levels level, std::string file, int line, std::string payload)
-            : _logger_name(logger_name), _time(time), _level(level), _file(file), _line(line), _tid(pthread_self()), _payload(payload)
+        // 名称,文件名和有效载荷都只引用调用方的数据,不拷贝也不申请内存;LogMsg只在格式化期间存在,调用方保证数据在此期间有效
+        LogMsg(std::string_view logger_name, const struct timespec &time, levels level, std::string_view file, int line, std::string_view payload, const ThreadInfo *thread = CurrentThread())
+            : _logger_name(logger_name), _time(time), _level(level), _file(file), _line(line), _thread(thread), _payload(payload)
         {
         }
 
-        std::string _logger_name; // 日志器名称
-        time_t _time;             // 时间
-        levels _level;            // 日志等级
-        std::string _file;        // 文件名
-        int _line;                // 行号
-        pthread_t _tid;           // 线程id
-        std::string _payload;     // 有效载荷
+        std::string_view _logger_name; // 日志器名称
+        struct timespec _time;         // 时间,精确到纳秒
+        levels _level;                 // 日志等级
+        std::string_view _file;        // 文件名
+        int _line;                     // 行号
+        const ThreadInfo *_thread;     // 线程id和线程名
+        std::string_view _payload;     // 有效载荷
+        const char *_fields = nullptr; // 打包的结构化字段(见field.hpp),指向记录或调用线程的缓冲区,不拷贝
+        size_t _fields_len = 0;
     };
 }
\ No newline at end of file
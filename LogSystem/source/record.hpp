@@ -0,0 +1,345 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <limits>
+#include <type_traits>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "level.hpp"
+#include "fmt.hpp"
+#include "thread.hpp"
+
+// 异步日志器放进缓冲区的二进制记录: [RecordHead][记录体]
+// 记录体按类型不同分别是: 已格式化好的整行日志 / 有效载荷文本 / 打包好的原始参数
+namespace wcm
+{
+    // 记录类型
+    enum RecordType
+    {
+        FORMATTED, // 记录体是已经格式化好的整行日志,后台线程原样输出
+        PAYLOAD,   // 记录体是有效载荷文本,后台线程只需做Formatter格式化
+        DEFERRED   // 记录体是打包的原始参数,后台线程解码参数后再格式化
+    };
+
+    struct RecordHead
+    {
+        uint32_t size;    // 整条记录的长度,包含头部
+        uint8_t type;     // 记录类型
+        uint8_t level;    // 日志等级
+        uint32_t line;    // 行号
+        uint32_t fields;  // 结构化字段(见field.hpp)在记录体中的起始位置,没有字段时等于记录体长度
+        struct timespec time; // 时间,精确到纳秒
+        const ThreadInfo *thread; // 线程id和线程名,ThreadInfo不会释放
+        const char *file; // 文件名,来自__FILE__,进程内一直有效
+        const char *fmt;  // 格式串,只有DEFERRED记录使用,必须是静态存储的字符串
+    };
+
+    // 打包参数的类型标签,每个参数在记录体中存储为 [标签][值]
+    enum ArgTag
+    {
+        TAG_INT = 'i',    // int64_t
+        TAG_UINT = 'u',   // uint64_t
+        TAG_DOUBLE = 'f', // double
+        TAG_LDOUBLE = 'F', // long double
+        TAG_STR = 's',    // uint32_t长度 + 字符串内容
+        TAG_PTR = 'p',    // const void *
+        TAG_BOOL = 'b',   // 1字节,只用于字段
+        TAG_FIELD = 'k'   // 字段名: uint8_t长度 + 名字,后面紧跟一个带标签的值,见field.hpp
+    };
+
+    void PutBytes(std::string &out, const void *data, size_t len)
+    {
+        out.append((const char *)data, len);
+    }
+
+    template <class T>
+    void PutArg(std::string &out, char tag, T val)
+    {
+        out += tag;
+        if constexpr (std::is_same<T, long double>::value && std::numeric_limits<long double>::digits == 64)
+        {
+            // x87扩展精度只有前10字节是值,后面是内容不确定的填充,清零后相同的值打包出相同的字节
+            char buf[sizeof(val)] = {0};
+            memcpy(buf, &val, 10);
+            PutBytes(out, buf, sizeof(buf));
+        }
+        else
+        {
+            PutBytes(out, &val, sizeof(val));
+        }
+    }
+
+    void PutStr(std::string &out, std::string_view str)
+    {
+        uint32_t len = str.size();
+        out += (char)TAG_STR;
+        PutBytes(out, &len, sizeof(len));
+        out.append(str.data(), len);
+    }
+
+    // 按fmt的转换说明从ap中依次取出参数,打包追加到out
+    // 遇到无法延迟格式化的写法(%n,宽字符,位置参数)返回false,调用者应退回到直接格式化
+    bool EncodeArgs(std::string &out, const char *fmt, va_list ap)
+    {
+        for (const char *p = strchr(fmt, '%'); p != nullptr; p = strchr(p, '%'))
+        {
+            FmtSpec spec = ParseSpec(p, 0);
+            if (spec.conv == 0)
+                return false;
+            if (spec.width_star)
+                PutArg<int64_t>(out, TAG_INT, va_arg(ap, int));
+            if (spec.prec_star)
+            {
+                int prec = va_arg(ap, int);
+                spec.prec = prec < 0 ? -1 : prec; // 负的精度表示未指定
+                PutArg<int64_t>(out, TAG_INT, prec);
+            }
+            switch (spec.conv)
+            {
+            case 'd':
+            case 'i':
+            {
+                int64_t v;
+                switch (spec.len)
+                {
+                case LEN_HH: v = (signed char)va_arg(ap, int); break;
+                case LEN_H: v = (short)va_arg(ap, int); break;
+                case LEN_L: v = va_arg(ap, long); break;
+                case LEN_LL: v = va_arg(ap, long long); break;
+                case LEN_J: v = va_arg(ap, intmax_t); break;
+                case LEN_Z: v = va_arg(ap, ssize_t); break;
+                case LEN_T: v = va_arg(ap, ptrdiff_t); break;
+                default: v = va_arg(ap, int); break;
+                }
+                PutArg(out, TAG_INT, v);
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+            {
+                uint64_t v;
+                switch (spec.len)
+                {
+                case LEN_HH: v = (unsigned char)va_arg(ap, unsigned int); break;
+                case LEN_H: v = (unsigned short)va_arg(ap, unsigned int); break;
+                case LEN_L: v = va_arg(ap, unsigned long); break;
+                case LEN_LL: v = va_arg(ap, unsigned long long); break;
+                case LEN_J: v = va_arg(ap, uintmax_t); break;
+                case LEN_Z: v = va_arg(ap, size_t); break;
+                case LEN_T: v = va_arg(ap, ptrdiff_t); break;
+                default: v = va_arg(ap, unsigned int); break;
+                }
+                PutArg(out, TAG_UINT, v);
+                break;
+            }
+            case 'c':
+                if (spec.len != LEN_NONE)
+                    return false;
+                PutArg<int64_t>(out, TAG_INT, va_arg(ap, int));
+                break;
+            case 's':
+                if (spec.len != LEN_NONE)
+                    return false;
+                PutStr(out, ToView(va_arg(ap, const char *), spec.prec)); // 有精度时参数不一定以'\0'结尾
+                break;
+            case 'p':
+                PutArg(out, TAG_PTR, va_arg(ap, void *));
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                if (spec.len == LEN_BIGL)
+                    PutArg(out, TAG_LDOUBLE, va_arg(ap, long double));
+                else
+                    PutArg(out, TAG_DOUBLE, va_arg(ap, double));
+                break;
+            case 'm':
+                PutArg<int64_t>(out, TAG_INT, errno); // %m输出调用时的errno
+                break;
+            case '%':
+                break;
+            default:
+                return false;
+            }
+            p += spec.end;
+        }
+        return true;
+    }
+
+    // 按转换说明把一个有类型的参数打包追加到out,打包结果与EncodeArgs一致,由DecodeArgs还原
+    template <class T>
+    void PackArg(std::string &out, const FmtSpec &spec, const T &arg)
+    {
+        using U = typename std::decay<T>::type;
+        constexpr ArgKind kind = KindOf<U>();
+        if constexpr (std::is_enum<U>::value)
+        {
+            PackArg(out, spec, (typename std::underlying_type<U>::type)arg);
+        }
+        else if constexpr (kind == KIND_INT)
+        {
+            if (spec.conv == 'c')
+                PutArg<int64_t>(out, TAG_INT, (int)arg);
+            else if (spec.conv == 'd' || spec.conv == 'i')
+                PutArg<int64_t>(out, TAG_INT, CastSigned(spec.len, arg));
+            else
+                PutArg<uint64_t>(out, TAG_UINT, CastUnsigned(spec.len, arg));
+        }
+        else if constexpr (kind == KIND_FLOAT)
+        {
+            if (std::is_same<U, long double>::value || spec.len == LEN_BIGL)
+                PutArg<long double>(out, TAG_LDOUBLE, arg);
+            else
+                PutArg<double>(out, TAG_DOUBLE, arg);
+        }
+        else if constexpr (kind == KIND_STR && std::is_pointer<U>::value)
+        {
+            if (spec.conv == 'p')
+                PutArg<const void *>(out, TAG_PTR, arg);
+            else
+                PutStr(out, ToView((const char *)arg, spec.prec));
+        }
+        else if constexpr (kind == KIND_STR)
+        {
+            PutStr(out, ToView(arg));
+        }
+        else
+        {
+            PutArg<const void *>(out, TAG_PTR, arg);
+        }
+    }
+
+    template <class S, size_t I, class T>
+    void PackOne(std::string &out, const T &arg)
+    {
+        constexpr FmtSpec spec = SpecAt(S::get(), I);
+        PackArg(out, spec, arg);
+    }
+
+    template <class S, class... Args, size_t... I>
+    void PackImpl(std::string &out, std::index_sequence<I...>, const Args &...args)
+    {
+        (PackOne<S, I>(out, args), ...);
+    }
+
+    // 按格式串S把参数打包追加到out,转换说明在编译期已经解析好
+    template <class S, class... Args>
+    void PackArgs(std::string &out, const Args &...args)
+    {
+        PackImpl<S>(out, std::index_sequence_for<Args...>(), args...);
+    }
+
+    // 从打包的参数中读取一个值,args指向标签
+    template <class T>
+    T GetArg(const char *&args)
+    {
+        T val;
+        memcpy(&val, args + 1, sizeof(val));
+        args += 1 + sizeof(val);
+        return val;
+    }
+
+    // 按fmt把打包的参数还原成与vasprintf相同的文本,追加到out,参数用fmt.hpp中的编码函数直接转换
+    void DecodeArgs(std::string &out, const char *fmt, const char *args, size_t len)
+    {
+        const char *end = args + len;
+        const char *p = fmt;
+        while (*p)
+        {
+            const char *pct = strchr(p, '%');
+            if (pct == nullptr)
+            {
+                out.append(p);
+                break;
+            }
+            out.append(p, pct - p);
+            FmtSpec spec = ParseSpec(pct, 0); // 编码时已经检查过,这里一定成功
+            p = pct + spec.end;
+            if (spec.conv == '%')
+            {
+                out += '%';
+                continue;
+            }
+            if (args >= end)
+                break; // 记录被截断,不再继续解码
+            if (spec.width_star)
+            {
+                int width = GetArg<int64_t>(args);
+                spec.left = spec.left || width < 0; // 负的宽度表示左对齐
+                spec.width = width < 0 ? -width : width;
+            }
+            if (spec.prec_star)
+            {
+                int prec = GetArg<int64_t>(args);
+                spec.prec = prec < 0 ? -1 : prec; // 负的精度表示未指定
+            }
+            switch (*args)
+            {
+            case TAG_INT:
+            {
+                int64_t v = GetArg<int64_t>(args);
+                if (spec.conv == 'm')
+                {
+                    const char *err = strerror(v);
+                    EncodeStr(out, spec, err, strlen(err));
+                }
+                else if (spec.conv == 'c')
+                    EncodeChar(out, spec, v);
+                else
+                    EncodeSigned(out, spec, v);
+                break;
+            }
+            case TAG_UINT:
+                EncodeUnsigned(out, spec, GetArg<uint64_t>(args));
+                break;
+            case TAG_DOUBLE:
+                EncodeFloat(out, spec, GetArg<double>(args));
+                break;
+            case TAG_LDOUBLE:
+                EncodeFloat(out, spec, GetArg<long double>(args));
+                break;
+            case TAG_PTR:
+                EncodePtr(out, spec, GetArg<const void *>(args));
+                break;
+            case TAG_STR:
+            {
+                uint32_t n;
+                memcpy(&n, args + 1, sizeof(n));
+                const char *str = args + 1 + sizeof(n);
+                args = str + n;
+                EncodeStr(out, spec, str, n);
+                break;
+            }
+            default:
+                return; // 未知标签,记录已损坏
+            }
+        }
+    }
+
+    // 线程局部的记录编码区,容量会保留下来,稳定后不再分配内存
+    std::string &RecordScratch()
+    {
+        static thread_local std::string scratch;
+        return scratch;
+    }
+
+    // 线程局部的有效载荷缓冲区,同样重复使用
+    std::string &PayloadScratch()
+    {
+        static thread_local std::string scratch;
+        return scratch;
+    }
+}
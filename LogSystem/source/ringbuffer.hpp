@@ -0,0 +1,137 @@
+#pragma once
+#include <iostream>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+#include <cassert>
+#include "buffer.hpp"
+
+namespace wcm
+{
+#define RING_SIZE 4 * 1024 * 1024 // 每个生产者线程的环形缓冲区默认大小
+#define CACHE_LINE 64             // 缓存行大小,读写指针分开存放,避免伪共享
+
+    // 向上取整到2的整数次幂,环形缓冲区的容量必须是2的整数次幂
+    size_t RingCapacity(size_t size)
+    {
+        size_t cap = 1;
+        while (cap < size)
+        {
+            cap <<= 1;
+        }
+        return cap;
+    }
+
+    // 单生产者单消费者无锁环形缓冲区
+    // 生产者只修改_tail,消费者只修改_head,读写指针单调递增,用 & _mask 得到实际下标
+    class RingBuffer
+    {
+    public:
+        RingBuffer(size_t capacity = RING_SIZE)
+            : _buff(new data_type[capacity]), _capacity(capacity), _mask(capacity - 1),
+              _head(0), _cached_tail(0), _tail(0), _cached_head(0), _closed(false)
+        {
+            assert(capacity > 0 && (capacity & (capacity - 1)) == 0); // 下标用 & _mask 计算,容量必须是2的整数次幂
+        }
+
+        ~RingBuffer()
+        {
+            delete[] _buff;
+        }
+
+        RingBuffer(const RingBuffer &) = delete;
+        RingBuffer &operator=(const RingBuffer &) = delete;
+
+        // 生产者调用:写入一条完整数据,剩余空间不足时返回false,不会写入半条数据
+        bool TryPush(const data_type *data, size_t len)
+        {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            // 先用缓存的读指针判断,只有空间看起来不够时才去读消费者的缓存行
+            if (len > _capacity - (tail - _cached_head))
+            {
+                _cached_head = _head.load(std::memory_order_acquire);
+                if (len > _capacity - (tail - _cached_head))
+                {
+                    return false;
+                }
+            }
+            size_t pos = tail & _mask;
+            size_t first = std::min(len, _capacity - pos); // 到环尾部为止能写下的长度
+            memcpy(_buff + pos, data, first);
+            memcpy(_buff, data + first, len - first); // 绕回环首部写剩下的部分
+            _tail.store(tail + len, std::memory_order_release); // 整条数据写完后才对消费者可见
+            return true;
+        }
+
+        // 消费者调用:把当前所有可读数据追加到buff中,返回取出的字节数
+        size_t PopTo(Buffer &buff)
+        {
+            size_t head = _head.load(std::memory_order_relaxed);
+            if (head == _cached_tail)
+            {
+                _cached_tail = _tail.load(std::memory_order_acquire);
+                if (head == _cached_tail)
+                {
+                    return 0;
+                }
+            }
+            size_t len = _cached_tail - head;
+            size_t pos = head & _mask;
+            size_t first = std::min(len, _capacity - pos);
+            buff.Push(_buff + pos, first);
+            buff.Push(_buff, len - first);
+            _head.store(head + len, std::memory_order_release); // 归还空间给生产者
+            return len;
+        }
+
+        // 不取走数据,把当前所有可读数据按顺序分成至多两段交给f(a, alen, b, blen),供致命信号时使用
+        template <class F>
+        void Peek(F f)
+        {
+            size_t head = _head.load(std::memory_order_acquire);
+            size_t len = _tail.load(std::memory_order_acquire) - head;
+            size_t pos = head & _mask;
+            size_t first = std::min(len, _capacity - pos);
+            f(_buff + pos, first, _buff, len - first);
+        }
+
+        // 判空,生产者消费者均可调用
+        bool Empty()
+        {
+            return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+        }
+
+        // 已写入还没被取走的字节数,生产者调用
+        size_t Size()
+        {
+            return _tail.load(std::memory_order_relaxed) - _head.load(std::memory_order_acquire);
+        }
+
+        // 环的总容量,超过该长度的数据永远无法写入
+        size_t Capacity()
+        {
+            return _capacity;
+        }
+
+        // 生产者线程退出时关闭,消费者取完剩余数据后即可回收
+        void Close()
+        {
+            _closed.store(true, std::memory_order_release);
+        }
+
+        bool Closed()
+        {
+            return _closed.load(std::memory_order_acquire);
+        }
+
+    private:
+        data_type *_buff;
+        size_t _capacity;
+        size_t _mask;
+        alignas(CACHE_LINE) std::atomic<size_t> _head; // 读指针,消费者修改
+        size_t _cached_tail;                           // 消费者缓存的写指针
+        alignas(CACHE_LINE) std::atomic<size_t> _tail; // 写指针,生产者修改
+        size_t _cached_head;                           // 生产者缓存的读指针
+        alignas(CACHE_LINE) std::atomic<bool> _closed; // 生产者线程是否已退出
+    };
+}
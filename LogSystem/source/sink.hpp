@@ -4,10 +4,19 @@
 #include <cassert>
 #include <sstream>
 #include <memory>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "util.hpp"
+#include "level.hpp"
+#include "uring.hpp"
+#include "lz4.hpp"
+#include "index.hpp"
 
 namespace wcm
 {
+#define MMAP_EXTENT 64 * 1024 * 1024 // 内存映射文件每次预分配并映射的大小
     class Sink
     {
     public:
@@ -16,6 +25,111 @@ namespace wcm
         {
         }
         virtual void log(const char *data, size_t len) = 0; // 输出data指向的数据的指定长度len
+
+        // 带等级的输出,level是这批数据中最高的日志等级,需要按等级处理的落地方式重写它
+        virtual void loglevel(const char *data, size_t len, levels level)
+        {
+            log(data, len);
+        }
+
+        // 带统计的输出,info是日志器格式化这批数据时记下的各段时间范围和等级,建立索引的落地方式重写它
+        virtual void logbatch(const char *data, size_t len, const BatchInfo &info)
+        {
+            loglevel(data, len, info.level);
+        }
+
+        // 二进制落地方式返回true,日志器不再为它格式化,而是把未格式化的记录(见record.hpp)交给logrecords
+        virtual bool Binary() const
+        {
+            return false;
+        }
+
+        // 输出一批记录,logger和pattern是日志器名和它的格式化模式,供以后还原出文本
+        virtual void logrecords(const std::string &logger, const std::string &pattern, const char *data, size_t len)
+        {
+        }
+
+        // 写出用户态缓冲中的数据并等待已提交的异步写入完成,日志器的Flush()调用,与log系列函数不会同时调用
+        virtual void flush()
+        {
+        }
+
+        // 进程收到致命信号时由信号处理函数调用(见crash.hpp),只能使用异步信号安全的调用,不加锁也不申请内存
+        // 先写出用户态缓冲中还没写出的数据,再直接写出data;len为0时只做前一步。默认不支持,什么也不做
+        virtual void logcrash(const char *data, size_t len)
+        {
+        }
+    };
+
+    // 写完全部数据,处理被信号打断和部分写入,出错时返回false;只使用write,信号处理函数中也可以调用
+    bool WriteFd(int fd, const char *data, size_t len)
+    {
+        while (len > 0)
+        {
+            ssize_t ret = write(fd, data, len);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += ret;
+            len -= ret;
+        }
+        return true;
+    }
+
+    // 落地方式的I/O错误不用assert掩盖:计数并输出到标准错误,同一种错误持续发生时只在第1,2,4,8...次提示
+    // errors是该落地方式的累计出错次数,op是出错的操作
+    void ReportIoError(size_t &errors, const std::string &path, const char *op, int err)
+    {
+        ++errors;
+        if ((errors & (errors - 1)) == 0)
+        {
+            std::cerr << "日志文件" << op << "失败: " << path << ", " << strerror(err) << ", 累计" << errors << "次" << std::endl;
+        }
+    }
+
+    // 取出文件流用户态缓冲中还没写出的数据,不修改流的状态,供致命信号时使用
+    struct FileBufPeek : public std::filebuf
+    {
+        static size_t Pending(std::filebuf *buf, const char *&data)
+        {
+            char *base = (buf->*&FileBufPeek::pbase)();
+            char *cur = (buf->*&FileBufPeek::pptr)();
+            data = base;
+            return base != nullptr && cur > base ? cur - base : 0;
+        }
+    };
+
+    // 基于文件流的落地方式在致命信号时的输出(见crash.hpp),只使用异步信号安全的调用
+    // 第一次输出时以追加方式重新打开文件,先写出文件流中还没写出的数据,之后直接write;进程随后就会退出,不再关闭
+    class CrashFile
+    {
+    public:
+        CrashFile()
+            : _fd(-1)
+        {
+        }
+
+        // 返回可以直接写入的文件描述符,打开失败返回-1
+        int Open(const char *path, std::ofstream &ofs)
+        {
+            if (_fd < 0)
+            {
+                _fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+                if (_fd >= 0)
+                {
+                    const char *data;
+                    size_t len = FileBufPeek::Pending(ofs.rdbuf(), data);
+                    WriteFd(_fd, data, len);
+                }
+            }
+            return _fd;
+        }
+
+    private:
+        int _fd;
     };
 
     // 输出到标准输出
@@ -26,72 +140,229 @@ namespace wcm
         {
             std::cout.write(data, len);
         }
+
+        void flush() override
+        {
+            std::cout.flush();
+        }
+
+        // std::cout自己的缓冲不能在信号处理函数中安全地写出,只直接写出data
+        void logcrash(const char *data, size_t len) override
+        {
+            WriteFd(STDOUT_FILENO, data, len);
+        }
     };
 
     // 输出到指定文件中
+    // index为true时同时写索引文件path.idx(见index.hpp)
     class FileSink : public Sink
     {
     public:
-        FileSink(const std::string &path)
+        FileSink(const std::string &path, bool index = false)
             : _path(path)
         {
             wcm::CreateDir(wcm::Path(_path));                   // 如果存储文件所在路径不存在则创建之
             _ofs.open(_path, std::ios::binary | std::ios::app); // 以二进制追加的方式打开指定文件
             assert(_ofs.is_open());
+            if (index)
+            {
+                _index.Open(_path);
+            }
         }
 
         void log(const char *data, size_t len) override
         {
             _ofs.write(data, len);
             assert(_ofs.good());
+            _index.Skip(len);
+        }
+
+        void logbatch(const char *data, size_t len, const BatchInfo &info) override
+        {
+            _ofs.write(data, len);
+            assert(_ofs.good());
+            _index.Append(info, len);
+        }
+
+        void flush() override
+        {
+            _ofs.flush();
+        }
+
+        void logcrash(const char *data, size_t len) override
+        {
+            int fd = _crash.Open(_path.c_str(), _ofs);
+            if (fd >= 0)
+            {
+                WriteFd(fd, data, len);
+            }
         }
 
     private:
-        std::string _path;  // 文件路径
-        std::ofstream _ofs; // 管理打开文件的句柄
+        std::string _path;   // 文件路径
+        std::ofstream _ofs;  // 管理打开文件的句柄
+        IndexWriter _index;  // 索引,没有开启时什么也不做
+        CrashFile _crash;    // 致命信号时使用
     };
 
+    // 滚动文件全名:基础开头 + 年月日时分秒 + 序号,每调用一次序号加一,防止1s内出现重复的名字
+    std::string RollFileName(const std::string &base, size_t &cnt)
+    {
+        struct tm tm;
+        time_t t = time(nullptr);
+        localtime_r(&t, &tm);
+        std::stringstream ss;
+        ss << base;
+        ss << tm.tm_year + 1900 << tm.tm_mon + 1 << tm.tm_mday << tm.tm_hour << tm.tm_min << tm.tm_sec << "-" << cnt++ << ".log";
+        return ss.str();
+    }
+
     // 输出到滚动文件中
+    // compress为true时用内置的LZ4流式压缩,文件名以.lz4结尾,每批数据压成一个块立即写出,capacity按压缩后的大小计算
+    // 打开已有的压缩文件追加时,先截掉崩溃留下的半个块并补上帧结束标记,再开始一个新帧
+    // index为true时每个滚动文件都有自己的索引文件(文件名加.idx);压缩的文件不能从中间开始解压,不建立索引
     class RollFileSink : public Sink
     {
     public:
-        RollFileSink(const std::string &base, size_t capacity, int cnt = 0)
-            : _base(base), _capacity(capacity), _size(0), _cnt(cnt)
+        RollFileSink(const std::string &base, size_t capacity, int cnt = 0, bool compress = false, bool index = false)
+            : _base(base), _capacity(capacity), _size(0), _cnt(cnt), _compress(compress), _indexed(index && !compress)
         {
-            std::string file_name = GetBaseName();
-            wcm::CreateDir(wcm::Path(file_name));                   // 如果存储文件所在路径不存在则创建之
-            _ofs.open(file_name, std::ios::binary | std::ios::app); // 以二进制追加的方式打开指定文件
-            assert(_ofs.is_open());
+            Open();
+        }
+
+        ~RollFileSink()
+        {
+            Close();
         }
 
         void log(const char *data, size_t len) override
+        {
+            Write(data, len);
+            _index.Skip(len);
+        }
+
+        void logbatch(const char *data, size_t len, const BatchInfo &info) override
+        {
+            Write(data, len);
+            _index.Append(info, len);
+        }
+
+        void flush() override
+        {
+            _ofs.flush();
+        }
+
+        // 压缩的文件把文本写成LZ4的未压缩块,解压时照常输出
+        void logcrash(const char *data, size_t len) override
+        {
+            int fd = _crash.Open(_file_name.c_str(), _ofs);
+            if (fd < 0 || !_compress)
+            {
+                if (fd >= 0)
+                    WriteFd(fd, data, len);
+                return;
+            }
+            while (len > 0)
+            {
+                size_t n = std::min<size_t>(len, LZ4_BLOCK_MAX);
+                uint32_t size = n | LZ4_UNCOMPRESSED, sum = XXH32(data, n);
+                char head[4] = {(char)size, (char)(size >> 8), (char)(size >> 16), (char)(size >> 24)};
+                char tail[4] = {(char)sum, (char)(sum >> 8), (char)(sum >> 16), (char)(sum >> 24)};
+                WriteFd(fd, head, 4);
+                WriteFd(fd, data, n);
+                WriteFd(fd, tail, 4);
+                data += n;
+                len -= n;
+            }
+        }
+
+    private:
+        // 一批数据写进当前文件,不会跨文件
+        void Write(const char *data, size_t len)
         {
             // 如果当前滚动文件存满了,需要创建下一个滚动文件继续存储
             if (_size >= _capacity)
             {
-                _ofs.close();
-                std::string file_name = GetBaseName();
-                wcm::CreateDir(wcm::Path(file_name));                   // 如果存储文件所在路径不存在则创建之
-                _ofs.open(file_name, std::ios::binary | std::ios::app); // 以二进制追加的方式打开指定文件
-                assert(_ofs.is_open());
-                _size = 0;
+                Close();
+                Open();
+            }
+            if (_compress)
+            {
+                _frame.clear();
+                _lz4.Compress(data, len, _frame);
+                data = _frame.data();
+                len = _frame.size();
             }
             _ofs.write(data, len);
             assert(_ofs.good());
             _size += len; // 累加大小
         }
 
-    private:
         // 获取滚动文件全名(基础开头 + 扩展结尾)
         std::string GetBaseName()
         {
-            struct tm tm;
-            time_t t = time(nullptr);
-            localtime_r(&t, &tm);
-            std::stringstream ss;
-            ss << _base;
-            ss << tm.tm_year + 1900 << tm.tm_mon + 1 << tm.tm_mday << tm.tm_hour << tm.tm_min << tm.tm_sec << "-" << _cnt++ << ".log";
-            return ss.str();
+            std::string name = RollFileName(_base, _cnt);
+            return _compress ? name + ".lz4" : name;
+        }
+
+        void Open()
+        {
+            _file_name = GetBaseName();
+            wcm::CreateDir(wcm::Path(_file_name)); // 如果存储文件所在路径不存在则创建之
+            if (_compress)
+            {
+                Recover(_file_name);
+            }
+            _ofs.open(_file_name, std::ios::binary | std::ios::app); // 以二进制追加的方式打开指定文件
+            assert(_ofs.is_open());
+            if (_indexed)
+            {
+                _index.Open(_file_name);
+            }
+            _size = 0;
+            if (_compress)
+            {
+                _frame.clear();
+                _lz4.Begin(_frame);
+                _ofs.write(_frame.data(), _frame.size());
+                _size += _frame.size();
+            }
+        }
+
+        void Close()
+        {
+            if (_compress)
+            {
+                _frame.clear();
+                _lz4.End(_frame);
+                _ofs.write(_frame.data(), _frame.size());
+            }
+            _ofs.close();
+            _index.Close();
+        }
+
+        // 已有的压缩文件最后一个帧没有正常结束时,截到最后一个完整的块并补上结束标记
+        void Recover(const std::string &file_name)
+        {
+            std::ifstream ifs(file_name, std::ios::binary);
+            if (!ifs.is_open())
+            {
+                return;
+            }
+            std::string old((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+            std::string text;
+            Lz4Scan scan = Lz4Decode(old.data(), old.size(), text);
+            if (!scan.open && !scan.error)
+            {
+                return;
+            }
+            if (truncate(file_name.c_str(), scan.valid) == 0 && scan.open)
+            {
+                std::ofstream ofs(file_name, std::ios::binary | std::ios::app);
+                std::string end;
+                _lz4.End(end);
+                ofs.write(end.data(), end.size());
+            }
         }
 
     private:
@@ -100,6 +371,441 @@ namespace wcm
         size_t _size;       // 当前存储的大小
         std::ofstream _ofs; // 管理打开文件的句柄
         size_t _cnt;        //_base扩展的标记,防止在1s内出现多个重复名字的文件
+        bool _compress;     // 是否压缩
+        bool _indexed;      // 是否建立索引
+        IndexWriter _index; // 当前文件的索引
+        Lz4Stream _lz4;     // 压缩器,保存当前帧最近64KB的历史
+        std::string _frame; // 压缩输出,复用避免每批申请内存
+        std::string _file_name; // 当前文件的全名
+        CrashFile _crash;   // 致命信号时使用
+    };
+
+    // 刷盘策略,各条件可以组合,都不设置时从不主动调用fdatasync
+    struct SyncPolicy
+    {
+        size_t bytes = 0;           // 未刷盘的数据达到该字节数时刷盘,0表示不按字节数
+        size_t interval = 0;        // 距上次刷盘超过该毫秒数时刷盘,在写入时检查,0表示不按时间
+        levels level = levels::OFF; // 这批数据中有该等级及以上的日志时刷盘,OFF表示不按等级
+    };
+
+    // 直接用文件描述符输出到指定文件,每批数据一次write系统调用,没有iostream的用户态缓冲和拷贝
+    // 可以选择用io_uring异步提交写入和刷盘,后台线程不用等待磁盘,内核不支持时退回write
+    // 没有用户态缓冲,适合配合异步日志器整批写出;同步日志器每条日志都会是一次系统调用
+    class FdSink : public Sink
+    {
+    public:
+        FdSink(const std::string &path, const SyncPolicy &policy = SyncPolicy(), bool uring = false)
+            : _path(path), _policy(policy), _unsynced(0), _last_sync(NowMs()), _errors(0), _uring_on(false), _pending_sync(false), _inflight(0)
+        {
+            wcm::CreateDir(wcm::Path(_path)); // 如果存储文件所在路径不存在则创建之
+            _fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (_fd < 0)
+            {
+                std::cerr << "打开日志文件失败: " << _path << ", " << strerror(errno) << std::endl;
+                abort();
+            }
+            if (uring)
+            {
+                _uring_on = _uring.Init(URING_ENTRIES);
+            }
+        }
+
+        ~FdSink()
+        {
+            Reap();
+            if (_unsynced > 0 && (_policy.bytes || _policy.interval || _policy.level != levels::OFF))
+            {
+                fdatasync(_fd); // 配置了刷盘策略时,关闭前把剩余数据刷盘
+            }
+            close(_fd);
+        }
+
+        void log(const char *data, size_t len) override
+        {
+            loglevel(data, len, levels::UNKNOW);
+        }
+
+        void loglevel(const char *data, size_t len, levels level) override
+        {
+            if (len == 0)
+            {
+                return;
+            }
+            bool sync = NeedSync(len, level);
+            if (_uring_on)
+            {
+                Submit(data, len, sync);
+                return;
+            }
+            WriteAll(data, len);
+            if (sync && fdatasync(_fd) < 0)
+            {
+                Error("fdatasync", errno);
+            }
+        }
+
+        // 等待已提交的异步写入完成
+        void flush() override
+        {
+            Reap();
+        }
+
+        // 还在进行的异步写入由内核完成,只直接写出data
+        void logcrash(const char *data, size_t len) override
+        {
+            WriteFd(_fd, data, len);
+        }
+
+        // 写入或刷盘失败的次数
+        size_t Errors()
+        {
+            return _errors;
+        }
+
+        // 是否正在使用io_uring
+        bool UringEnabled()
+        {
+            return _uring_on;
+        }
+
+    private:
+        static uint64_t NowMs()
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // 累计未刷盘的数据,判断这次写入后是否需要刷盘
+        bool NeedSync(size_t len, levels level)
+        {
+            _unsynced += len;
+            uint64_t now = 0;
+            bool sync = level >= _policy.level && level != levels::UNKNOW;
+            sync = sync || (_policy.bytes > 0 && _unsynced >= _policy.bytes);
+            if (!sync && _policy.interval > 0)
+            {
+                now = NowMs();
+                sync = now - _last_sync >= _policy.interval;
+            }
+            if (sync)
+            {
+                _unsynced = 0;
+                _last_sync = now ? now : NowMs();
+            }
+            return sync;
+        }
+
+        // 写完全部数据,处理被信号打断和部分写入
+        void WriteAll(const char *data, size_t len)
+        {
+            while (len > 0)
+            {
+                ssize_t ret = write(_fd, data, len);
+                if (ret < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    Error("write", errno);
+                    return;
+                }
+                data += ret;
+                len -= ret;
+            }
+        }
+
+        void Error(const char *op, int err)
+        {
+            ReportIoError(_errors, _path, op, err);
+        }
+
+        // 等待上一次提交的写入和刷盘完成,同一时刻只有一批数据在写,保证顺序
+        // 提交项已经交给内核,io_uring_enter失败不影响它完成:这时改为睡眠后直接查看完成队列,
+        // 仍按完成项报告的字节数只补写没写完的部分,不会重复写出;收齐后放弃异步写入
+        void Reap()
+        {
+            bool broken = false;
+            while (_inflight > 0)
+            {
+                struct io_uring_cqe cqe;
+                if (!_uring.PopCqe(cqe))
+                {
+                    if (broken)
+                    {
+                        usleep(URING_POLL_US);
+                    }
+                    else if (_uring.Submit(1) < 0 && errno != EBUSY)
+                    {
+                        Error("io_uring_enter", errno);
+                        broken = true;
+                    }
+                    continue;
+                }
+                --_inflight;
+                if (cqe.user_data == URING_WRITE)
+                {
+                    if (cqe.res < 0)
+                    {
+                        Error("write", -cqe.res);
+                    }
+                    else if ((size_t)cqe.res < _pending.size())
+                    {
+                        // 部分写入:链接在后面的刷盘会被取消,剩余部分同步写完再刷盘
+                        WriteAll(_pending.data() + cqe.res, _pending.size() - cqe.res);
+                        if (_pending_sync && fdatasync(_fd) < 0)
+                        {
+                            Error("fdatasync", errno);
+                        }
+                    }
+                }
+                else if (cqe.res < 0 && cqe.res != -ECANCELED)
+                {
+                    Error("fdatasync", -cqe.res);
+                }
+            }
+            if (broken)
+            {
+                _uring_on = false; // 队列不可用,之后同步写入
+            }
+        }
+
+        // 把数据拷贝到自己的缓冲区后提交写入,需要刷盘时在写入后链接一个fdatasync,不等待完成直接返回
+        void Submit(const char *data, size_t len, bool sync)
+        {
+            Reap();
+            if (!_uring_on)
+            {
+                WriteAll(data, len);
+                if (sync && fdatasync(_fd) < 0)
+                    Error("fdatasync", errno);
+                return;
+            }
+            _pending.assign(data, len);
+            _pending_sync = sync;
+            struct io_uring_sqe *sqe = _uring.GetSqe();
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = _fd;
+            sqe->addr = (uint64_t)_pending.data();
+            sqe->len = _pending.size();
+            sqe->off = (uint64_t)-1; // 使用当前文件位置,配合O_APPEND追加
+            sqe->user_data = URING_WRITE;
+            _inflight = 1;
+            if (sync)
+            {
+                sqe->flags |= IOSQE_IO_LINK; // 写入完成后才执行刷盘
+                sqe = _uring.GetSqe();
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = _fd;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                sqe->user_data = URING_SYNC;
+                _inflight = 2;
+            }
+            if (_uring.Submit() < 0)
+            {
+                // 提交失败,退回同步写入
+                _inflight = 0;
+                _uring_on = false;
+                WriteAll(data, len);
+                if (sync && fdatasync(_fd) < 0)
+                    Error("fdatasync", errno);
+            }
+        }
+
+    private:
+        enum
+        {
+            URING_ENTRIES = 8, // 同时最多一次写入加一次刷盘,队列不需要很深
+            URING_WRITE = 1,   // 完成项的user_data,区分写入和刷盘
+            URING_SYNC = 2,
+            URING_POLL_US = 1000 // io_uring_enter不可用时查看完成队列的间隔,微秒
+        };
+
+        std::string _path;    // 文件路径
+        int _fd;              // 以O_APPEND打开的文件描述符
+        SyncPolicy _policy;   // 刷盘策略
+        size_t _unsynced;     // 上次刷盘后写入的字节数
+        uint64_t _last_sync;  // 上次刷盘的时间,毫秒
+        size_t _errors;       // 写入或刷盘失败的次数
+        URing _uring;
+        bool _uring_on;       // 是否使用io_uring
+        std::string _pending; // 正在异步写入的数据,写完之前必须保持有效
+        bool _pending_sync;   // 正在写入的数据后面是否链接了刷盘
+        unsigned _inflight;   // 已提交还没完成的提交项个数
+    };
+
+    // 内存映射文件:按MMAP_EXTENT大小fallocate预分配并mmap,后台线程直接把数据拷贝进映射区,每批数据没有write系统调用
+    // 映射的是页缓存,进程崩溃后已经拷贝进去的日志依然会落盘;正常关闭或滚动时把文件截断到实际长度
+    // capacity为0时只写path一个文件,否则path作为基础文件名,按RollFileSink的规则滚动
+    class MmapFileSink : public Sink
+    {
+    public:
+        MmapFileSink(const std::string &path, size_t capacity = 0, size_t extent = MMAP_EXTENT)
+            : _path(path), _capacity(capacity), _cnt(0), _fd(-1), _map(nullptr), _map_off(0), _map_len(0), _size(0), _errors(0)
+        {
+            size_t page = sysconf(_SC_PAGESIZE);
+            _extent = (std::max(extent, page) + page - 1) / page * page; // 映射的偏移和长度都要按页对齐
+            Open();
+        }
+
+        ~MmapFileSink()
+        {
+            Close();
+        }
+
+        void log(const char *data, size_t len) override
+        {
+            if (_capacity > 0 && _size >= _capacity)
+            {
+                Close();
+                Open();
+            }
+            while (len > 0)
+            {
+                if (_size >= _map_off + _map_len && !Remap(_size))
+                {
+                    // 预分配或映射失败(比如磁盘满),退回普通写入,不丢日志
+                    ssize_t ret = pwrite(_fd, data, len, _size);
+                    if (ret <= 0)
+                    {
+                        if (ret < 0 && errno == EINTR)
+                            continue;
+                        Error("pwrite", errno);
+                        return;
+                    }
+                    data += ret;
+                    len -= ret;
+                    _size += ret;
+                    continue;
+                }
+                size_t n = std::min(len, _map_off + _map_len - _size);
+                memcpy(_map + (_size - _map_off), data, n);
+                data += n;
+                len -= n;
+                _size += n;
+            }
+        }
+
+        // 映射区中的数据已经在页缓存里,只需用pwrite接着写出data,与映射区看到的是同一份数据
+        void logcrash(const char *data, size_t len) override
+        {
+            while (len > 0 && _fd >= 0)
+            {
+                ssize_t ret = pwrite(_fd, data, len, _size);
+                if (ret <= 0)
+                {
+                    if (ret < 0 && errno == EINTR)
+                        continue;
+                    return;
+                }
+                data += ret;
+                len -= ret;
+                _size += ret;
+            }
+        }
+
+        // 预分配,映射或写入失败的次数
+        size_t Errors()
+        {
+            return _errors;
+        }
+
+    private:
+        void Open()
+        {
+            std::string file_name = _capacity > 0 ? RollFileName(_path, _cnt) : _path;
+            wcm::CreateDir(wcm::Path(file_name)); // 如果存储文件所在路径不存在则创建之
+            _fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (_fd < 0)
+            {
+                std::cerr << "打开日志文件失败: " << file_name << ", " << strerror(errno) << std::endl;
+                abort();
+            }
+            struct stat st;
+            fstat(_fd, &st);
+            _size = st.st_size;
+            _map = nullptr;
+            _map_off = _map_len = 0;
+            if (_size > 0 && Remap(_size - 1))
+            {
+                // 追加到已有文件:上次崩溃时没来得及截断的预分配空间全是0,只可能在最后一个映射区内,跳过它们
+                while (_size > _map_off && _map[_size - 1 - _map_off] == 0)
+                {
+                    --_size;
+                }
+            }
+        }
+
+        // 映射包含pos的那一段,文件长度不够时先预分配
+        bool Remap(size_t pos)
+        {
+            if (_map != nullptr)
+            {
+                munmap(_map, _map_len);
+                _map = nullptr;
+                _map_off = _map_len = 0;
+            }
+            size_t off = pos / _extent * _extent;
+            int ret = fallocate(_fd, 0, off, _extent);
+            if (ret < 0 && errno == EOPNOTSUPP)
+            {
+                ret = ftruncate(_fd, std::max<size_t>(off + _extent, FileSize())); // 文件系统不支持预分配,扩展成稀疏文件
+            }
+            if (ret < 0)
+            {
+                Error("fallocate", errno);
+                return false;
+            }
+            void *ptr = mmap(nullptr, _extent, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, off);
+            if (ptr == MAP_FAILED)
+            {
+                Error("mmap", errno);
+                return false;
+            }
+            _map = (char *)ptr;
+            _map_off = off;
+            _map_len = _extent;
+            return true;
+        }
+
+        // 解除映射并把文件截断到实际写入的长度
+        void Close()
+        {
+            if (_map != nullptr)
+            {
+                munmap(_map, _map_len);
+                _map = nullptr;
+            }
+            if (_fd >= 0)
+            {
+                if (ftruncate(_fd, _size) < 0)
+                {
+                    Error("ftruncate", errno);
+                }
+                close(_fd);
+                _fd = -1;
+            }
+        }
+
+        size_t FileSize()
+        {
+            struct stat st;
+            return fstat(_fd, &st) == 0 ? st.st_size : 0;
+        }
+
+        void Error(const char *op, int err)
+        {
+            ReportIoError(_errors, _path, op, err);
+        }
+
+    private:
+        std::string _path; // 文件路径,滚动时是基础文件名
+        size_t _capacity;  // 每个滚动文件的大小,0表示不滚动
+        size_t _extent;    // 每次预分配并映射的大小
+        size_t _cnt;       // 滚动文件名的序号
+        int _fd;
+        char *_map;        // 当前映射区
+        size_t _map_off;   // 映射区在文件中的偏移
+        size_t _map_len;   // 映射区长度
+        size_t _size;      // 文件中实际日志数据的长度,也是下一次写入的位置
+        size_t _errors;    // 出错次数
     };
 
     // 简单工厂
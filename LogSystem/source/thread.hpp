@@ -0,0 +1,114 @@
+// 线程身份: 内核线程id(与top,perf,gettid一致)和线程名
+// 每个线程第一次用到时取得一个ThreadInfo缓存在线程局部变量中,tid和名字都预先渲染成文本,格式化时直接memcpy
+// ThreadInfo生成后不再修改,也不释放: 异步日志器的记录只保存它的指针,线程退出后后台线程可能还要格式化它的记录,
+// 崩溃处理函数也要在信号处理函数中读取它;内容相同的ThreadInfo可以共用,所以按(tid, 名字)登记,
+// 内核复用退出线程的tid、线程池反复创建同名线程、线程改回用过的名字时都不再分配,总数不超过不同(tid, 名字)的个数
+#pragma once
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include "util.hpp"
+
+namespace wcm
+{
+#define THREAD_NAME_MAX 32    // 线程名最多保存的字节数,更长的被截断
+#define THREAD_COMM_MAX 16    // 内核中线程名的缓冲区大小(含'\0')
+
+    struct ThreadInfo
+    {
+        pid_t tid;                  // 内核线程id
+        uint8_t tid_len;            // tid_str的长度
+        uint8_t name_len;           // name的长度
+        char tid_str[20];           // tid的十进制文本,不以'\0'结尾
+        char name[THREAD_NAME_MAX]; // 线程名,不以'\0'结尾
+    };
+
+    // 填写线程身份,名字超过THREAD_NAME_MAX时截断
+    void FillThreadInfo(ThreadInfo &info, pid_t tid, const char *name, size_t len)
+    {
+        info.tid = tid;
+        info.tid_len = Utoa(info.tid_str, (uint64_t)tid);
+        info.name_len = std::min(len, (size_t)THREAD_NAME_MAX);
+        memcpy(info.name, name, info.name_len);
+    }
+
+    // 当前线程的ThreadInfo指针,没有生成过时为nullptr
+    const ThreadInfo *&ThreadSlot()
+    {
+        static thread_local const ThreadInfo *info = nullptr;
+        return info;
+    }
+
+    // 已经生成的ThreadInfo登记表,键是tid的字节加上名字;不释放,进程退出时其他线程可能还在打日志
+    struct ThreadTable
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, const ThreadInfo *> infos;
+    };
+
+    ThreadTable &Threads()
+    {
+        static ThreadTable *table = [] {
+            // fork时持有登记表的锁,子进程中锁一定是空闲的;
+            // 子进程中唯一的线程继承了父进程中这个线程的缓存,tid已经不对了,清掉后重新查找
+            pthread_atfork([] { Threads().mutex.lock(); }, [] { Threads().mutex.unlock(); }, [] {
+                Threads().mutex.unlock();
+                ThreadSlot() = nullptr;
+            });
+            return new ThreadTable;
+        }();
+        return *table;
+    }
+
+    // 查找或生成当前线程以name为名字的ThreadInfo并缓存起来
+    const ThreadInfo *NewThreadInfo(const char *name, size_t len)
+    {
+        pid_t tid = (pid_t)syscall(SYS_gettid);
+        len = std::min(len, (size_t)THREAD_NAME_MAX);
+        std::string key((const char *)&tid, sizeof(tid));
+        key.append(name, len);
+        ThreadTable &table = Threads();
+        const ThreadInfo *info;
+        {
+            std::unique_lock<std::mutex> lock(table.mutex);
+            const ThreadInfo *&slot = table.infos[key];
+            if (slot == nullptr)
+            {
+                ThreadInfo *created = new ThreadInfo;
+                FillThreadInfo(*created, tid, name, len);
+                slot = created;
+            }
+            info = slot;
+        }
+        ThreadSlot() = info;
+        return info;
+    }
+
+    // 当前线程的身份,第一次调用时从内核取tid,没有设置过名字时使用内核中的线程名(与top显示的一致)
+    const ThreadInfo *CurrentThread()
+    {
+        const ThreadInfo *info = ThreadSlot();
+        if (__builtin_expect(info != nullptr, 1))
+        {
+            return info;
+        }
+        char comm[THREAD_COMM_MAX] = {0};
+        pthread_getname_np(pthread_self(), comm, sizeof(comm));
+        return NewThreadInfo(comm, strlen(comm));
+    }
+
+    // 设置当前线程的名字,用%N输出;内核中的线程名也一起设置(只保留前15字节),top和perf中也能看到
+    // 已经写进异步日志器缓冲区的记录仍然显示原来的名字
+    void SetThreadName(const std::string &name)
+    {
+        pthread_setname_np(pthread_self(), name.substr(0, THREAD_COMM_MAX - 1).c_str());
+        NewThreadInfo(name.data(), name.size());
+    }
+}
@@ -0,0 +1,159 @@
+#pragma once
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace wcm
+{
+    // 最小化的io_uring封装,直接使用系统调用,不依赖liburing
+    // 只提供FdSink需要的功能:取提交项,提交,收割完成项,只能由一个线程使用
+    class URing
+    {
+    public:
+        URing()
+            : _fd(-1), _sq_ptr(nullptr), _cq_ptr(nullptr), _sqes(nullptr), _sq_size(0), _cq_size(0), _sqes_size(0), _to_submit(0)
+        {
+        }
+
+        ~URing()
+        {
+            Close();
+        }
+
+        URing(const URing &) = delete;
+        URing &operator=(const URing &) = delete;
+
+        // 创建队列,内核不支持或者不支持按当前文件位置读写(5.6以前)时返回false
+        bool Init(unsigned entries)
+        {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            _fd = syscall(__NR_io_uring_setup, entries, &p);
+            if (_fd < 0)
+            {
+                return false;
+            }
+            if (!(p.features & IORING_FEAT_RW_CUR_POS))
+            {
+                Close();
+                return false;
+            }
+            _sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            _cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+            if (p.features & IORING_FEAT_SINGLE_MMAP) // 提交队列和完成队列共用一次映射
+            {
+                _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+            }
+            _sq_ptr = Map(_sq_size, IORING_OFF_SQ_RING);
+            _cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? _sq_ptr : Map(_cq_size, IORING_OFF_CQ_RING);
+            _sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+            _sqes = (struct io_uring_sqe *)Map(_sqes_size, IORING_OFF_SQES);
+            if (_sq_ptr == nullptr || _cq_ptr == nullptr || _sqes == nullptr)
+            {
+                Close();
+                return false;
+            }
+            char *sq = (char *)_sq_ptr, *cq = (char *)_cq_ptr;
+            _sq_head = (unsigned *)(sq + p.sq_off.head);
+            _sq_tail = (unsigned *)(sq + p.sq_off.tail);
+            _sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+            _sq_entries = p.sq_entries;
+            _sq_array = (unsigned *)(sq + p.sq_off.array);
+            _cq_head = (unsigned *)(cq + p.cq_off.head);
+            _cq_tail = (unsigned *)(cq + p.cq_off.tail);
+            _cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+            _cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+            return true;
+        }
+
+        // 取一个清零的提交项,队列满时返回nullptr
+        struct io_uring_sqe *GetSqe()
+        {
+            unsigned tail = *_sq_tail;
+            unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+            if (tail + _to_submit - head >= _sq_entries)
+            {
+                return nullptr;
+            }
+            unsigned idx = (tail + _to_submit) & _sq_mask;
+            _sq_array[idx] = idx;
+            ++_to_submit;
+            memset(&_sqes[idx], 0, sizeof(struct io_uring_sqe));
+            return &_sqes[idx];
+        }
+
+        // 提交取出的所有提交项,wait不为0时阻塞到完成队列中至少有wait个完成项
+        int Submit(unsigned wait = 0)
+        {
+            __atomic_store_n(_sq_tail, *_sq_tail + _to_submit, __ATOMIC_RELEASE); // 提交项填好后才对内核可见
+            unsigned cnt = _to_submit;
+            _to_submit = 0;
+            int ret;
+            do
+            {
+                ret = syscall(__NR_io_uring_enter, _fd, cnt, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            } while (ret < 0 && errno == EINTR);
+            return ret;
+        }
+
+        // 取出一个完成项,没有时返回false
+        bool PopCqe(struct io_uring_cqe &cqe)
+        {
+            unsigned head = *_cq_head;
+            if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+            {
+                return false;
+            }
+            cqe = _cqes[head & _cq_mask];
+            __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE); // 归还完成项给内核
+            return true;
+        }
+
+        void Close()
+        {
+            if (_sqes != nullptr)
+                munmap(_sqes, _sqes_size);
+            if (_cq_ptr != nullptr && _cq_ptr != _sq_ptr)
+                munmap(_cq_ptr, _cq_size);
+            if (_sq_ptr != nullptr)
+                munmap(_sq_ptr, _sq_size);
+            if (_fd >= 0)
+                close(_fd);
+            _fd = -1;
+            _sq_ptr = _cq_ptr = nullptr;
+            _sqes = nullptr;
+        }
+
+    private:
+        void *Map(size_t size, off_t offset)
+        {
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, offset);
+            return ptr == MAP_FAILED ? nullptr : ptr;
+        }
+
+    private:
+        int _fd;
+        void *_sq_ptr;
+        void *_cq_ptr;
+        struct io_uring_sqe *_sqes;
+        size_t _sq_size;
+        size_t _cq_size;
+        size_t _sqes_size;
+        unsigned _to_submit; // 已取出还没提交的提交项个数
+        unsigned *_sq_head;
+        unsigned *_sq_tail;
+        unsigned _sq_mask;
+        unsigned _sq_entries;
+        unsigned *_sq_array;
+        unsigned *_cq_head;
+        unsigned *_cq_tail;
+        unsigned _cq_mask;
+        struct io_uring_cqe *_cqes;
+    };
+}
@@ -4,6 +4,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
 
 namespace wcm
 {
@@ -14,6 +17,72 @@ namespace wcm
         return time(nullptr);
     }
 
+    // 获取当前时间,精确到纳秒
+    struct timespec TimeSpec()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return ts;
+    }
+
+    // 单调时钟,纳秒,用于统计耗时和延迟
+    uint64_t SteadyNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+    }
+
+    // 将无符号整数转换成十进制文本写入out,返回写入的字节数,out至少要有20字节空间
+    // 每次处理两位数字查表,避免逐位除法
+    size_t Utoa(char *out, uint64_t val)
+    {
+        static const char digits[] =
+            "00010203040506070809"
+            "10111213141516171819"
+            "20212223242526272829"
+            "30313233343536373839"
+            "40414243444546474849"
+            "50515253545556575859"
+            "60616263646566676869"
+            "70717273747576777879"
+            "80818283848586878889"
+            "90919293949596979899";
+        char tmp[20];
+        char *p = tmp + sizeof(tmp); // 从后往前写
+        while (val >= 100)
+        {
+            size_t idx = (val % 100) * 2;
+            val /= 100;
+            *--p = digits[idx + 1];
+            *--p = digits[idx];
+        }
+        if (val >= 10)
+        {
+            size_t idx = val * 2;
+            *--p = digits[idx + 1];
+            *--p = digits[idx];
+        }
+        else
+        {
+            *--p = '0' + val;
+        }
+        size_t len = tmp + sizeof(tmp) - p;
+        memcpy(out, p, len);
+        return len;
+    }
+
+    // 将有符号整数转换成十进制文本写入out,返回写入的字节数,out至少要有20字节空间
+    size_t Itoa(char *out, int64_t val)
+    {
+        if (val >= 0)
+        {
+            return Utoa(out, val);
+        }
+        *out = '-';
+        return 1 + Utoa(out + 1, 0 - (uint64_t)val); // 先转无符号再取负,INT64_MIN也不会溢出
+    }
+
     // 判断文件是否存在
     bool Exisit(const std::string &file)
     {
@@ -27,7 +96,7 @@ namespace wcm
     // 获取文件所在目录 -- ./a/b/c/d.cpp -> ./a/b/c
     std::string Path(const std::string &path)
     {
-        int pos = path.find_last_of("/\\"); // Linux和Win的目录分隔符不一致
+        size_t pos = path.find_last_of("/\\"); // Linux和Win的目录分隔符不一致
         // 表示不存在'/'或'\',则表示当前所处目录为./
         if (pos == std::string::npos)
             return ".";
@@ -43,8 +112,8 @@ namespace wcm
         std::string cur_path = Path(path);
         if (Exisit(cur_path))
             return;
-        int pos = 0; // 查找到的'/','\'下标
-        int idx = 0; // 开始查找的下标
+        size_t pos = 0; // 查找到的'/','\'下标
+        size_t idx = 0; // 开始查找的下标
         while (idx < cur_path.size())
         {
             pos = cur_path.find_first_of("/\\", idx);
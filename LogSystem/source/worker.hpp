@@ -0,0 +1,201 @@
+#pragma once
+#include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "sink.hpp"
+#include "level.hpp"
+#include "util.hpp"
+
+// 每个落地方式独立的后台输出线程
+// 后台线程格式化好的一批日志放在引用计数的共享缓冲区中,只读地交给所有落地方式的线程并行输出,最后一个用完时回收
+namespace wcm
+{
+#define SINK_QUEUE_MAX 64 * 1024 * 1024 // 每个落地方式最多积压的字节数,超过后后台线程等待它追上
+#define POOL_KEEP 16                    // 缓冲池最多保留的空闲缓冲区个数
+
+    using SharedBuffer = std::shared_ptr<std::string>;
+
+    // 共享缓冲区池,引用计数归零时缓冲区回到池中,容量保留下来重复使用
+    class BufferPool : public std::enable_shared_from_this<BufferPool>
+    {
+    public:
+        using ptr = std::shared_ptr<BufferPool>;
+
+        ~BufferPool()
+        {
+            for (auto e : _free)
+            {
+                delete e;
+            }
+        }
+
+        // 取一个空的缓冲区,删除器持有池的引用,缓冲区晚于日志器释放也是安全的
+        SharedBuffer Get()
+        {
+            std::string *buff = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (!_free.empty())
+                {
+                    buff = _free.back();
+                    _free.pop_back();
+                }
+            }
+            if (buff == nullptr)
+            {
+                buff = new std::string();
+            }
+            buff->clear();
+            BufferPool::ptr self = shared_from_this();
+            return SharedBuffer(buff, [self](std::string *p) { self->Put(p); });
+        }
+
+    private:
+        void Put(std::string *buff)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_free.size() < POOL_KEEP)
+            {
+                _free.push_back(buff);
+                return;
+            }
+            lock.unlock();
+            delete buff;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::vector<std::string *> _free; // 空闲缓冲区
+    };
+
+    // 一个落地方式的积压情况
+    struct SinkStat
+    {
+        size_t pending_batches; // 还没输出完的批数,包括正在输出的
+        size_t pending_bytes;   // 还没输出完的字节数
+        size_t written_bytes;   // 已经输出的字节数
+        uint64_t lag;           // 最早一批还没输出完的数据已经等待的时间,纳秒,没有积压时为0
+        uint64_t max_lag;       // 一批数据从交给该落地方式到输出完成的最长时间,纳秒
+    };
+
+    // 单个落地方式的输出线程
+    class SinkWorker
+    {
+    public:
+        using ptr = std::shared_ptr<SinkWorker>;
+        SinkWorker(const Sink::ptr &sink)
+            : _sink(sink), _stop(false), _pending_bytes(0), _written_bytes(0), _max_lag(0)
+        {
+            _thread = std::thread(&SinkWorker::ThreadRoutine, this);
+        }
+
+        // 输出完所有积压的数据再退出
+        ~SinkWorker()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+                _con_cv.notify_all();
+            }
+            _thread.join();
+        }
+
+        // 交给该落地方式一批数据,积压超过SINK_QUEUE_MAX时等待
+        void Push(const SharedBuffer &data, const BatchInfo &info)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _pro_cv.wait(lock, [&]() { return _queue.empty() || _pending_bytes + data->size() <= SINK_QUEUE_MAX; });
+            _queue.push_back(Batch{data, info, SteadyNs()});
+            _pending_bytes += data->size();
+            _con_cv.notify_one();
+        }
+
+        // 等积压的数据全部输出完,再让落地方式写出用户态缓冲;队列为空时输出线程不会调用落地方式,持有锁期间可以安全调用
+        void Flush()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _pro_cv.wait(lock, [&]() { return _queue.empty(); });
+            _sink->flush();
+        }
+
+        // 致命信号时调用(见crash.hpp):不加锁地把积压的数据直接写给落地方式,队首那一批可能已经输出了一部分
+        void CrashDrain()
+        {
+            _sink->logcrash(nullptr, 0);
+            for (const auto &e : _queue)
+            {
+                _sink->logcrash(e.data->data(), e.data->size());
+            }
+        }
+
+        SinkStat Stat()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            SinkStat st;
+            st.pending_batches = _queue.size();
+            st.pending_bytes = _pending_bytes;
+            st.written_bytes = _written_bytes;
+            st.lag = _queue.empty() ? 0 : SteadyNs() - _queue.front().time;
+            st.max_lag = _max_lag;
+            return st;
+        }
+
+    private:
+        struct Batch
+        {
+            SharedBuffer data; // 共享的只读数据
+            BatchInfo info;    // 这批数据的最高等级和各段统计
+            uint64_t time;     // 交给该落地方式的时间
+        };
+
+        // 一次输出一批,输出完才出队,积压统计包含正在输出的那一批
+        void ThreadRoutine()
+        {
+            while (true)
+            {
+                Batch batch;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _con_cv.wait(lock, [&]() { return _stop || !_queue.empty(); });
+                    if (_queue.empty())
+                    {
+                        break;
+                    }
+                    // 队首要留到输出完才出队(Flush()等队列为空,CrashDrain()还要读它的数据),只把用不到的统计移出来,不拷贝
+                    Batch &front = _queue.front();
+                    batch.data = front.data;
+                    batch.info = std::move(front.info);
+                    batch.time = front.time;
+                }
+                _sink->logbatch(batch.data->data(), batch.data->size(), batch.info);
+                uint64_t lag = SteadyNs() - batch.time;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _queue.pop_front();
+                    _pending_bytes -= batch.data->size();
+                    _written_bytes += batch.data->size();
+                    _max_lag = std::max(_max_lag, lag);
+                    _pro_cv.notify_all();
+                }
+            }
+        }
+
+    private:
+        Sink::ptr _sink;
+        bool _stop;
+        std::deque<Batch> _queue; // 积压的数据,队首是正在输出的一批
+        size_t _pending_bytes;
+        size_t _written_bytes;
+        uint64_t _max_lag;
+        std::mutex _mutex;
+        std::condition_variable _pro_cv; // 后台线程等待积压减少
+        std::condition_variable _con_cv; // 输出线程等待新数据
+        std::thread _thread;             // 放在最后,其他成员初始化完才启动
+    };
+}
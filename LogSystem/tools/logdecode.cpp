@@ -0,0 +1,82 @@
+#include "../source/log.hpp"
+#include <sys/mman.h>
+
+// 把BinFileSink写出的二进制日志还原成文本输出到标准输出
+// 用法: logdecode 文件...   多个文件按参数顺序输出,滚动文件可以直接用通配符按名字顺序传入
+// 遇到不完整(进程崩溃)或损坏的条目时提示,再从后面的下一个文件头(之后追加写入的数据)继续解码,最后返回1
+
+#define OUT_CHUNK 1024 * 1024 // 输出缓冲攒够这么多字节写一次
+
+// 解码一个文件,成功返回true
+bool DecodeFile(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "打开文件失败: %s, %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+    const char *data = (const char *)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "映射文件失败: %s, %s\n", path, strerror(errno));
+        return false;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    const char *end = data + st.st_size;
+    if (st.st_size < BINLOG_MAGIC_LEN || memcmp(data, BINLOG_MAGIC, BINLOG_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "不是二进制日志文件: %s\n", path);
+        munmap((void *)data, st.st_size);
+        return false;
+    }
+
+    wcm::BinDecoder decoder;
+    std::string out;
+    const char *p = data;
+    bool ok = true;
+    while (p < end)
+    {
+        if (!decoder.Next(p, end, out))
+        {
+            ok = false;
+            const char *next = (const char *)memmem(p + 1, end - p - 1, BINLOG_MAGIC, BINLOG_MAGIC_LEN);
+            size_t skip = (next != nullptr ? next : end) - p;
+            fprintf(stderr, "%s: 第%zu字节处的数据不完整或已损坏,跳过%zu字节\n", path, (size_t)(p - data), skip);
+            p += skip;
+            continue;
+        }
+        if (out.size() >= OUT_CHUNK)
+        {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    munmap((void *)data, st.st_size);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "用法: %s 二进制日志文件...\n", argv[0]);
+        return 2;
+    }
+    bool ok = true;
+    for (int i = 1; i < argc; ++i)
+    {
+        ok = DecodeFile(argv[i]) && ok;
+    }
+    fflush(stdout);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+#include "../source/log.hpp"
+#include <getopt.h>
+
+// 按时间范围和等级查询开启了索引的文本日志文件,只读取索引中可能匹配的段(见index.hpp)
+// 用法: logquery [-f 开始时间] [-t 结束时间] [-l 最低等级] [-v] 日志文件...
+//   时间格式: "2024-08-04 14:03[:05]",只写"14:03[:05]"表示今天,按本地时区解释;或者"@秒级时间戳"
+//   结束时间只精确到分钟时包含这一分钟,比如-t 14:05包含14:05:59
+//   -v 在标准错误输出读取的字节数和段数
+// 结果以段为单位,段里可能有范围外或等级更低的相邻日志,需要精确到行时再交给grep
+// 参数中以.idx结尾的文件会被忽略,滚动文件可以直接用通配符传入;没有索引的文件整个输出
+
+#define READ_CHUNK 1024 * 1024 // 每次读取的最大字节数
+
+// 解析时间,返回纳秒;end为true时取这一秒(没有写秒时是这一分钟)的最后一纳秒
+bool ParseTime(const char *str, bool end, int64_t &ns)
+{
+    if (str[0] == '@')
+    {
+        char *e;
+        ns = strtoll(str + 1, &e, 10) * 1000000000l + (end ? 999999999l : 0);
+        return *e == '\0';
+    }
+    struct tm tm;
+    time_t now = time(nullptr);
+    localtime_r(&now, &tm);
+    tm.tm_sec = 0;
+    const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%H:%M:%S", "%H:%M"};
+    for (const char *fmt : formats)
+    {
+        struct tm t = tm;
+        const char *e = strptime(str, fmt, &t);
+        if (e == nullptr || *e != '\0')
+        {
+            continue;
+        }
+        t.tm_isdst = -1;
+        bool has_sec = strstr(fmt, "%S") != nullptr;
+        ns = (int64_t)mktime(&t) * 1000000000l;
+        if (end)
+        {
+            ns += (has_sec ? 1000000000l : 60000000000l) - 1;
+        }
+        return true;
+    }
+    return false;
+}
+
+// 解析等级名称,返回该等级及以上的位图
+bool ParseLevel(const char *str, uint32_t &mask)
+{
+    for (int l = wcm::levels::DEBUG; l < wcm::levels::OFF; ++l)
+    {
+        if (strcasecmp(str, wcm::LevelStr((wcm::levels)l)) == 0)
+        {
+            mask = ~((1u << l) - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 查询一个文件,成功返回true
+bool QueryFile(const char *path, int64_t from, int64_t to, uint32_t mask, bool verbose, std::string &buf)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "打开文件失败: %s, %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    std::vector<wcm::IndexEntry> entries;
+    if (!wcm::LoadIndex(path, st.st_size, entries))
+    {
+        fprintf(stderr, "%s: 没有索引,输出整个文件\n", path);
+    }
+    std::vector<wcm::IndexRange> ranges = wcm::QueryIndex(entries, st.st_size, from, to, mask);
+    size_t total = 0;
+    bool ok = true;
+    for (const auto &r : ranges)
+    {
+        uint64_t off = r.offset, left = r.len;
+        while (left > 0 && ok)
+        {
+            size_t n = std::min(left, (uint64_t)READ_CHUNK);
+            buf.resize(n);
+            ssize_t ret = pread(fd, &buf[0], n, off);
+            if (ret <= 0)
+            {
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                fprintf(stderr, "读取文件失败: %s, %s\n", path, ret < 0 ? strerror(errno) : "文件被截断");
+                ok = false;
+                break;
+            }
+            fwrite(buf.data(), 1, ret, stdout);
+            off += ret;
+            left -= ret;
+            total += ret;
+        }
+    }
+    close(fd);
+    if (verbose)
+    {
+        fprintf(stderr, "%s: 索引%zu段, 读取%zu段 %zu/%zu字节\n", path, entries.size(), ranges.size(), total, (size_t)st.st_size);
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    uint32_t mask = ~0u;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t:l:v")) != -1)
+    {
+        bool ok = true;
+        switch (opt)
+        {
+        case 'f':
+            ok = ParseTime(optarg, false, from);
+            break;
+        case 't':
+            ok = ParseTime(optarg, true, to);
+            break;
+        case 'l':
+            ok = ParseLevel(optarg, mask);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            ok = false;
+        }
+        if (!ok)
+        {
+            if (opt != '?')
+                fprintf(stderr, "参数格式错误: -%c %s\n", opt, optarg);
+            optind = argc; // 走到下面的用法提示
+            break;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "用法: %s [-f 开始时间] [-t 结束时间] [-l 最低等级] [-v] 日志文件...\n", argv[0]);
+        return 2;
+    }
+    bool ok = true;
+    std::string buf;
+    size_t suffix = strlen(INDEX_SUFFIX);
+    for (int i = optind; i < argc; ++i)
+    {
+        size_t len = strlen(argv[i]);
+        if (len >= suffix && strcmp(argv[i] + len - suffix, INDEX_SUFFIX) == 0)
+        {
+            continue;
+        }
+        ok = QueryFile(argv[i], from, to, mask, verbose, buf) && ok;
+    }
+    fflush(stdout);
+    return ok ? 0 : 1;
+}